@@ -1,6 +1,8 @@
 // POSIX 확장 기능을 활성화 (struct timespec, utimensat, st_atim/st_mtim 등을 사용하기 위함)
 #define _XOPEN_SOURCE 700
 #define _POSIX_C_SOURCE 200809L
+// copy_file_range, getopt_long 등 GNU 확장 (커널 복사 오프로드)
+#define _GNU_SOURCE
 
 #include <stdio.h>    // printf, fprintf, perror
 #include <stdlib.h>   // exit, EXIT_FAILURE
@@ -13,13 +15,638 @@
 #include <fcntl.h>    // open, O_RDONLY, O_WRONLY, O_CREAT, O_TRUNC, AT_FDCWD
 #include <limits.h>   // PATH_MAX (경로 최대 길이)
 #include <time.h>     // struct timespec (시간 구조체)
+#include <pthread.h>  // pthread_create, pthread_mutex_t (-j 병렬 복사)
+#include <getopt.h>   // getopt_long (--reflink 옵션)
+#include <sys/ioctl.h> // ioctl (FICLONE)
+#if defined(__linux__)
+#include <linux/fs.h>     // FICLONE (btrfs/xfs 리플링크)
+#include <sys/sendfile.h> // sendfile
+#include <sys/mman.h>     // mmap (io_uring 큐 매핑)
+#include <sys/syscall.h>  // io_uring_setup/enter/register 시스템 콜 번호
+#include <sys/uio.h>      // struct iovec (고정 버퍼 등록)
+#include <linux/io_uring.h>
+#endif
 
 #define BUFFER_SIZE 4096 // 파일 복사 시 사용할 버퍼 크기
+#define MAX_JOBS 256     // -j 로 지정할 수 있는 최대 스레드 수
+#define MAX_QUEUE_DEPTH 256 // -q 로 지정할 수 있는 최대 io_uring 큐 깊이
 
 // 전역 플래그 (옵션 처리)
 int recursive_flag = 0; // -r : 재귀적 복사 플래그
 int verbose_flag = 0;   // -v : 상세 출력 플래그
 int preserve_flag = 0;  // -p : 권한 및 시간 보존 플래그
+int jobs = 1;           // -j N : 디렉토리 복사에 사용할 스레드 수 (1이면 기존 직렬 복사)
+int queue_depth = 0;    // -q N : 커널 복사 대신 io_uring 으로 복사하며 동시에 진행할 버퍼 수 (0이면 사용 안 함)
+
+// --reflink=WHEN : 리플링크(FICLONE) 사용 여부
+enum { REFLINK_NEVER, REFLINK_AUTO, REFLINK_ALWAYS };
+int reflink_mode = REFLINK_AUTO;
+
+/**
+ * 대상 경로에 원본의 권한과 타임스탬프를 적용하는 함수 (-p 옵션 처리).
+ * @param path 대상 경로
+ * @param mode 원본의 권한
+ * @param atime 원본의 접근 시간
+ * @param mtime 원본의 수정 시간
+ */
+void preserve_metadata(const char *path, mode_t mode, struct timespec atime, struct timespec mtime) {
+    // 권한 보존: 파일 경로를 사용하여 권한 설정
+    if (chmod(path, mode) == -1) {
+        perror("chmod destination");
+    }
+
+    // 타임스탬프 보존: 접근 시간(atime)과 수정 시간(mtime) 설정
+    struct timespec times[2];
+    times[0] = atime; // 접근 시간 (Access Time)
+    times[1] = mtime; // 수정 시간 (Modification Time)
+
+    // utimensat 시스템 콜을 사용하여 시간 정보 업데이트
+    if (utimensat(AT_FDCWD, path, times, 0) == -1) {
+        perror("utimensat destination");
+    }
+}
+
+// 파일 내용 복사 방법. 앞의 것일수록 빠르며, 지원되지 않으면 다음 방법으로 내려간다.
+// METHOD_URING 은 -q 로 고른 경우에만 쓰며, 쓸 수 없으면 METHOD_RW 로 내려간다.
+enum copy_method { METHOD_CLONE, METHOD_RANGE, METHOD_SENDFILE, METHOD_URING, METHOD_RW };
+
+#define FS_CACHE_SIZE 16   // 복사 방법을 기억할 (원본, 대상) 파일 시스템 쌍의 수
+#define COPY_CHUNK (1 << 30) // copy_file_range/sendfile 한 번에 요청할 최대 바이트 수
+
+// (원본 장치, 대상 장치) 쌍마다 사용할 수 있는 가장 빠른 복사 방법을 기억하는 캐시
+struct fs_entry {
+    dev_t src_dev;
+    dev_t dest_dev;
+    enum copy_method method;
+};
+
+struct fs_entry fs_cache[FS_CACHE_SIZE];
+int fs_count = 0; // 지금까지 기록한 항목 수 (가득 차면 오래된 것부터 덮어씀)
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER; // -j 작업 스레드들이 공유
+
+/**
+ * 파일 시스템 쌍에 캐시된 복사 방법을 찾는 함수.
+ * @param src_dev 원본 파일의 장치 번호
+ * @param dest_dev 대상 파일의 장치 번호
+ * @return 캐시된 방법, 없으면 METHOD_CLONE (가장 빠른 방법부터 시도)
+ */
+enum copy_method fs_method_get(dev_t src_dev, dev_t dest_dev) {
+    enum copy_method method = METHOD_CLONE;
+    int i, n;
+
+    pthread_mutex_lock(&fs_lock);
+    n = fs_count < FS_CACHE_SIZE ? fs_count : FS_CACHE_SIZE;
+    for (i = 0; i < n; i++) {
+        if (fs_cache[i].src_dev == src_dev && fs_cache[i].dest_dev == dest_dev) {
+            method = fs_cache[i].method;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return method;
+}
+
+/**
+ * 파일 시스템 쌍이 지원하지 않는 방법을 건너뛰도록 캐시를 갱신하는 함수.
+ * 다른 스레드가 이미 더 느린 방법으로 내려갔다면 그대로 둔다.
+ * @param src_dev 원본 파일의 장치 번호
+ * @param dest_dev 대상 파일의 장치 번호
+ * @param method 이 쌍에서 동작한 방법
+ */
+void fs_method_set(dev_t src_dev, dev_t dest_dev, enum copy_method method) {
+    int i, n;
+
+    pthread_mutex_lock(&fs_lock);
+    n = fs_count < FS_CACHE_SIZE ? fs_count : FS_CACHE_SIZE;
+    for (i = 0; i < n; i++) {
+        if (fs_cache[i].src_dev == src_dev && fs_cache[i].dest_dev == dest_dev) {
+            if (method > fs_cache[i].method) {
+                fs_cache[i].method = method;
+            }
+            pthread_mutex_unlock(&fs_lock);
+            return;
+        }
+    }
+    i = fs_count++ % FS_CACHE_SIZE;
+    fs_cache[i].src_dev = src_dev;
+    fs_cache[i].dest_dev = dest_dev;
+    fs_cache[i].method = method;
+    pthread_mutex_unlock(&fs_lock);
+}
+
+#if defined(__linux__)
+/**
+ * 오류 번호가 "이 파일 시스템에서는 이 방법을 쓸 수 없음"을 뜻하는지 확인하는 함수.
+ * @param err errno 값
+ * @return 다음 방법으로 내려가야 하면 1, 실제 입출력 오류면 0
+ */
+int unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTSUP || err == ENOSYS || err == EXDEV ||
+           err == EINVAL || err == ENOTTY || err == EBADF;
+}
+#endif
+
+#if defined(__linux__)
+// apue.3e/lib/uringcopy.c 의 uring_copy 와 같은 방식 (xcopy 는 libapue 없이 단독으로 빌드하므로 따로 둠)
+// 짧은 읽기는 버퍼 전체를, 짧은 쓰기는 남은 부분만 pread/pwrite 로 다시 처리하는 것도 같다
+#define URING_BSZ (128 * 1024) // io_uring 고정 버퍼 하나의 크기
+
+// 직접 매핑한 io_uring 의 제출 큐(SQ)와 완료 큐(CQ)
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned tail; // 다음 SQE 를 넣을 위치
+    unsigned nsqe; // 넣었지만 아직 제출하지 않은 SQE 수
+};
+
+/**
+ * entries 개의 요청을 담을 수 있는 io_uring 을 만들고 큐를 매핑하는 함수.
+ * @param ur 초기화할 링
+ * @param entries 제출 큐 크기
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int uring_init(struct uring *ur, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(ur, 0, sizeof(*ur));
+    memset(&p, 0, sizeof(p));
+    if ((ur->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return -1;
+    }
+    ur->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        // SQ 와 CQ 가 한 번의 mmap 을 공유
+        if (ur->cq_len > ur->sq_len) ur->sq_len = ur->cq_len;
+        ur->cq_len = 0;
+    }
+    ur->sq_ptr = mmap(NULL, ur->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    ur->cq_ptr = ur->cq_len == 0 ? ur->sq_ptr :
+                 mmap(NULL, ur->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+    ur->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sq_ptr == MAP_FAILED || ur->cq_ptr == MAP_FAILED || ur->sqes == MAP_FAILED) {
+        if (ur->sqes != MAP_FAILED) munmap(ur->sqes, ur->sqes_len);
+        if (ur->cq_len != 0 && ur->cq_ptr != MAP_FAILED) munmap(ur->cq_ptr, ur->cq_len);
+        if (ur->sq_ptr != MAP_FAILED) munmap(ur->sq_ptr, ur->sq_len);
+        close(ur->fd);
+        return -1;
+    }
+
+    sq = ur->sq_ptr;
+    cq = ur->cq_ptr;
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ur->tail = *ur->sq_tail;
+    return 0;
+}
+
+/**
+ * io_uring 의 매핑을 풀고 닫는 함수. 처리 중인 요청은 커널이 취소한다.
+ * @param ur 닫을 링
+ */
+void uring_free(struct uring *ur) {
+    munmap(ur->sqes, ur->sqes_len);
+    if (ur->cq_len != 0) munmap(ur->cq_ptr, ur->cq_len);
+    munmap(ur->sq_ptr, ur->sq_len);
+    close(ur->fd);
+}
+
+/**
+ * 고정 버퍼 하나의 읽기 또는 쓰기 요청을 제출 큐에 넣는 함수.
+ * 한 번에 큐 크기 이상 넣지 않고, 커널이 uring_wait 때마다 모두 가져가므로 자리는 항상 있다.
+ * @param op IORING_OP_READ_FIXED 또는 IORING_OP_WRITE_FIXED
+ * @param buf_index 등록된 버퍼 번호
+ * @param flags IOSQE_IO_LINK 이면 다음 요청은 이 요청이 끝난 뒤에 시작
+ * @param data 완료 시 돌려받을 값
+ */
+void uring_prep(struct uring *ur, int op, int fd, int buf_index, char *buf, size_t len, off_t off, int flags, unsigned long long data) {
+    unsigned i = ur->tail++ & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->buf_index = buf_index;
+    sqe->user_data = data;
+    ur->sq_array[i] = i;
+    ur->nsqe++;
+}
+
+/**
+ * 넣어 둔 요청을 제출하고 하나 이상 완료될 때까지 기다리는 함수.
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int uring_wait(struct uring *ur) {
+    int n;
+
+    __atomic_store_n(ur->sq_tail, ur->tail, __ATOMIC_RELEASE);
+    while ((n = syscall(__NR_io_uring_enter, ur->fd, ur->nsqe, 1, IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -1;
+        }
+    }
+    ur->nsqe -= n;
+    return 0;
+}
+
+/**
+ * 버퍼 하나 분량을 pread/pwrite 로 다시 복사하는 함수 (io_uring 읽기가 짧게 끝난 드문 경우).
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int copy_slot(int src_fd, int dest_fd, char *buf, size_t len, off_t off) {
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < len; done += n) {
+        if ((n = pread(src_fd, buf + done, len - done, off + done)) == -1) return -1;
+        if (n == 0) break; // 파일이 줄어든 경우
+    }
+    len = done;
+    for (done = 0; done < len; done += n) {
+        if ((n = pwrite(dest_fd, buf + done, len - done, off + done)) == -1) return -1;
+    }
+    return 0;
+}
+
+/**
+ * io_uring 으로 원본의 off 부터 len 바이트를 대상의 같은 오프셋에 복사하는 함수.
+ * 커널에 한 번 등록한 고정 버퍼 depth 개를 돌려 쓰며, 버퍼마다 읽기 요청에 쓰기 요청을
+ * 연결(IOSQE_IO_LINK)해 함께 넣으므로 데이터가 사용자 공간 코드를 거치지 않고
+ * 항상 depth 개의 읽기/쓰기가 진행 중이다.
+ * @param src_fd 원본 파일 디스크립터
+ * @param dest_fd 대상 파일 디스크립터
+ * @param off 복사를 시작할 오프셋
+ * @param len 복사할 바이트 수
+ * @param depth 동시에 진행할 버퍼 수 (큐 깊이)
+ * @return 성공 시 0, 입출력 오류 시 -1 (errno 설정), io_uring 을 쓸 수 없으면 -2 (아무것도 복사하지 않음)
+ */
+int uring_copy(int src_fd, int dest_fd, off_t off, off_t len, int depth) {
+    struct uring ur;
+    struct iovec *iov = NULL;
+    off_t *slot_off = NULL;   // 버퍼마다 복사 중인 오프셋
+    size_t *slot_len = NULL;  // 버퍼마다 요청한 길이
+    int *read_res = NULL;     // 버퍼마다 읽기 요청의 결과
+    int *free_slots = NULL;
+    char *bufs = NULL, *buf;
+    off_t next, end = off + len;
+    unsigned head, tail;
+    int i, nfree, inflight = 0, err = 0, result = -2;
+    struct io_uring_cqe *cqe;
+
+    if (uring_init(&ur, 2 * depth) == -1) {
+        return -2;
+    }
+    if (posix_memalign((void **)&bufs, 4096, (size_t)depth * URING_BSZ) != 0) {
+        bufs = NULL;
+        goto out;
+    }
+    iov = malloc(depth * sizeof(*iov));
+    slot_off = malloc(depth * sizeof(*slot_off));
+    slot_len = malloc(depth * sizeof(*slot_len));
+    read_res = malloc(depth * sizeof(*read_res));
+    free_slots = malloc(depth * sizeof(*free_slots));
+    if (!iov || !slot_off || !slot_len || !read_res || !free_slots) {
+        goto out;
+    }
+    for (i = 0; i < depth; i++) {
+        iov[i].iov_base = bufs + (size_t)i * URING_BSZ;
+        iov[i].iov_len = URING_BSZ;
+        free_slots[i] = depth - 1 - i;
+    }
+    // 버퍼를 한 번만 등록해 두면 요청마다 커널이 페이지를 고정하지 않아도 됨
+    if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_BUFFERS, iov, depth) == -1) {
+        goto out; // RLIMIT_MEMLOCK 초과 등
+    }
+
+    // user_data = 버퍼 번호 * 2 (+1 이면 쓰기)
+    nfree = depth;
+    for (next = off; ; ) {
+        while (err == 0 && nfree > 0 && next < end) {
+            i = free_slots[--nfree];
+            buf = iov[i].iov_base;
+            slot_off[i] = next;
+            slot_len[i] = end - next < URING_BSZ ? (size_t)(end - next) : URING_BSZ;
+            next += slot_len[i];
+            uring_prep(&ur, IORING_OP_READ_FIXED, src_fd, i, buf, slot_len[i], slot_off[i], IOSQE_IO_LINK, 2 * i);
+            uring_prep(&ur, IORING_OP_WRITE_FIXED, dest_fd, i, buf, slot_len[i], slot_off[i], 0, 2 * i + 1);
+            inflight++;
+        }
+        if (inflight == 0) {
+            break;
+        }
+        if (uring_wait(&ur) == -1) {
+            err = errno;
+            break;
+        }
+
+        head = *ur.cq_head;
+        tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &ur.cqes[head & *ur.cq_mask];
+            i = cqe->user_data / 2;
+            buf = iov[i].iov_base;
+            if ((cqe->user_data & 1) == 0) {
+                read_res[i] = cqe->res; // 이어서 쓰기 완료가 옴
+                continue;
+            }
+            if (cqe->res == -ECANCELED) {
+                // 읽기가 실패했거나 짧게 끝나 연결된 쓰기가 취소됨
+                if (read_res[i] < 0) {
+                    if (err == 0) err = -read_res[i];
+                } else if (copy_slot(src_fd, dest_fd, buf, slot_len[i], slot_off[i]) == -1 && err == 0) {
+                    err = errno;
+                }
+            } else if (cqe->res < 0) {
+                if (err == 0) err = -cqe->res;
+            } else if ((size_t)cqe->res < slot_len[i]) {
+                // 짧은 쓰기: 남은 부분만 다시 씀 (버퍼에는 이미 읽은 데이터가 있음)
+                ssize_t w;
+                size_t done;
+                for (done = cqe->res; done < slot_len[i]; done += w) {
+                    if ((w = pwrite(dest_fd, buf + done, slot_len[i] - done, slot_off[i] + done)) == -1) {
+                        if (err == 0) err = errno;
+                        break;
+                    }
+                }
+            }
+            free_slots[nfree++] = i;
+            inflight--;
+        }
+        __atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+    }
+    result = 0;
+    if (err != 0) {
+        errno = err;
+        result = -1;
+    }
+    // uring_wait 가 실패했다면 커널이 아직 버퍼에 읽고 있을 수 있음
+    // 링을 닫으면 요청이 취소되지만 끝날 때까지 기다리지는 않으므로 버퍼를 해제하지 않는다
+    if (inflight > 0) {
+        bufs = NULL;
+    }
+
+out:
+    uring_free(&ur);
+    free(iov);
+    free(slot_off);
+    free(slot_len);
+    free(read_res);
+    free(free_slots);
+    free(bufs);
+    return result;
+}
+#endif
+
+/**
+ * 한 번에 요청할 바이트 수를 구하는 함수.
+ * @param len 남은 바이트 수, 음수면 파일 끝까지
+ * @param max 한 번에 요청할 최대 바이트 수
+ * @return len 과 max 중 작은 값
+ */
+size_t chunk_size(off_t len, size_t max) {
+    return (len < 0 || (off_t)max < len) ? max : (size_t)len;
+}
+
+/**
+ * 두 파일의 현재 오프셋에서 len 바이트를 복사하는 함수.
+ * copy_file_range, sendfile, read/write 순서로 시도하며, 앞 단계가 중간까지 복사했다면 이어서 복사한다.
+ * -q 로 io_uring 을 고른 경우(METHOD_URING)에는 io_uring 으로 복사하고, 쓸 수 없으면 read/write 로 복사한다.
+ * @param src_fd 원본 파일 디스크립터
+ * @param dest_fd 대상 파일 디스크립터
+ * @param len 복사할 바이트 수, 음수면 파일 끝까지
+ * @param method 시도할 첫 방법, 지원되지 않는 방법을 만나면 다음 방법으로 갱신됨
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int copy_range(int src_fd, int dest_fd, off_t len, enum copy_method *method) {
+    ssize_t n = 0, w;
+    char buffer[BUFFER_SIZE];
+    char *p;
+
+#if defined(__linux__)
+    // copy_file_range: 커널 안에서 복사 (NFS 등은 서버 쪽 복사로 처리)
+    if (*method == METHOD_RANGE) {
+        while (len != 0 && (n = copy_file_range(src_fd, NULL, dest_fd, NULL, chunk_size(len, COPY_CHUNK), 0)) > 0) {
+            if (len > 0) len -= n;
+        }
+        if (len == 0 || n == 0) {
+            return 0;
+        }
+        if (!unsupported(errno)) {
+            return -1;
+        }
+        *method = METHOD_SENDFILE;
+    }
+
+    // sendfile: 페이지 캐시에서 바로 쓰므로 사용자 버퍼를 거치지 않음
+    if (*method == METHOD_SENDFILE) {
+        while (len != 0 && (n = sendfile(dest_fd, src_fd, NULL, chunk_size(len, COPY_CHUNK))) > 0) {
+            if (len > 0) len -= n;
+        }
+        if (len == 0 || n == 0) {
+            return 0;
+        }
+        if (!unsupported(errno)) {
+            return -1;
+        }
+        *method = METHOD_RW;
+    }
+
+    // io_uring: 사용자 버퍼를 쓰지만 여러 읽기/쓰기를 겹쳐서 진행
+    // 파일 끝까지(len < 0)라면 지금 크기까지만 io_uring 으로 복사하고, 그 뒤에 늘어난 부분은 아래 루프가 복사
+    // 버퍼 하나에 들어가는 작은 구간은 겹칠 것이 없으므로 read/write 로 충분
+    if (*method == METHOD_URING) {
+        struct stat st;
+        off_t off = lseek(src_fd, 0, SEEK_CUR);
+        off_t todo = len;
+        if (off != -1 && len < 0 && fstat(src_fd, &st) == 0) {
+            todo = st.st_size - off;
+        }
+        if (off != -1 && todo > URING_BSZ) {
+            int r = uring_copy(src_fd, dest_fd, off, todo, queue_depth);
+            if (r == -1) {
+                return -1;
+            }
+            if (r == 0) {
+                // 오프셋을 지정해 복사했으므로 파일 오프셋은 직접 옮김
+                if (lseek(src_fd, off + todo, SEEK_SET) == -1 || lseek(dest_fd, off + todo, SEEK_SET) == -1) {
+                    return -1;
+                }
+                if (len >= 0) {
+                    return 0;
+                }
+            } else {
+                *method = METHOD_RW; // io_uring 을 쓸 수 없는 커널 또는 설정
+            }
+        }
+    }
+#endif
+
+    // 기존 방식: 사용자 버퍼를 거쳐 읽고 쓰기
+    while (len != 0 && (n = read(src_fd, buffer, chunk_size(len, BUFFER_SIZE))) > 0) {
+        if (len > 0) len -= n;
+        for (p = buffer; n > 0; p += w, n -= w) {
+            if ((w = write(dest_fd, p, n)) == -1) {
+                return -1;
+            }
+        }
+    }
+    return n == -1 ? -1 : 0;
+}
+
+/**
+ * 0으로만 채워진 블록은 쓰지 않고 건너뛰어 대상에 구멍(hole)으로 남기며 복사하는 함수.
+ * SEEK_DATA/SEEK_HOLE 을 지원하지 않는 파일 시스템에서 copy_sparse 가 사용한다.
+ * @param src_fd 원본 파일 디스크립터 (오프셋 0)
+ * @param dest_fd 대상 파일 디스크립터 (비어 있는 파일)
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int copy_zeros(int src_fd, int dest_fd) {
+    ssize_t n, w;
+    off_t end;
+    char buffer[BUFFER_SIZE];
+    char *p;
+
+    while ((n = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
+        // 첫 바이트가 0이고 나머지가 한 칸씩 밀린 자신과 같으면 블록 전체가 0
+        if (buffer[0] == 0 && memcmp(buffer, buffer + 1, n - 1) == 0) {
+            if (lseek(dest_fd, n, SEEK_CUR) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        for (p = buffer; n > 0; p += w, n -= w) {
+            if ((w = write(dest_fd, p, n)) == -1) {
+                return -1;
+            }
+        }
+    }
+    if (n == -1 || (end = lseek(dest_fd, 0, SEEK_CUR)) == -1) {
+        return -1;
+    }
+    // 끝부분의 구멍은 쓴 적이 없으므로 크기만 맞춘다
+    return ftruncate(dest_fd, end);
+}
+
+/**
+ * 구멍(hole)이 있는 파일을 데이터 구간만 복사하는 함수.
+ * SEEK_DATA/SEEK_HOLE 로 찾은 데이터 구간을 같은 오프셋에 복사하고 구멍은 건너뛰므로,
+ * 복사 시간과 대상의 디스크 사용량이 실제 데이터 양에 비례한다.
+ * @param src_fd 원본 파일 디스크립터 (오프셋 0)
+ * @param dest_fd 대상 파일 디스크립터 (비어 있는 파일)
+ * @param size 원본 파일 크기
+ * @param method 데이터 구간 복사에 쓸 방법 (copy_range 참고)
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int copy_sparse(int src_fd, int dest_fd, off_t size, enum copy_method *method) {
+#if defined(SEEK_DATA)
+    off_t data, hole;
+
+    for (hole = 0; hole < size; ) {
+        if ((data = lseek(src_fd, hole, SEEK_DATA)) == -1) {
+            if (errno == ENXIO) {
+                break; // 나머지는 모두 구멍
+            }
+            if (errno == EINVAL && hole == 0) {
+                return copy_zeros(src_fd, dest_fd);
+            }
+            return -1;
+        }
+        if ((hole = lseek(src_fd, data, SEEK_HOLE)) == -1 ||
+            lseek(src_fd, data, SEEK_SET) == -1 || lseek(dest_fd, data, SEEK_SET) == -1) {
+            return -1;
+        }
+        if (copy_range(src_fd, dest_fd, hole - data, method) == -1) {
+            return -1;
+        }
+    }
+    // 건너뛴 구멍은 대상에서도 구멍으로 남고, 끝부분의 구멍은 크기만 맞춘다
+    return ftruncate(dest_fd, size);
+#else
+    (void)size;
+    (void)method;
+    return copy_zeros(src_fd, dest_fd);
+#endif
+}
+
+/**
+ * 열린 두 파일 사이에서 내용을 복사하는 함수.
+ * FICLONE 리플링크를 먼저 시도하고, 안 되면 copy_file_range, sendfile, read/write 순서로 복사한다.
+ * -q N 을 주면 리플링크 다음에 커널 복사 대신 io_uring 을 쓴다.
+ * 실패한 방법은 파일 시스템 쌍마다 캐시해 다음 파일부터는 건너뛴다.
+ * 할당된 블록이 크기보다 적은 파일(구멍이 있는 파일)은 copy_sparse 로 구멍을 유지한다.
+ * @param src_fd 원본 파일 디스크립터 (파일 오프셋 0)
+ * @param dest_fd 대상 파일 디스크립터 (비어 있는 파일)
+ * @return 성공 시 0, 실패 시 -1 (errno 설정)
+ */
+int copy_data(int src_fd, int dest_fd) {
+    struct stat src_st, dest_st;
+    enum copy_method method, start, rw = METHOD_RW;
+    int result;
+
+    if (fstat(src_fd, &src_st) == -1 || fstat(dest_fd, &dest_st) == -1) {
+        return -1;
+    }
+    method = fs_method_get(src_st.st_dev, dest_st.st_dev);
+    if (reflink_mode == REFLINK_ALWAYS && method != METHOD_CLONE) {
+        errno = EOPNOTSUPP; // 이 파일 시스템 쌍은 이미 리플링크에 실패함
+        return -1;
+    }
+    if (reflink_mode == REFLINK_NEVER && method == METHOD_CLONE) {
+        method = METHOD_RANGE;
+    }
+    start = method;
+
+    // 리플링크: 데이터 블록(과 구멍)을 공유하므로 크기와 상관없이 메타데이터만 복사됨 (btrfs, xfs)
+    if (method == METHOD_CLONE) {
+#if defined(__linux__)
+        if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+            return 0;
+        }
+        if (reflink_mode == REFLINK_ALWAYS || !unsupported(errno)) {
+            return -1;
+        }
+#else
+        if (reflink_mode == REFLINK_ALWAYS) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+#endif
+        method = METHOD_RANGE;
+    }
+    if (queue_depth > 0 && method < METHOD_URING) {
+        method = METHOD_URING;
+    }
+
+    if (src_st.st_size == 0) {
+        // 크기가 0으로 보이는 파일(/proc 등)은 커널 복사가 0바이트로 끝나므로 read/write 로 복사
+        result = copy_range(src_fd, dest_fd, -1, &rw);
+    } else if ((off_t)src_st.st_blocks * 512 < src_st.st_size) {
+        result = copy_sparse(src_fd, dest_fd, src_st.st_size, &method);
+    } else {
+        result = copy_range(src_fd, dest_fd, -1, &method);
+    }
+
+    if (result == 0 && method != start) {
+        fs_method_set(src_st.st_dev, dest_st.st_dev, method);
+    }
+    return result;
+}
 
 /**
  * 단일 파일을 복사하는 함수.
@@ -32,8 +659,6 @@ int preserve_flag = 0;  // -p : 권한 및 시간 보존 플래그
  */
 int copy_file(const char *source, const char *destination, mode_t mode, struct timespec atime, struct timespec mtime) {
     int src_fd, dest_fd;
-    ssize_t bytes_read, bytes_written;
-    char buffer[BUFFER_SIZE];
 
     // 1. 원본 파일 열기 (읽기 전용) - 간결한 조건 검사 스타일 적용
     if ((src_fd = open(source, O_RDONLY)) < 0) {
@@ -55,19 +680,9 @@ int copy_file(const char *source, const char *destination, mode_t mode, struct t
         printf("복사 중: %s -> %s\n", source, destination);
     }
 
-    // 3. 파일 내용 복사
-    while ((bytes_read = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
-        bytes_written = write(dest_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("write destination file");
-            close(src_fd);
-            close(dest_fd);
-            return -1;
-        }
-    }
-
-    if (bytes_read == -1) {
-        perror("read source file");
+    // 3. 파일 내용 복사 (가능하면 커널에서 복사, copy_data 참고)
+    if (copy_data(src_fd, dest_fd) == -1) {
+        fprintf(stderr, "xcopy: cannot copy '%s' to '%s': %s\n", source, destination, strerror(errno));
         close(src_fd);
         close(dest_fd);
         return -1;
@@ -80,20 +695,7 @@ int copy_file(const char *source, const char *destination, mode_t mode, struct t
 
     // 5. -p 옵션 처리: 권한 및 타임스탬프 보존
     if (preserve_flag) {
-        // 권한 보존: 파일 경로를 사용하여 권한 설정
-        if (chmod(destination, mode) == -1) {
-            perror("chmod destination file");
-        }
-        
-        // 타임스탬프 보존: 접근 시간(atime)과 수정 시간(mtime) 설정
-        struct timespec times[2];
-        times[0] = atime; // 접근 시간 (Access Time)
-        times[1] = mtime; // 수정 시간 (Modification Time)
-        
-        // utimensat 시스템 콜을 사용하여 시간 정보 업데이트
-        if (utimensat(AT_FDCWD, destination, times, 0) == -1) {
-            perror("utimensat destination file");
-        }
+        preserve_metadata(destination, mode, atime, mtime);
     }
 
     return 0;
@@ -175,16 +777,351 @@ int copy_dir(const char *source, const char *destination) {
     }
 
     closedir(dir);
+
+    // 5. -p 옵션 처리: 디렉토리의 권한과 시간은 내용을 모두 복사한 뒤에 적용
+    // (먼저 적용하면 하위 항목을 만들면서 mtime이 바뀌고, 쓰기 권한이 없으면 복사가 실패함)
+    if (preserve_flag) {
+        if (lstat(source, &st) < 0) {
+            perror("lstat source directory");
+            return -1;
+        }
+        preserve_metadata(destination, st.st_mode, st.st_atim, st.st_mtim);
+    }
     return 0;
 }
 
+/*
+ * -j N 병렬 복사 엔진.
+ *
+ * 작업(task)은 "디렉토리 스캔"과 "파일 복사" 두 종류이다. 스레드마다 자기 덱(deque)을 갖고,
+ * 새 작업은 자기 덱의 뒤에 넣고 뒤에서 꺼낸다(깊이 우선, 캐시에 유리). 자기 덱이 비면
+ * 다른 스레드 덱의 앞에서 훔쳐 온다(work stealing) - 앞쪽에는 오래된, 보통 더 큰 작업이 있다.
+ *
+ * 디렉토리 스캔 작업은 대상 디렉토리를 먼저 만든 다음 항목을 읽으므로, 디렉토리는 항상
+ * 그 내용보다 먼저 생성된다. 각 디렉토리는 아직 끝나지 않은 하위 작업 수(pending)를 세고,
+ * 0이 되는 순간(내용이 모두 써진 뒤) -p 메타데이터를 적용하고 부모에게 완료를 알린다.
+ */
+enum { TASK_DIR, TASK_FILE };
+
+typedef struct dir_node {
+    struct dir_node *parent; // 부모 디렉토리 (루트는 NULL)
+    int pending;             // 끝나지 않은 하위 작업 수 (+1: 스캔 자신)
+    char *dst;               // 대상 디렉토리 경로
+    struct stat st;          // 원본 디렉토리 정보 (-p 용)
+} dir_node;
+
+typedef struct task {
+    int type;          // TASK_DIR 또는 TASK_FILE
+    char *src;         // 원본 경로
+    char *dst;         // 대상 경로
+    struct stat st;    // 원본 정보 (파일: 권한/시간, 디렉토리: dir_node에 복사)
+    dir_node *parent;  // 이 작업이 속한 디렉토리
+} task;
+
+typedef struct {
+    pthread_mutex_t lock;
+    task **buf;          // 원형 버퍼
+    unsigned long cap;   // buf 크기 (2의 거듭제곱)
+    unsigned long head;  // 도둑이 꺼내는 쪽
+    unsigned long tail;  // 주인이 넣고 꺼내는 쪽
+} deque;
+
+static deque *deques;          // 스레드별 덱
+static int njobs;              // 스레드 수
+static long outstanding;       // 아직 끝나지 않은 작업 수 (0이 되면 전체 완료)
+static int failed;             // 오류가 한 번이라도 났는지
+static unsigned long idle_gen; // 작업이 추가될 때마다 증가 (잠든 스레드 깨우기용)
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * "dir/name" 형태의 경로를 새로 할당해 만드는 함수.
+ * @return 새 경로 문자열, PATH_MAX를 넘거나 메모리가 없으면 NULL
+ */
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path;
+
+    if (dlen + 1 + nlen + 1 > PATH_MAX || (path = malloc(dlen + 1 + nlen + 1)) == NULL) {
+        return NULL;
+    }
+    memcpy(path, dir, dlen);
+    path[dlen] = '/';
+    memcpy(path + dlen + 1, name, nlen + 1);
+    return path;
+}
+
+/**
+ * 덱의 뒤(tail)에 작업을 넣는 함수. 가득 차면 두 배로 늘린다.
+ */
+static void deque_push(deque *d, task *t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail - d->head == d->cap) {
+        unsigned long newcap = d->cap ? d->cap * 2 : 64;
+        task **nbuf = malloc(newcap * sizeof(task *));
+        if (nbuf == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned long i = d->head; i != d->tail; i++) {
+            nbuf[i & (newcap - 1)] = d->buf[i & (d->cap - 1)];
+        }
+        free(d->buf);
+        d->buf = nbuf;
+        d->cap = newcap;
+    }
+    d->buf[d->tail++ & (d->cap - 1)] = t;
+    pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * 덱에서 작업을 하나 꺼내는 함수.
+ * @param steal 0이면 주인으로서 뒤에서, 1이면 도둑으로서 앞에서 꺼낸다
+ * @return 꺼낸 작업, 비어 있으면 NULL
+ */
+static task *deque_take(deque *d, int steal) {
+    task *t = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head) {
+        t = steal ? d->buf[d->head++ & (d->cap - 1)] : d->buf[--d->tail & (d->cap - 1)];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+/**
+ * 스레드 self의 덱에 새 작업을 추가하고, 잠든 스레드를 깨우는 함수.
+ */
+static void add_task(int self, int type, char *src, char *dst, const struct stat *st, dir_node *parent) {
+    task *t = malloc(sizeof(task));
+
+    if (t == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    t->type = type;
+    t->src = src;
+    t->dst = dst;
+    t->st = *st;
+    t->parent = parent;
+    __sync_add_and_fetch(&outstanding, 1);
+    deque_push(&deques[self], t);
+
+    pthread_mutex_lock(&idle_lock);
+    idle_gen++;
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/**
+ * 디렉토리의 하위 작업 하나가 끝났음을 알리는 함수.
+ * 마지막 작업이었다면 -p 메타데이터를 적용하고, 부모에게도 같은 방식으로 알린다.
+ */
+static void dir_done(dir_node *node) {
+    while (node != NULL && __sync_sub_and_fetch(&node->pending, 1) == 0) {
+        dir_node *parent = node->parent;
+
+        if (preserve_flag) {
+            preserve_metadata(node->dst, node->st.st_mode, node->st.st_atim, node->st.st_mtim);
+        }
+        free(node->dst);
+        free(node);
+        node = parent;
+    }
+}
+
+/**
+ * 디렉토리 스캔 작업: 대상 디렉토리를 만들고, 항목마다 새 작업을 자기 덱에 넣는다.
+ * @param self 실행 중인 스레드 번호
+ * @param t 스캔할 디렉토리 작업 (dst 소유권은 새 dir_node로 넘어간다)
+ */
+static void scan_dir(int self, task *t) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    dir_node *node;
+    char *source_path, *dest_path;
+
+    if ((node = malloc(sizeof(dir_node))) == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    node->parent = t->parent;
+    node->pending = 1; // 스캔 자신
+    node->dst = t->dst;
+    node->st = t->st;
+
+    // 1. 대상 디렉토리 생성 (내용보다 먼저)
+    if (mkdir(t->dst, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir destination directory");
+        failed = 1;
+        dir_done(node);
+        return;
+    }
+
+    // 2. 원본 디렉토리 열기
+    if ((dir = opendir(t->src)) == NULL) {
+        perror("opendir source directory");
+        failed = 1;
+        dir_done(node);
+        return;
+    }
+
+    // 3. 디렉토리 항목 순회: 하위 디렉토리와 파일을 작업으로 등록
+    while (!failed && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if ((source_path = join_path(t->src, entry->d_name)) == NULL ||
+            (dest_path = join_path(t->dst, entry->d_name)) == NULL) {
+            fprintf(stderr, "xcopy: path name too long for '%s'\n", entry->d_name);
+            free(source_path);
+            continue;
+        }
+        if (lstat(source_path, &st) < 0) {
+            perror("lstat source_path");
+            free(source_path);
+            free(dest_path);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+            // 작업을 넣기 전에 pending을 올려야 작업이 먼저 끝나도 디렉토리가 일찍 완료되지 않는다
+            __sync_add_and_fetch(&node->pending, 1);
+            add_task(self, S_ISDIR(st.st_mode) ? TASK_DIR : TASK_FILE, source_path, dest_path, &st, node);
+            continue;
+        }
+        if (S_ISLNK(st.st_mode)) { // 심볼릭 링크인 경우 (무시)
+            fprintf(stderr, "xcopy: ignoring symbolic link '%s'\n", source_path);
+        } else { // 기타 파일 타입 (FIFO, socket 등)
+            fprintf(stderr, "xcopy: skipping unknown file type for '%s'\n", source_path);
+        }
+        free(source_path);
+        free(dest_path);
+    }
+
+    closedir(dir);
+    dir_done(node); // 스캔 자신의 몫
+}
+
+/**
+ * 작업 스레드: 자기 덱에서, 없으면 다른 스레드의 덱에서 작업을 가져와 실행한다.
+ * 모든 작업이 끝나면(outstanding == 0) 종료한다.
+ */
+static void *worker(void *arg) {
+    int self = (int)(long)arg;
+    task *t;
+
+    for (;;) {
+        unsigned long gen;
+
+        pthread_mutex_lock(&idle_lock);
+        gen = idle_gen;
+        pthread_mutex_unlock(&idle_lock);
+
+        // 자기 덱 → 다른 스레드 덱 순서로 작업을 찾는다
+        t = deque_take(&deques[self], 0);
+        for (int i = 1; t == NULL && i < njobs; i++) {
+            t = deque_take(&deques[(self + i) % njobs], 1);
+        }
+
+        if (t == NULL) {
+            // 할 일이 없으면, 새 작업이 추가되거나 전체가 끝날 때까지 잠든다
+            pthread_mutex_lock(&idle_lock);
+            while (idle_gen == gen && outstanding > 0) {
+                pthread_cond_wait(&idle_cond, &idle_lock);
+            }
+            if (outstanding == 0) {
+                pthread_mutex_unlock(&idle_lock);
+                return NULL;
+            }
+            pthread_mutex_unlock(&idle_lock);
+            continue;
+        }
+
+        if (t->type == TASK_DIR) {
+            scan_dir(self, t); // t->dst는 dir_node가 가져간다
+        } else {
+            if (!failed && copy_file(t->src, t->dst, t->st.st_mode, t->st.st_atim, t->st.st_mtim) == -1) {
+                failed = 1;
+            }
+            free(t->dst);
+            dir_done(t->parent);
+        }
+        free(t->src);
+        free(t);
+
+        // 마지막 작업이었다면 잠든 스레드를 모두 깨워 종료시킨다
+        if (__sync_sub_and_fetch(&outstanding, 1) == 0) {
+            pthread_mutex_lock(&idle_lock);
+            idle_gen++;
+            pthread_cond_broadcast(&idle_cond);
+            pthread_mutex_unlock(&idle_lock);
+        }
+    }
+}
+
+/**
+ * 디렉토리를 nthreads개의 스레드로 병렬 복사하는 함수 (-j 옵션 처리).
+ * 결과는 copy_dir()과 같지만 파일들이 복사되는 순서는 정해져 있지 않다.
+ * 오류가 나면 새 작업은 더 시작하지 않고, 이미 등록된 작업만 정리한다.
+ * @param source 원본 디렉토리 경로
+ * @param destination 대상 디렉토리 경로
+ * @param nthreads 스레드 수
+ * @return 성공 시 0, 실패 시 -1
+ */
+int copy_dir_parallel(const char *source, const char *destination, int nthreads) {
+    pthread_t tids[MAX_JOBS];
+    struct stat st;
+    char *src, *dst;
+    int i, err;
+
+    if (lstat(source, &st) < 0) {
+        perror("lstat source directory");
+        return -1;
+    }
+    njobs = nthreads;
+    if ((deques = calloc(nthreads, sizeof(deque))) == NULL ||
+        (src = strdup(source)) == NULL || (dst = strdup(destination)) == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+    }
+
+    // 루트 디렉토리 스캔이 첫 작업이다
+    add_task(0, TASK_DIR, src, dst, &st, NULL);
+    for (i = 0; i < nthreads; i++) {
+        if ((err = pthread_create(&tids[i], NULL, worker, (void *)(long)i)) != 0) {
+            fprintf(stderr, "xcopy: pthread_create: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].buf);
+    }
+    free(deques);
+    return failed ? -1 : 0;
+}
+
 int main(int argc, char *argv[]) {
     int opt;
     char *source_arg = NULL;
     char *target_arg = NULL;
+    static const struct option long_options[] = {
+        {"reflink", optional_argument, NULL, 'R'}, // --reflink[=auto|always|never]
+        {NULL, 0, NULL, 0}
+    };
 
-    // 명령줄 옵션 파싱 (-r, -v, -p)
-    while ((opt = getopt(argc, argv, "rvp")) != -1) {
+    // 명령줄 옵션 파싱 (-r, -v, -p, -j N, -q N, --reflink[=WHEN])
+    while ((opt = getopt_long(argc, argv, "rvpj:q:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'r':
                 recursive_flag = 1;
@@ -195,16 +1132,43 @@ int main(int argc, char *argv[]) {
             case 'p':
                 preserve_flag = 1;
                 break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1 || jobs > MAX_JOBS) {
+                    fprintf(stderr, "xcopy: -j must be between 1 and %d\n", MAX_JOBS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                queue_depth = atoi(optarg);
+                if (queue_depth < 0 || queue_depth > MAX_QUEUE_DEPTH) {
+                    fprintf(stderr, "xcopy: -q must be between 0 and %d\n", MAX_QUEUE_DEPTH);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                // 값 없이 --reflink 만 주면 cp 와 같이 always
+                if (optarg == NULL || strcmp(optarg, "always") == 0) {
+                    reflink_mode = REFLINK_ALWAYS;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    reflink_mode = REFLINK_AUTO;
+                } else if (strcmp(optarg, "never") == 0) {
+                    reflink_mode = REFLINK_NEVER;
+                } else {
+                    fprintf(stderr, "xcopy: invalid --reflink argument '%s' (auto, always, never)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 // 알 수 없는 옵션이나 옵션 인자가 누락된 경우 사용법 출력
-                fprintf(stderr, "Usage: %s [-r] [-v] [-p] SOURCE TARGET\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-r] [-v] [-p] [-j N] [-q N] [--reflink[=WHEN]] SOURCE TARGET\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
     // SOURCE와 TARGET 인자 확인
     if (argc - optind < 2) { 
-        fprintf(stderr, "Usage: %s [-r] [-v] [-p] SOURCE TARGET\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-r] [-v] [-p] [-j N] [-q N] [--reflink[=WHEN]] SOURCE TARGET\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -254,8 +1218,9 @@ int main(int argc, char *argv[]) {
             final_target_path[PATH_MAX - 1] = '\0';
         }
 
-        // 디렉토리 복사 시작
-        if (copy_dir(source_arg, final_target_path) == -1) {
+        // 디렉토리 복사 시작 (-j 2 이상이면 병렬 복사)
+        if ((jobs > 1 ? copy_dir_parallel(source_arg, final_target_path, jobs)
+                      : copy_dir(source_arg, final_target_path)) == -1) {
             exit(EXIT_FAILURE);
         }
 
@@ -0,0 +1,99 @@
+/*
+ * rot13 with io_uring instead of POSIX AIO (compare rot13c2.c;
+ * glibc runs aio_read and aio_write on threads of its own).
+ * uring_copy() keeps depth registered buffers in flight and calls
+ * us to translate each one between its read and its write.  Where
+ * io_uring isn't available, we fall back to read and write.  Usage:
+ * 	rot13c3 [-d depth] infile outfile
+ */
+#include "apue.h"
+#include <ctype.h>
+#include <fcntl.h>
+
+#define BSZ 4096
+
+unsigned char buf[BSZ];
+
+unsigned char
+translate(unsigned char c)
+{
+	if (isalpha(c)) {
+		if (c >= 'n')
+			c -= 13;
+		else if (c >= 'a')
+			c += 13;
+		else if (c >= 'N')
+			c -= 13;
+		else
+			c += 13;
+	}
+	return(c);
+}
+
+void
+xlate(unsigned char *p, size_t n, void *arg)
+{
+	size_t	i;
+
+	for (i = 0; i < n; i++)
+		p[i] = translate(p[i]);
+}
+
+int
+main(int argc, char* argv[])
+{
+	int			ifd, ofd, n, nw, c, depth, err;
+	struct stat	sbuf;
+
+	err = 0;
+	depth = 8;
+	while ((c = getopt(argc, argv, "d:")) != -1) {
+		switch (c) {
+		case 'd':
+			depth = atoi(optarg);
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || depth < 1 || optind != argc - 2)
+		err_quit("usage: rot13c3 [-d depth] infile outfile");
+	if ((ifd = open(argv[optind], O_RDONLY)) < 0)
+		err_sys("can't open %s", argv[optind]);
+	if ((ofd = open(argv[optind+1], O_RDWR|O_CREAT|O_TRUNC,
+	  FILE_MODE)) < 0)
+		err_sys("can't create %s", argv[optind+1]);
+	if (fstat(ifd, &sbuf) < 0)
+		err_sys("fstat failed");
+
+	if (S_ISREG(sbuf.st_mode)) {
+		err = uring_copy(ifd, ofd, 0, sbuf.st_size, depth, xlate, NULL);
+		if (err == -1)
+			err_sys("uring_copy failed");
+		if (err == 0) {
+			if (fsync(ofd) < 0)
+				err_sys("fsync failed");
+			exit(0);
+		}
+	}
+
+	/*
+	 * No io_uring, or not a regular file: do it the old way.
+	 */
+	while ((n = read(ifd, buf, BSZ)) > 0) {
+		xlate(buf, n, NULL);
+		if ((nw = write(ofd, buf, n)) != n) {
+			if (nw < 0)
+				err_sys("write failed");
+			else
+				err_quit("short write (%d/%d)", nw, n);
+		}
+	}
+	if (n < 0)
+		err_sys("read failed");
+	if (fsync(ofd) < 0)
+		err_sys("fsync failed");
+	exit(0);
+}
@@ -1,15 +1,24 @@
 #ifndef _APUE_DB_H
 #define _APUE_DB_H
 
+#include <stdio.h>		/* for FILE and size_t */
+
 typedef	void *	DBHANDLE;
 
 DBHANDLE  db_open(const char *, int, ...);
 void      db_close(DBHANDLE);
 char     *db_fetch(DBHANDLE, const char *);
+char     *db_fetch_r(DBHANDLE, const char *, char *, size_t);
 int       db_store(DBHANDLE, const char *, const char *, int);
 int       db_delete(DBHANDLE, const char *);
 void      db_rewind(DBHANDLE);
 char     *db_nextrec(DBHANDLE, char *);
+int       db_seek(DBHANDLE, const char *);
+char     *db_nextkey(DBHANDLE, char *);
+int       db_ctl(DBHANDLE, int, ...);
+int       db_scan(DBHANDLE, int,
+            int (*)(void *, const char *, const char *), void *);
+int       db_dumpstats(DBHANDLE, FILE *, int);
 
 /*
  * Flags for db_store().
@@ -18,6 +27,15 @@ char     *db_nextrec(DBHANDLE, char *);
 #define DB_REPLACE	   2	/* replace existing record */
 #define DB_STORE	   3	/* replace or insert */
 
+/*
+ * Commands for db_ctl().
+ */
+#define DB_WAL		   1	/* log writes; arg: checkpoint size (long) */
+#define DB_CHECKPOINT  2	/* sync files and empty the log */
+#define DB_CACHE	   3	/* cache fetched records; arg: bytes (long) */
+#define DB_THREADS	   4	/* let threads share the handle; set last */
+#define DB_ORDERED	   5	/* keep an ordered index for db_seek */
+
 /*
  * Implementation limits.
  */
@@ -4,6 +4,9 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>	/* struct iovec */
+#include <stdint.h>		/* fixed-size fields of log records */
+#include <sys/mman.h>	/* mmap of generation counters */
+#include <pthread.h>
 
 /*
  * Internal index file constants.
@@ -25,13 +28,170 @@
 #define FREE_OFF      0	/* free list offset in index file */
 #define HASH_OFF PTR_SZ	/* hash table offset in index file */
 
+/*
+ * The write-ahead log.  Each db_store or db_delete is one transaction:
+ * a WALHDR followed by the WALENTs for every write it makes to the
+ * index and data files.  The whole transaction is appended to the log
+ * with a single write, so a crash leaves at most one torn transaction,
+ * at the end of the log, which the checksum lets us recognize.
+ *
+ * Replaying the log is only safe if no one is still adding to it, and
+ * if no write made since was left out of it.  So every handle using
+ * the log holds a read lock on its byte WAL_OWNER for as long as it's
+ * open, and once the log exists, every handle that writes uses it.
+ */
+#define WAL_MAGIC	0x57414c31	/* "WAL1" */
+#define WAL_CKPT_DEF (1024*1024)	/* default checkpoint threshold */
+#define WAL_LOCK	   0	/* byte of the log locked by LK_WAL */
+#define WAL_OWNER	   1	/* byte of the log locked by its users */
+#define WAL_IDX		   0	/* WALENT.file: index file */
+#define WAL_DAT		   1	/* WALENT.file: data file */
+#define WAL_BPT		   2	/* WALENT.file: ordered index */
+
+typedef struct {	/* start of a transaction in the log */
+  uint32_t magic;	/* WAL_MAGIC */
+  uint32_t len;		/* #bytes of WALENTs that follow */
+  uint32_t crc;		/* CRC-32 of those bytes */
+  uint32_t pad;
+} WALHDR;
+
+typedef struct {	/* one write; followed by the bytes written */
+  int64_t  off;		/* offset in the file */
+  uint32_t len;		/* #bytes written */
+  uint32_t file;	/* WAL_IDX, WAL_DAT or WAL_BPT */
+} WALENT;
+
+/*
+ * The record locks, for _db_lock and _db_unlock.
+ */
+#define LK_CHAIN	   0	/* hash chain at db->chainoff */
+#define LK_FREE		   1	/* free list */
+#define LK_IDXAPP	   2	/* append to index file */
+#define LK_DATAPP	   3	/* append to data file */
+#define LK_WAL		   4	/* the whole log */
+#define LK_BPT		   5	/* the whole ordered index */
+#define LK_NLOCKS	   6
+
+/*
+ * Locks that, when logging, are held until the transaction commits
+ * rather than released as soon as the write is buffered.
+ */
+#define TXN_FREE	(1 << LK_FREE)
+#define TXN_IDXAPP	(1 << LK_IDXAPP)
+#define TXN_DATAPP	(1 << LK_DATAPP)
+#define TXN_BPT		(1 << LK_BPT)
+
+/*
+ * In thread mode, the threads of a process share one handle.  fcntl
+ * record locks belong to the process, so they can't keep its threads
+ * apart: each record lock is layered over a rwlock, and a read lock
+ * is taken with fcntl by the first reading thread and released by
+ * the last.  Hash chains share NSTRIPE rwlocks, but the count of
+ * reading threads is kept per chain, since it's per fcntl lock.
+ */
+#define NSTRIPE		  32
+
+typedef struct {
+  pthread_rwlock_t rwlock;  /* excludes other threads */
+  pthread_mutex_t  mutex;   /* protects counts of reading threads */
+} DBLOCK;
+
 typedef unsigned long	DBHASH;	/* hash values */
 typedef unsigned long	COUNT;	/* unsigned counter */
 
 /*
- * Library's private representation of the database.
+ * The record cache.  Every hash chain has a generation counter in
+ * the shared file <name>.gen, which a process bumps whenever it write
+ * locks the chain.  A cached record is good only as long as the
+ * generation of its chain hasn't changed, so writes by any process
+ * invalidate the caches of all of them.  Entries are evicted with
+ * the CLOCK algorithm once the cache grows past its byte budget.
+ */
+typedef struct dbcent {
+  struct dbcent *hnext;  /* next entry in cache hash bucket */
+  struct dbcent *prev;   /* CLOCK ring */
+  struct dbcent *next;
+  DBHASH   chain;  /* hash chain the key is on */
+  uint32_t gen;    /* generation of the chain when cached */
+  int      ref;    /* CLOCK reference bit */
+  size_t   size;   /* #bytes charged against the budget */
+  char    *data;   /* data record, stored after the key */
+  char     key[1]; /* key, null, data, null */
+} DBCENT;
+
+typedef struct {
+  DBCENT **bucket;  /* hash table of entries, by key */
+  size_t   nbucket; /* power of 2 */
+  DBCENT  *hand;    /* CLOCK hand; NULL when empty */
+  size_t   used;    /* #bytes of entries */
+  size_t   budget;  /* max #bytes of entries */
+} DBCACHE;
+
+#define CACHE_BUCKET 256	/* budget bytes per hash bucket */
+
+#define SCAN_BUFSZ	(64 * 1024)	/* db_scan reads this much at a time */
+
+#define ORD_SEEK	   0	/* next key >= ordkey; ordpg not read */
+#define ORD_NEXT	   1	/* next key > ordkey; ordpg may be good */
+
+/*
+ * The ordered index, <name>.bpt, is a B+tree of the keys in the
+ * database, kept alongside the hash table so records can be read in
+ * key order.  Page 0 is a BPTHDR; every other page is a BPTPAGE
+ * followed by entries: a 2-byte key length and the key, plus, in
+ * interior pages, the 4-byte page number of the subtree holding keys
+ * >= that key.  Interior pages hold keys less than the first key in
+ * their "link" subtree; leaves are chained left to right by "link".
+ * Deletes never merge pages, they just leave them less full.
+ *
+ * The index can be created while other handles have the database
+ * open.  After the chain generations, <name>.gen has a counter that
+ * _db_bptcreate bumps (and one for the log); a writer that sees it change
+ * opens the new index before touching the hash chains again.
  */
+#define BPT_MAGIC	0x42505431	/* "BPT1" */
+#define BPT_PAGESZ	4096
+#define BPT_MAXDEPTH  32
+
 typedef struct {
+  uint32_t magic;  /* BPT_MAGIC, written once the tree is built */
+  uint32_t root;   /* page number of the root */
+  uint32_t npage;  /* #pages in the file */
+  uint32_t stamp;  /* changed by every update, for db_nextkey */
+} BPTHDR;
+
+typedef struct {
+  uint16_t leaf;   /* nonzero for a leaf */
+  uint16_t nkey;   /* #entries */
+  uint16_t used;   /* #bytes of entries */
+  uint16_t pad;
+  uint32_t link;   /* leaf: next leaf; interior: leftmost subtree */
+} BPTPAGE;
+
+typedef union {
+  BPTHDR  hdr;
+  BPTPAGE pg;
+  char    buf[BPT_PAGESZ];
+} BPTBUF;
+
+#define BPT_ROOM	(BPT_PAGESZ - sizeof(BPTPAGE))
+#define BPT_ENT(bp)	((bp)->buf + sizeof(BPTPAGE))	/* first entry */
+#define BPT_ENTMAX	(2 + IDXLEN_MAX + 4)	/* largest entry */
+
+struct db;
+
+typedef struct {	/* state shared by the threads using a handle */
+  pthread_key_t   key;       /* each thread's struct db */
+  pthread_mutex_t mutex;     /* protects list and the record cache */
+  struct db      *list;      /* the threads' struct dbs */
+  DBLOCK          lock[NSTRIPE + LK_NLOCKS - 1];
+  int            *nread;     /* reading threads, per fcntl lock */
+} DBSHARE;
+
+/*
+ * Library's private representation of the database.
+ */
+typedef struct db {
   int    idxfd;  /* fd for index file */
   int    datfd;  /* fd for data file */
   char  *idxbuf; /* malloc'ed buffer for index record */
@@ -47,9 +207,29 @@ typedef struct {
 			      /* includes newline at end */
   off_t  ptrval; /* contents of chain ptr in index record */
   off_t  ptroff; /* chain ptr offset pointing to this idx record */
+  off_t  scanoff; /* offset of next index record for db_nextrec */
   off_t  chainoff; /* offset of hash chain for this index record */
   off_t  hashoff;  /* offset in index file of hash table */
   DBHASH nhash;    /* current hash table size */
+  int    walfd;    /* fd for write-ahead log, -1 if not logging */
+  char  *walbuf;   /* malloc'ed buffer for current transaction */
+  size_t wallen;   /* #bytes used in walbuf; 0 if no writes yet */
+  size_t walmax;   /* #bytes allocated for walbuf */
+  off_t  walckpt;  /* checkpoint once the log grows past this */
+  int    txnlocks; /* TXN_xxx locks to release at commit */
+  volatile uint32_t *gen; /* mmap'ed chain generations, or NULL */
+  DBCACHE *cache;  /* record cache, or NULL */
+  DBSHARE *share;  /* thread mode: shared state, or NULL */
+  struct db *parent; /* thread's struct db: the handle's */
+  struct db *tnext;  /* next thread's struct db */
+  int    bptfd;    /* fd for ordered index, -1 if none */
+  uint32_t bptgen; /* gen[nhash] when we last looked for the index */
+  uint32_t walgen; /* gen[nhash+1] when we last looked for the log */
+  BPTBUF *ordpg;   /* db_nextkey: malloc'ed copy of current leaf */
+  char  *ordkey;   /* malloc'ed key last sought or returned */
+  size_t ordoff;   /* offset in ordpg of next entry */
+  uint32_t ordstamp; /* tree stamp when ordpg was read */
+  int    ordstate; /* ORD_xxx */
   COUNT  cnt_delok;    /* delete OK */
   COUNT  cnt_delerr;   /* delete error */
   COUNT  cnt_fetchok;  /* fetch OK */
@@ -60,20 +240,83 @@ typedef struct {
   COUNT  cnt_stor3;    /* store: DB_REPLACE, diff len, appended */
   COUNT  cnt_stor4;    /* store: DB_REPLACE, same len, overwrote */
   COUNT  cnt_storerr;  /* store error */
+  COUNT  cnt_commit;   /* transactions written to the log */
+  COUNT  cnt_ckpt;     /* checkpoints */
+  COUNT  cnt_cachehit; /* fetch: found in cache */
+  COUNT  cnt_cachemiss;/* fetch: not in cache or stale */
 } DB;
 
+/*
+ * One worker of db_scan: it handles the index records that start
+ * in [lo, hi).  For db_dumpstats, chainlen is non-NULL and the
+ * worker tallies the records instead of calling func.
+ */
+typedef struct {
+  DB     *db;
+  off_t   lo;       /* first byte of our part of the index file */
+  off_t   hi;       /* one past the last byte */
+  int   (*func)(void *, const char *, const char *);
+  void   *arg;      /* first argument to func */
+  volatile int *stop; /* set when any worker's func returns nonzero */
+  int     rc;       /* nonzero value returned by func */
+  pthread_t tid;
+  int     started;  /* tid is valid */
+  COUNT  *chainlen; /* db_dumpstats: #records per hash chain */
+  COUNT   nfree;    /* db_dumpstats: #deleted records */
+  COUNT   freeidx;  /* db_dumpstats: #bytes in deleted index records */
+  COUNT   freedat;  /* db_dumpstats: #bytes in deleted data records */
+  COUNT   maxfree;  /* db_dumpstats: largest deleted data record */
+} DBSCAN;
+
 /*
  * Internal functions.
  */
+static void    _db_addcounts(DB *, DB *);
 static DB     *_db_alloc(int);
+static int     _db_bptcreate(DB *);
+static uint32_t _db_bptchild(BPTBUF *, const char *, size_t);
+static int     _db_bptdelete(DB *, const char *);
+static void    _db_bptdone(DB *);
+static void    _db_bptfind(DB *, BPTBUF *, const char *, size_t, int);
+static int     _db_bptinsert(DB *, const char *);
+static int     _db_bptnew(DB *);
+static void    _db_bptopen(DB *);
+static void    _db_bptread(DB *, uint32_t, BPTBUF *);
+static size_t  _db_bptsearch(BPTBUF *, const char *, size_t, int *);
+static void    _db_bptwrite(DB *, uint32_t, BPTBUF *, size_t);
+static DBCENT **_db_cachebucket(DBCACHE *, const char *);
+static char   *_db_cacheget(DB *, const char *);
+static void    _db_cacheput(DB *, const char *, const char *);
+static void    _db_cacheremove(DB *, DBCENT *);
+static int     _db_cachesize(DB *, size_t);
+static void    _db_endthread(void *);
+static void    _db_checkpoint(DB *);
+static void    _db_commit(DB *);
+static uint32_t _db_crc32(const char *, size_t);
 static void    _db_dodelete(DB *);
 static int	    _db_find_and_lock(DB *, const char *, int);
 static int     _db_findfree(DB *, int, int);
 static void    _db_free(DB *);
+static void    _db_genopen(DB *, int, int);
 static DBHASH  _db_hash(DB *, const char *);
+static void    _db_lock(DB *, int, int);
+static int     _db_lockfd(DB *, int, off_t *, off_t *);
+static void    _db_logwrite(DB *, int, off_t, struct iovec *, int);
+static int     _db_walnew(DB *);
+static int     _db_walown(int, int, int);
 static char   *_db_readdat(DB *);
 static off_t   _db_readidx(DB *, off_t);
 static off_t   _db_readptr(DB *, off_t);
+static void    _db_recover(DB *, int);
+static int     _db_scan(DB *, DBSCAN *, int);
+static void   *_db_scanthread(void *);
+static DB     *_db_thread(DB *);
+static int     _db_threadinit(DB *);
+static void    _db_unlock(DB *, int, int);
+static void    _db_waitwriters(DB *);
+static int     _db_walapply(DB *, const char *, size_t);
+static int     _db_walopen(DB *, off_t, int);
+static void    _db_walpatch(DB *, int, off_t, char *, size_t);
 static void    _db_writedat(DB *, const char *, off_t, int);
 static void    _db_writeidx(DB *, const char *, off_t, int, off_t);
 static void    _db_writeptr(DB *, off_t, off_t);
@@ -91,6 +334,7 @@ db_open(const char *pathname, int oflag, ...)
 				hash[(NHASH_DEF + 1) * PTR_SZ + 2];
 					/* +2 for newline and null */
 	struct stat	statbuff;
+	BPTHDR		hdr;
 
 	/*
 	 * Allocate a DB structure, and the buffers it needs.
@@ -161,6 +405,54 @@ db_open(const char *pathname, int oflag, ...)
 		if (un_lock(db->idxfd, 0, SEEK_SET, 0) < 0)
 			err_dump("db_open: un_lock error");
 	}
+
+	_db_genopen(db, len, oflag);
+
+	/*
+	 * Bring the files up to date with any transactions that were
+	 * logged but not yet checkpointed when the last writer died.
+	 * If there's an ordered index, we have to keep it up to date,
+	 * too.  A truncated database starts over with neither.
+	 */
+	if ((oflag & O_ACCMODE) != O_RDONLY && (oflag & O_TRUNC)) {
+		strcpy(db->name + len, ".wal");
+		if (unlink(db->name) < 0 && errno != ENOENT)
+			err_sys("db_open: can't unlink %s", db->name);
+		strcpy(db->name + len, ".bpt");
+		if (unlink(db->name) < 0 && errno != ENOENT)
+			err_sys("db_open: can't unlink %s", db->name);
+	} else {
+		strcpy(db->name + len, ".bpt");
+		if ((db->bptfd = open(db->name, oflag & O_ACCMODE)) < 0 &&
+		  errno != ENOENT)
+			err_sys("db_open: can't open %s", db->name);
+		if ((oflag & O_ACCMODE) != O_RDONLY)
+			_db_recover(db, len);
+
+		/*
+		 * No magic number means the index was never finished.
+		 */
+		if (db->bptfd >= 0) {
+			if (pread(db->bptfd, &hdr, sizeof(BPTHDR), 0) !=
+			  sizeof(BPTHDR) || hdr.magic != BPT_MAGIC) {
+				close(db->bptfd);
+				db->bptfd = -1;
+			}
+		}
+	}
+
+	/*
+	 * We looked without the lock, so an index being built right now
+	 * went unseen; make the first write look again, properly.
+	 */
+	if (db->gen != NULL)
+		db->bptgen = db->gen[db->nhash] - 1;
+
+	/*
+	 * If there's a log, we have to use it, too.
+	 */
+	if ((oflag & O_ACCMODE) != O_RDONLY)
+		_db_walopen(db, WAL_CKPT_DEF, 0);
 	db_rewind(db);
 	return(db);
 }
@@ -178,7 +470,7 @@ _db_alloc(int namelen)
 	 */
 	if ((db = calloc(1, sizeof(DB))) == NULL)
 		err_dump("_db_alloc: calloc error for DB");
-	db->idxfd = db->datfd = -1;				/* descriptors */
+	db->idxfd = db->datfd = db->walfd = db->bptfd = -1;	/* descriptors */
 
 	/*
 	 * Allocate room for the name.
@@ -214,10 +506,47 @@ db_close(DBHANDLE h)
 static void
 _db_free(DB *db)
 {
+	DBSHARE	*sp;
+	DB		*tdb;
+	int		i;
+
+	if ((sp = db->share) != NULL) {
+		pthread_key_delete(sp->key);
+		while ((tdb = sp->list) != NULL) {
+			sp->list = tdb->tnext;
+			free(tdb->idxbuf);
+			free(tdb->datbuf);
+			free(tdb->walbuf);
+			free(tdb->ordpg);
+			free(tdb->ordkey);
+			free(tdb);
+		}
+		for (i = 0; i < NSTRIPE + LK_NLOCKS - 1; i++) {
+			pthread_rwlock_destroy(&sp->lock[i].rwlock);
+			pthread_mutex_destroy(&sp->lock[i].mutex);
+		}
+		pthread_mutex_destroy(&sp->mutex);
+		free(sp->nread);
+		free(sp);
+	}
 	if (db->idxfd >= 0)
 		close(db->idxfd);
 	if (db->datfd >= 0)
 		close(db->datfd);
+	if (db->walfd >= 0)
+		close(db->walfd);
+	if (db->walbuf != NULL)
+		free(db->walbuf);
+	if (db->bptfd >= 0)
+		close(db->bptfd);
+	if (db->ordpg != NULL)
+		free(db->ordpg);
+	if (db->ordkey != NULL)
+		free(db->ordkey);
+	if (db->cache != NULL)
+		_db_cachesize(db, 0);
+	if (db->gen != NULL)
+		munmap((void *)db->gen, (db->nhash + 2) * sizeof(uint32_t));
 	if (db->idxbuf != NULL)
 		free(db->idxbuf);
 	if (db->datbuf != NULL)
@@ -233,25 +562,52 @@ _db_free(DB *db)
 char *
 db_fetch(DBHANDLE h, const char *key)
 {
-	DB      *db = h;
+	DB      *db = _db_thread(h);
 	char	*ptr;
 
+	/*
+	 * A cache hit needs no locks and no I/O at all.
+	 */
+	if (db->cache != NULL && (ptr = _db_cacheget(db, key)) != NULL) {
+		db->cnt_fetchok++;
+		return(ptr);
+	}
+
 	if (_db_find_and_lock(db, key, 0) < 0) {
 		ptr = NULL;				/* error, record not found */
 		db->cnt_fetcherr++;
 	} else {
 		ptr = _db_readdat(db);	/* return pointer to data */
 		db->cnt_fetchok++;
+		if (db->cache != NULL)
+			_db_cacheput(db, key, ptr);	/* chain is still locked */
 	}
 
 	/*
 	 * Unlock the hash chain that _db_find_and_lock locked.
 	 */
-	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-		err_dump("db_fetch: un_lock error");
+	_db_unlock(db, LK_CHAIN, F_RDLCK);
 	return(ptr);
 }
 
+/*
+ * Fetch a record into the caller's buffer, which is the way for
+ * threads sharing a handle to keep the data past their next call.
+ */
+char *
+db_fetch_r(DBHANDLE h, const char *key, char *buf, size_t size)
+{
+	char	*ptr;
+
+	if ((ptr = db_fetch(h, key)) == NULL)
+		return(NULL);
+	if (strlen(ptr) >= size) {
+		errno = ERANGE;
+		return(NULL);
+	}
+	return(strcpy(buf, ptr));
+}
+
 /*
  * Find the specified record.  Called by db_delete, db_fetch,
  * and db_store.  Returns with the hash chain locked.
@@ -275,11 +631,18 @@ _db_find_and_lock(DB *db, const char *key, int writelock)
 	 * when done.  Note we lock and unlock only the first byte.
 	 */
 	if (writelock) {
-		if (writew_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-			err_dump("_db_find_and_lock: writew_lock error");
+		_db_lock(db, LK_CHAIN, F_WRLCK);
+
+		/*
+		 * Invalidate every cached copy of this chain before we
+		 * change it.  Doing it first means that even if we die
+		 * halfway through, no cache holds what was there before.
+		 */
+		if (db->gen != NULL)
+			__sync_fetch_and_add(&db->gen[(db->chainoff -
+			  db->hashoff) / PTR_SZ], 1);
 	} else {
-		if (readw_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-			err_dump("_db_find_and_lock: readw_lock error");
+		_db_lock(db, LK_CHAIN, F_RDLCK);
 	}
 
 	/*
@@ -325,10 +688,15 @@ _db_readptr(DB *db, off_t offset)
 {
 	char	asciiptr[PTR_SZ + 1];
 
-	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
-		err_dump("_db_readptr: lseek error to ptr field");
-	if (read(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ)
-		err_dump("_db_readptr: read error of ptr field");
+	if (pread(db->idxfd, asciiptr, PTR_SZ, offset) != PTR_SZ)
+		err_dump("_db_readptr: pread error of ptr field");
+
+	/*
+	 * db_store rereads the hash chain ptr after _db_dodelete may
+	 * have rewritten it, so look through our own logged writes too.
+	 */
+	if (db->wallen > 0)
+		_db_walpatch(db, WAL_IDX, offset, asciiptr, PTR_SZ);
 	asciiptr[PTR_SZ] = 0;		/* null terminate */
 	return(atol(asciiptr));
 }
@@ -349,13 +717,12 @@ _db_readidx(DB *db, off_t offset)
 	struct iovec	iov[2];
 
 	/*
-	 * Position index file and record the offset.  db_nextrec
-	 * calls us with offset==0, meaning read from current offset.
-	 * We still need to call lseek to record the current offset.
+	 * Record the offset.  db_nextrec calls us with offset==0,
+	 * meaning read the record after the one it read last.  We
+	 * use pread throughout, since in thread mode the descriptors
+	 * are shared and have no offset of their own to speak of.
 	 */
-	if ((db->idxoff = lseek(db->idxfd, offset,
-	  offset == 0 ? SEEK_CUR : SEEK_SET)) == -1)
-		err_dump("_db_readidx: lseek error");
+	db->idxoff = (offset == 0) ? db->scanoff : offset;
 
 	/*
 	 * Read the ascii chain ptr and the ascii length at
@@ -366,10 +733,11 @@ _db_readidx(DB *db, off_t offset)
 	iov[0].iov_len  = PTR_SZ;
 	iov[1].iov_base = asciilen;
 	iov[1].iov_len  = IDXLEN_SZ;
-	if ((i = readv(db->idxfd, &iov[0], 2)) != PTR_SZ + IDXLEN_SZ) {
+	if ((i = preadv(db->idxfd, &iov[0], 2, db->idxoff)) !=
+	  PTR_SZ + IDXLEN_SZ) {
 		if (i == 0 && offset == 0)
 			return(-1);		/* EOF for db_nextrec */
-		err_dump("_db_readidx: readv error of index record");
+		err_dump("_db_readidx: preadv error of index record");
 	}
 
 	/*
@@ -387,8 +755,11 @@ _db_readidx(DB *db, off_t offset)
 	 * Now read the actual index record.  We read it into the key
 	 * buffer that we malloced when we opened the database.
 	 */
-	if ((i = read(db->idxfd, db->idxbuf, db->idxlen)) != db->idxlen)
-		err_dump("_db_readidx: read error of index record");
+	if ((i = pread(db->idxfd, db->idxbuf, db->idxlen,
+	  db->idxoff + PTR_SZ + IDXLEN_SZ)) != db->idxlen)
+		err_dump("_db_readidx: pread error of index record");
+	if (offset == 0)
+		db->scanoff = db->idxoff + PTR_SZ + IDXLEN_SZ + db->idxlen;
 	if (db->idxbuf[db->idxlen-1] != NEWLINE)	/* sanity check */
 		err_dump("_db_readidx: missing newline");
 	db->idxbuf[db->idxlen-1] = 0;	 /* replace newline with null */
@@ -424,10 +795,8 @@ _db_readidx(DB *db, off_t offset)
 static char *
 _db_readdat(DB *db)
 {
-	if (lseek(db->datfd, db->datoff, SEEK_SET) == -1)
-		err_dump("_db_readdat: lseek error");
-	if (read(db->datfd, db->datbuf, db->datlen) != db->datlen)
-		err_dump("_db_readdat: read error");
+	if (pread(db->datfd, db->datbuf, db->datlen, db->datoff) != db->datlen)
+		err_dump("_db_readdat: pread error");
 	if (db->datbuf[db->datlen-1] != NEWLINE)	/* sanity check */
 		err_dump("_db_readdat: missing newline");
 	db->datbuf[db->datlen-1] = 0; /* replace newline with null */
@@ -440,18 +809,33 @@ _db_readdat(DB *db)
 int
 db_delete(DBHANDLE h, const char *key)
 {
-	DB		*db = h;
-	int		rc = 0;			/* assume record will be found */
+	DB		*db = _db_thread(h);
+	int		rc;
 
-	if (_db_find_and_lock(db, key, 1) == 0) {
+again:
+	rc = _db_find_and_lock(db, key, 1);
+	if (_db_walnew(db))
+		_db_walopen(db, WAL_CKPT_DEF, 0);
+	if (rc == 0) {
+		if (_db_bptnew(db)) {
+			_db_unlock(db, LK_CHAIN, F_WRLCK);
+			_db_bptopen(db);
+			goto again;
+		}
+		if (db->bptfd >= 0) {
+			_db_lock(db, LK_BPT, F_WRLCK);
+			_db_bptdelete(db, key);
+			_db_bptdone(db);
+		}
 		_db_dodelete(db);
 		db->cnt_delok++;
 	} else {
 		rc = -1;			/* not found */
 		db->cnt_delerr++;
 	}
-	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-		err_dump("db_delete: un_lock error");
+	if (db->walfd >= 0)
+		_db_commit(db);
+	_db_unlock(db, LK_CHAIN, F_WRLCK);
 	return(rc);
 }
 
@@ -480,8 +864,7 @@ _db_dodelete(DB *db)
 	/*
 	 * We have to lock the free list.
 	 */
-	if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_dodelete: writew_lock error");
+	_db_lock(db, LK_FREE, F_WRLCK);
 
 	/*
 	 * Write the data record with all blanks.
@@ -520,8 +903,10 @@ _db_dodelete(DB *db)
 	 * contents of the deleted record's chain ptr, saveptr.
 	 */
 	_db_writeptr(db, db->ptroff, saveptr);
-	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_dodelete: un_lock error");
+	if (db->walfd >= 0)
+		db->txnlocks |= TXN_FREE;	/* until _db_commit */
+	else
+		_db_unlock(db, LK_FREE, F_WRLCK);
 }
 
 /*
@@ -539,24 +924,34 @@ _db_writedat(DB *db, const char *data, off_t offset, int whence)
 	 * and write to make the two an atomic operation.  If we're
 	 * overwriting an existing record, we don't have to lock.
 	 */
-	if (whence == SEEK_END) /* we're appending, lock entire file */
-		if (writew_lock(db->datfd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: writew_lock error");
-
-	if ((db->datoff = lseek(db->datfd, offset, whence)) == -1)
-		err_dump("_db_writedat: lseek error");
+	if (whence == SEEK_END) { /* we're appending, lock entire file */
+		_db_lock(db, LK_DATAPP, F_WRLCK);
+		if ((offset = lseek(db->datfd, 0, SEEK_END)) == -1)
+			err_dump("_db_writedat: lseek error");
+	}
+	db->datoff = offset;
 	db->datlen = strlen(data) + 1;	/* datlen includes newline */
 
 	iov[0].iov_base = (char *) data;
 	iov[0].iov_len  = db->datlen - 1;
 	iov[1].iov_base = &newline;
 	iov[1].iov_len  = 1;
-	if (writev(db->datfd, &iov[0], 2) != db->datlen)
-		err_dump("_db_writedat: writev error of data record");
+
+	/*
+	 * When logging, the write is only buffered until _db_commit,
+	 * so the append lock has to be held until then, too.
+	 */
+	if (db->walfd >= 0) {
+		_db_logwrite(db, WAL_DAT, db->datoff, &iov[0], 2);
+		if (whence == SEEK_END)
+			db->txnlocks |= TXN_DATAPP;
+		return;
+	}
+	if (pwritev(db->datfd, &iov[0], 2, db->datoff) != db->datlen)
+		err_dump("_db_writedat: pwritev error of data record");
 
 	if (whence == SEEK_END)
-		if (un_lock(db->datfd, 0, SEEK_SET, 0) < 0)
-			err_dump("_db_writedat: un_lock error");
+		_db_unlock(db, LK_DATAPP, F_WRLCK);
 }
 
 /*
@@ -587,28 +982,33 @@ _db_writeidx(DB *db, const char *key,
 	 * and write to make the two an atomic operation.  If we're
 	 * overwriting an existing record, we don't have to lock.
 	 */
-	if (whence == SEEK_END)		/* we're appending */
-		if (writew_lock(db->idxfd, ((db->nhash+1)*PTR_SZ)+1,
-		  SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: writew_lock error");
+	if (whence == SEEK_END) {	/* we're appending */
+		_db_lock(db, LK_IDXAPP, F_WRLCK);
+		if ((offset = lseek(db->idxfd, 0, SEEK_END)) == -1)
+			err_dump("_db_writeidx: lseek error");
+	}
 
 	/*
-	 * Position the index file and record the offset.
+	 * Record the offset.
 	 */
-	if ((db->idxoff = lseek(db->idxfd, offset, whence)) == -1)
-		err_dump("_db_writeidx: lseek error");
+	db->idxoff = offset;
 
 	iov[0].iov_base = asciiptrlen;
 	iov[0].iov_len  = PTR_SZ + IDXLEN_SZ;
 	iov[1].iov_base = db->idxbuf;
 	iov[1].iov_len  = len;
-	if (writev(db->idxfd, &iov[0], 2) != PTR_SZ + IDXLEN_SZ + len)
-		err_dump("_db_writeidx: writev error of index record");
+	if (db->walfd >= 0) {
+		_db_logwrite(db, WAL_IDX, db->idxoff, &iov[0], 2);
+		if (whence == SEEK_END)
+			db->txnlocks |= TXN_IDXAPP;
+		return;
+	}
+	if (pwritev(db->idxfd, &iov[0], 2, db->idxoff) !=
+	  PTR_SZ + IDXLEN_SZ + len)
+		err_dump("_db_writeidx: pwritev error of index record");
 
 	if (whence == SEEK_END)
-		if (un_lock(db->idxfd, ((db->nhash+1)*PTR_SZ)+1,
-		  SEEK_SET, 0) < 0)
-			err_dump("_db_writeidx: un_lock error");
+		_db_unlock(db, LK_IDXAPP, F_WRLCK);
 }
 
 /*
@@ -624,10 +1024,16 @@ _db_writeptr(DB *db, off_t offset, off_t ptrval)
 		err_quit("_db_writeptr: invalid ptr: %d", ptrval);
 	sprintf(asciiptr, "%*lld", PTR_SZ, (long long)ptrval);
 
-	if (lseek(db->idxfd, offset, SEEK_SET) == -1)
-		err_dump("_db_writeptr: lseek error to ptr field");
-	if (write(db->idxfd, asciiptr, PTR_SZ) != PTR_SZ)
-		err_dump("_db_writeptr: write error of ptr field");
+	if (db->walfd >= 0) {
+		struct iovec	iov;
+
+		iov.iov_base = asciiptr;
+		iov.iov_len  = PTR_SZ;
+		_db_logwrite(db, WAL_IDX, offset, &iov, 1);
+		return;
+	}
+	if (pwrite(db->idxfd, asciiptr, PTR_SZ, offset) != PTR_SZ)
+		err_dump("_db_writeptr: pwrite error of ptr field");
 }
 
 /*
@@ -637,7 +1043,7 @@ _db_writeptr(DB *db, off_t offset, off_t ptrval)
 int
 db_store(DBHANDLE h, const char *key, const char *data, int flag)
 {
-	DB		*db = h;
+	DB		*db = _db_thread(h);
 	int		rc, keylen, datlen;
 	off_t	ptrval;
 
@@ -657,8 +1063,13 @@ db_store(DBHANDLE h, const char *key, const char *data, int flag)
 	 * exists or not. The following calls to _db_writeptr change the
 	 * hash table entry for this chain to point to the new record.
 	 * The new record is added to the front of the hash chain.
+	 * If someone started a log, from now on we have to log, too.
 	 */
-	if (_db_find_and_lock(db, key, 1) < 0) { /* record not found */
+again:
+	rc = _db_find_and_lock(db, key, 1);
+	if (_db_walnew(db))
+		_db_walopen(db, WAL_CKPT_DEF, 0);
+	if (rc < 0) { /* record not found */
 		if (flag == DB_REPLACE) {
 			rc = -1;
 			db->cnt_storerr++;
@@ -666,6 +1077,22 @@ db_store(DBHANDLE h, const char *key, const char *data, int flag)
 			goto doreturn;
 		}
 
+		/*
+		 * A new key goes into the ordered index, if any.  If one
+		 * was just created, we can't wait for it to be built while
+		 * we hold the chain lock, so we let go and start over.
+		 */
+		if (_db_bptnew(db)) {
+			_db_unlock(db, LK_CHAIN, F_WRLCK);
+			_db_bptopen(db);
+			goto again;
+		}
+		if (db->bptfd >= 0) {
+			_db_lock(db, LK_BPT, F_WRLCK);
+			_db_bptinsert(db, key);
+			_db_bptdone(db);
+		}
+
 		/*
 		 * _db_find_and_lock locked the hash chain for us; read
 		 * the chain ptr to the first index record on hash chain.
@@ -740,8 +1167,9 @@ db_store(DBHANDLE h, const char *key, const char *data, int flag)
 	rc = 0;		/* OK */
 
 doreturn:	/* unlock hash chain locked by _db_find_and_lock */
-	if (un_lock(db->idxfd, db->chainoff, SEEK_SET, 1) < 0)
-		err_dump("db_store: un_lock error");
+	if (db->walfd >= 0)
+		_db_commit(db);
+	_db_unlock(db, LK_CHAIN, F_WRLCK);
 	return(rc);
 }
 
@@ -758,8 +1186,7 @@ _db_findfree(DB *db, int keylen, int datlen)
 	/*
 	 * Lock the free list.
 	 */
-	if (writew_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_findfree: writew_lock error");
+	_db_lock(db, LK_FREE, F_WRLCK);
 
 	/*
 	 * Read the free list pointer.
@@ -797,10 +1224,13 @@ _db_findfree(DB *db, int keylen, int datlen)
 	}
 
 	/*
-	 * Unlock the free list.
+	 * Unlock the free list, unless the transaction has to commit
+	 * first.
 	 */
-	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("_db_findfree: un_lock error");
+	if (db->walfd >= 0)
+		db->txnlocks |= TXN_FREE;
+	else
+		_db_unlock(db, LK_FREE, F_WRLCK);
 	return(rc);
 }
 
@@ -812,18 +1242,17 @@ _db_findfree(DB *db, int keylen, int datlen)
 void
 db_rewind(DBHANDLE h)
 {
-	DB		*db = h;
+	DB		*db = _db_thread(h);
 	off_t	offset;
 
 	offset = (db->nhash + 1) * PTR_SZ;	/* +1 for free list ptr */
 
 	/*
-	 * We're just setting the file offset for this process
-	 * to the start of the index records; no need to lock.
+	 * We're just setting our scan offset to the start
+	 * of the index records; no need to lock.
 	 * +1 below for newline at end of hash table.
 	 */
-	if ((db->idxoff = lseek(db->idxfd, offset+1, SEEK_SET)) == -1)
-		err_dump("db_rewind: lseek error");
+	db->scanoff = db->idxoff = offset + 1;
 }
 
 /*
@@ -835,7 +1264,7 @@ db_rewind(DBHANDLE h)
 char *
 db_nextrec(DBHANDLE h, char *key)
 {
-	DB		*db = h;
+	DB		*db = _db_thread(h);
 	char	c;
 	char	*ptr;
 
@@ -843,8 +1272,7 @@ db_nextrec(DBHANDLE h, char *key)
 	 * We read lock the free list so that we don't read
 	 * a record in the middle of its being deleted.
 	 */
-	if (readw_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("db_nextrec: readw_lock error");
+	_db_lock(db, LK_FREE, F_RDLCK);
 
 	do {
 		/*
@@ -869,7 +1297,1742 @@ db_nextrec(DBHANDLE h, char *key)
 	db->cnt_nextrec++;
 
 doreturn:
-	if (un_lock(db->idxfd, FREE_OFF, SEEK_SET, 1) < 0)
-		err_dump("db_nextrec: un_lock error");
+	_db_unlock(db, LK_FREE, F_RDLCK);
 	return(ptr);
 }
+
+/*
+ * Call func(arg, key, data) for every record in the database,
+ * using nthreads threads that each read part of the index file.
+ * The calls are made concurrently and in no particular order, and
+ * data is good only until func returns.  If func returns nonzero,
+ * the scan stops as soon as the other threads notice and db_scan
+ * returns that value; otherwise it returns 0.
+ *
+ * Like db_nextrec, records stored after the scan starts may or may
+ * not be seen, but no records can be deleted while it's running.
+ */
+int
+db_scan(DBHANDLE h, int nthreads,
+  int (*func)(void *, const char *, const char *), void *arg)
+{
+	DB		*db = _db_thread(h);
+	DBSCAN	*sp;
+	int		i, rc;
+
+	if (nthreads < 1 || func == NULL) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if ((sp = calloc(nthreads, sizeof(DBSCAN))) == NULL)
+		err_dump("db_scan: calloc error");
+	for (i = 0; i < nthreads; i++) {
+		sp[i].func = func;
+		sp[i].arg = arg;
+	}
+	rc = _db_scan(db, sp, nthreads);
+	free(sp);
+	return(rc);
+}
+
+/*
+ * Divide the index records among the workers and run them.
+ */
+static int
+_db_scan(DB *db, DBSCAN *sp, int nthreads)
+{
+	struct stat		statbuff;
+	off_t			start, part;
+	volatile int	stop = 0;
+	int				i, err, rc;
+
+	/*
+	 * As in db_nextrec, a read lock on the free list keeps
+	 * records from being deleted under us.  The end of the
+	 * file is only stable while no one is appending to it.
+	 */
+	_db_lock(db, LK_FREE, F_RDLCK);
+	_db_lock(db, LK_IDXAPP, F_RDLCK);
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_scan: fstat error");
+	_db_unlock(db, LK_IDXAPP, F_RDLCK);
+
+	start = ((db->nhash + 1) * PTR_SZ) + 1;
+	part = (statbuff.st_size - start) / nthreads;
+	for (i = 0; i < nthreads; i++) {
+		sp[i].db = db;
+		sp[i].lo = start + i * part;
+		sp[i].hi = (i == nthreads - 1) ? statbuff.st_size :
+		  sp[i].lo + part;
+		sp[i].stop = &stop;
+	}
+
+	/*
+	 * If we can't start a thread, we do its part ourselves.
+	 */
+	for (i = 1; i < nthreads; i++) {
+		if ((err = pthread_create(&sp[i].tid, NULL, _db_scanthread,
+		  &sp[i])) == 0)
+			sp[i].started = 1;
+	}
+	_db_scanthread(&sp[0]);
+	rc = sp[0].rc;
+	for (i = 1; i < nthreads; i++) {
+		if (sp[i].started) {
+			if ((err = pthread_join(sp[i].tid, NULL)) != 0)
+				err_exit(err, "_db_scan: can't join thread");
+		} else {
+			_db_scanthread(&sp[i]);
+		}
+		if (rc == 0)
+			rc = sp[i].rc;
+	}
+	_db_unlock(db, LK_FREE, F_RDLCK);
+	return(rc);
+}
+
+/*
+ * Read the records in our part of the index file.  We read the
+ * index a big buffer at a time.  Data records are mostly appended
+ * in the same order as their index records, so we read those through
+ * a window on the data file too, rather than one pread per record.
+ */
+static void *
+_db_scanthread(void *arg)
+{
+	DBSCAN	*sp = arg;
+	DB		*db = sp->db;
+	char	*ibuf, *dbuf, *rec, *ptr1, *ptr2, *nl;
+	char	asciilen[IDXLEN_SZ + 1];
+	off_t	off, ioff, doff, datoff;
+	ssize_t	ilen, dlen;
+	size_t	idxlen, datlen;
+	int		rc;
+
+	if ((ibuf = malloc(SCAN_BUFSZ)) == NULL ||
+	  (dbuf = malloc(SCAN_BUFSZ)) == NULL ||
+	  (rec = malloc(IDXLEN_MAX + 1)) == NULL)
+		err_dump("_db_scanthread: malloc error");
+	ioff = doff = 0;
+	ilen = dlen = 0;
+
+	/*
+	 * Unless we start at the first record, our first record is
+	 * the one after the first newline at or past lo-1.
+	 */
+	off = sp->lo;
+	if (off > ((db->nhash + 1) * PTR_SZ) + 1) {
+		for (off--; off < sp->hi; off = ioff + ilen) {
+			if ((ilen = pread(db->idxfd, ibuf, SCAN_BUFSZ, off)) < 0)
+				err_dump("_db_scanthread: pread error");
+			ioff = off;
+			if ((nl = memchr(ibuf, NEWLINE, ilen)) != NULL) {
+				off = ioff + (nl - ibuf) + 1;
+				break;
+			}
+			if (ilen == 0)
+				off = sp->hi;
+		}
+	}
+
+	while (off < sp->hi && !*sp->stop) {
+		/*
+		 * Make sure the whole record is in the buffer: first
+		 * its length, then the rest of it.
+		 */
+		if (off + PTR_SZ + IDXLEN_SZ > ioff + ilen) {
+			if ((ilen = pread(db->idxfd, ibuf, SCAN_BUFSZ, off)) <
+			  PTR_SZ + IDXLEN_SZ)
+				err_dump("_db_scanthread: pread error of index record");
+			ioff = off;
+		}
+		memcpy(asciilen, ibuf + (off - ioff) + PTR_SZ, IDXLEN_SZ);
+		asciilen[IDXLEN_SZ] = 0;
+		if ((idxlen = atoi(asciilen)) < IDXLEN_MIN || idxlen > IDXLEN_MAX)
+			err_dump("_db_scanthread: invalid length");
+		if (off + PTR_SZ + IDXLEN_SZ + idxlen > ioff + ilen) {
+			if ((ilen = pread(db->idxfd, ibuf, SCAN_BUFSZ, off)) <
+			  (ssize_t)(PTR_SZ + IDXLEN_SZ + idxlen))
+				err_dump("_db_scanthread: pread error of index record");
+			ioff = off;
+		}
+		memcpy(rec, ibuf + (off - ioff) + PTR_SZ + IDXLEN_SZ, idxlen);
+		off += PTR_SZ + IDXLEN_SZ + idxlen;
+
+		/*
+		 * Split the record the same way _db_readidx does.
+		 */
+		if (rec[idxlen-1] != NEWLINE)
+			err_dump("_db_scanthread: missing newline");
+		rec[idxlen-1] = 0;
+		if ((ptr1 = strchr(rec, SEP)) == NULL ||
+		  (ptr2 = strchr(ptr1 + 1, SEP)) == NULL)
+			err_dump("_db_scanthread: missing separator");
+		*ptr1++ = 0;
+		*ptr2++ = 0;
+		if ((datoff = atol(ptr1)) < 0 ||
+		  (datlen = atol(ptr2)) <= 0 || datlen > DATLEN_MAX)
+			err_dump("_db_scanthread: invalid data offset or length");
+
+		if (rec[strspn(rec, " ")] == 0) {	/* deleted */
+			if (sp->chainlen != NULL) {
+				sp->nfree++;
+				sp->freeidx += PTR_SZ + IDXLEN_SZ + idxlen;
+				sp->freedat += datlen;
+				if (datlen > sp->maxfree)
+					sp->maxfree = datlen;
+			}
+			continue;
+		}
+		if (sp->chainlen != NULL) {
+			sp->chainlen[_db_hash(db, rec)]++;
+			continue;
+		}
+
+		if (datoff < doff || datoff + datlen > doff + dlen) {
+			if ((dlen = pread(db->datfd, dbuf, SCAN_BUFSZ, datoff)) <
+			  (ssize_t)datlen)
+				err_dump("_db_scanthread: pread error of data record");
+			doff = datoff;
+		}
+		if (dbuf[datoff - doff + datlen - 1] != NEWLINE)
+			err_dump("_db_scanthread: missing newline in data");
+		dbuf[datoff - doff + datlen - 1] = 0;
+		rc = (*sp->func)(sp->arg, rec, dbuf + (datoff - doff));
+		dbuf[datoff - doff + datlen - 1] = NEWLINE;
+		if (rc != 0) {
+			sp->rc = rc;
+			*sp->stop = 1;
+		}
+	}
+	free(ibuf);
+	free(dbuf);
+	free(rec);
+	return(NULL);
+}
+
+/*
+ * Print the handle's counters, summed over all the threads using it,
+ * and what a scan of the files shows about the lengths of the hash
+ * chains and the space taken by deleted records.
+ */
+int
+db_dumpstats(DBHANDLE h, FILE *fp, int nthreads)
+{
+	DB			*db = _db_thread(h), tot;
+	DB			*tdb;
+	DBSCAN		*sp;
+	COUNT		*chainlen, *dist, nrec, maxlen, n;
+	struct stat	idxstat, datstat;
+	DBHASH		i;
+	int			j;
+
+	if (nthreads < 1) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	/*
+	 * Thread copies add their counts to the handle's when the
+	 * threads exit; until then, we have to add them up ourselves.
+	 */
+	memset(&tot, 0, sizeof(tot));
+	_db_addcounts(&tot, h);
+	if (((DB *)h)->share != NULL) {
+		pthread_mutex_lock(&((DB *)h)->share->mutex);
+		for (tdb = ((DB *)h)->share->list; tdb != NULL; tdb = tdb->tnext)
+			_db_addcounts(&tot, tdb);
+		pthread_mutex_unlock(&((DB *)h)->share->mutex);
+	}
+	fprintf(fp, "fetch: %lu ok, %lu not found\n",
+	  tot.cnt_fetchok, tot.cnt_fetcherr);
+	fprintf(fp, "cache: %lu hits, %lu misses\n",
+	  tot.cnt_cachehit, tot.cnt_cachemiss);
+	fprintf(fp, "store: %lu appended, %lu reused, %lu replaced "
+	  "by append, %lu replaced in place, %lu errors\n", tot.cnt_stor1,
+	  tot.cnt_stor2, tot.cnt_stor3, tot.cnt_stor4, tot.cnt_storerr);
+	fprintf(fp, "delete: %lu ok, %lu not found\n",
+	  tot.cnt_delok, tot.cnt_delerr);
+	fprintf(fp, "nextrec: %lu\n", tot.cnt_nextrec);
+	fprintf(fp, "log: %lu commits, %lu checkpoints\n",
+	  tot.cnt_commit, tot.cnt_ckpt);
+
+	/*
+	 * Each worker counts into its own array; we add them up after.
+	 */
+	if ((sp = calloc(nthreads, sizeof(DBSCAN))) == NULL ||
+	  (chainlen = calloc(db->nhash * (nthreads + 1), sizeof(COUNT))) == NULL)
+		err_dump("db_dumpstats: calloc error");
+	for (j = 0; j < nthreads; j++)
+		sp[j].chainlen = chainlen + (j + 1) * db->nhash;
+	_db_scan(db, sp, nthreads);
+	if (fstat(db->idxfd, &idxstat) < 0 || fstat(db->datfd, &datstat) < 0)
+		err_sys("db_dumpstats: fstat error");
+
+	nrec = maxlen = 0;
+	for (j = 0; j < nthreads; j++) {
+		for (i = 0; i < db->nhash; i++)
+			chainlen[i] += sp[j].chainlen[i];
+		if (j > 0) {
+			sp[0].nfree += sp[j].nfree;
+			sp[0].freeidx += sp[j].freeidx;
+			sp[0].freedat += sp[j].freedat;
+			if (sp[j].maxfree > sp[0].maxfree)
+				sp[0].maxfree = sp[j].maxfree;
+		}
+	}
+	for (i = 0; i < db->nhash; i++) {
+		nrec += chainlen[i];
+		if (chainlen[i] > maxlen)
+			maxlen = chainlen[i];
+	}
+	fprintf(fp, "records: %lu in %lu chains, %.2f per chain\n", nrec,
+	  (COUNT)db->nhash, (double)nrec / db->nhash);
+
+	if ((dist = calloc(maxlen + 1, sizeof(COUNT))) == NULL)
+		err_dump("db_dumpstats: calloc error");
+	for (i = 0; i < db->nhash; i++)
+		dist[chainlen[i]]++;
+	fprintf(fp, "chain length: #chains\n");
+	for (n = 0; n <= maxlen; n++) {
+		if (dist[n] != 0)
+			fprintf(fp, "  %6lu: %lu\n", n, dist[n]);
+	}
+	free(dist);
+
+	fprintf(fp, "free: %lu deleted records, %lu index bytes "
+	  "(%.1f%%), %lu data bytes (%.1f%%), largest %lu\n", sp[0].nfree,
+	  sp[0].freeidx, idxstat.st_size ? 100.0 * sp[0].freeidx /
+	  idxstat.st_size : 0.0, sp[0].freedat, datstat.st_size ?
+	  100.0 * sp[0].freedat / datstat.st_size : 0.0, sp[0].maxfree);
+	free(chainlen);
+	free(sp);
+	return(0);
+}
+
+/*
+ * Add the counters of one struct db to another's.
+ */
+static void
+_db_addcounts(DB *to, DB *from)
+{
+	to->cnt_delok += from->cnt_delok;
+	to->cnt_delerr += from->cnt_delerr;
+	to->cnt_fetchok += from->cnt_fetchok;
+	to->cnt_fetcherr += from->cnt_fetcherr;
+	to->cnt_nextrec += from->cnt_nextrec;
+	to->cnt_stor1 += from->cnt_stor1;
+	to->cnt_stor2 += from->cnt_stor2;
+	to->cnt_stor3 += from->cnt_stor3;
+	to->cnt_stor4 += from->cnt_stor4;
+	to->cnt_storerr += from->cnt_storerr;
+	to->cnt_commit += from->cnt_commit;
+	to->cnt_ckpt += from->cnt_ckpt;
+	to->cnt_cachehit += from->cnt_cachehit;
+	to->cnt_cachemiss += from->cnt_cachemiss;
+}
+
+/*
+ * Change the way an open database behaves.  Like fcntl(2),
+ * the optional third argument depends on the command.
+ */
+int
+db_ctl(DBHANDLE h, int cmd, ...)
+{
+	DB		*db = h;
+	va_list	ap;
+	long	arg;
+
+	/*
+	 * Once threads share the handle, copies of it are all over,
+	 * so only DB_CHECKPOINT can still be used.
+	 */
+	if (db->share != NULL && cmd != DB_CHECKPOINT) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	switch (cmd) {
+	case DB_WAL:
+		va_start(ap, cmd);
+		arg = va_arg(ap, long);
+		va_end(ap);
+		return(_db_walopen(db, arg > 0 ? arg : WAL_CKPT_DEF, 1));
+
+	case DB_CACHE:
+		va_start(ap, cmd);
+		arg = va_arg(ap, long);
+		va_end(ap);
+		if (arg < 0)
+			break;
+		return(_db_cachesize(db, arg));
+
+	case DB_CHECKPOINT:
+		if (db->walfd < 0)
+			break;
+		_db_checkpoint(_db_thread(db));
+		return(0);
+
+	case DB_THREADS:
+		return(_db_threadinit(db));
+
+	case DB_ORDERED:
+		return(_db_bptcreate(db));
+	}
+	errno = EINVAL;
+	return(-1);
+}
+
+/*
+ * Start logging writes.  The log lives next to the index and data
+ * files and is created with the same permissions as the index file.
+ * db_ctl creates it; db_open, and writers that see gen[nhash+1]
+ * change, only open one that exists, so that once there's a log,
+ * no write is made without it.  Returns 0 if we're logging, else -1.
+ */
+static int
+_db_walopen(DB *db, off_t ckpt, int create)
+{
+	DB			*hdb = (db->share != NULL) ? db->parent : db;
+	struct stat	statbuff;
+	char		*name;
+	int			len, fd;
+
+	db->walckpt = ckpt;
+	if (db->walfd >= 0)
+		return(0);		/* already logging */
+	if (create && db->gen == NULL) {
+		errno = ENOTSUP;	/* no way to tell the other handles */
+		return(-1);
+	}
+	if (db->share != NULL) {
+		pthread_mutex_lock(&db->share->mutex);
+		if (hdb->walfd >= 0) {	/* another thread opened it */
+			db->walfd = hdb->walfd;
+			pthread_mutex_unlock(&db->share->mutex);
+			return(0);
+		}
+	}
+
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_walopen: fstat error");
+	len = strlen(db->name) - 4;		/* name ends in ".dat", ".bpt", ... */
+	if ((name = malloc(len + 5)) == NULL)
+		err_dump("_db_walopen: malloc error for name");
+	memcpy(name, db->name, len);
+	strcpy(name + len, ".wal");
+	if (db->gen != NULL)
+		db->walgen = db->gen[db->nhash + 1];
+	if ((fd = open(name, O_RDWR | O_APPEND | (create ? O_CREAT : 0),
+	  statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0) {
+		if (!create && errno != ENOENT)
+			err_sys("_db_walopen: can't open %s", name);
+	} else if (_db_walown(fd, F_RDLCK, 1) < 0) {
+		err_sys("_db_walopen: can't lock %s", name);
+	}
+	free(name);
+	db->walfd = hdb->walfd = fd;
+	if (db->share != NULL)
+		pthread_mutex_unlock(&db->share->mutex);
+	if (fd < 0)
+		return(-1);
+
+	/*
+	 * Tell the handles that aren't logging, and wait for any of them
+	 * that missed it to finish its write.
+	 */
+	if (create) {
+		__sync_fetch_and_add(&db->gen[db->nhash + 1], 1);
+		_db_waitwriters(db);
+	}
+	return(0);
+}
+
+/*
+ * Has someone started a log since we last looked?  Writers ask with
+ * a hash chain locked, before they write anything.
+ */
+static int
+_db_walnew(DB *db)
+{
+	return(db->walfd < 0 && db->gen != NULL &&
+	  db->gen[db->nhash + 1] != db->walgen);
+}
+
+/*
+ * Lock byte WAL_OWNER of the log.  Where we can, we use open file
+ * description locks, which tell apart the handles of one process and
+ * aren't dropped when it closes some other descriptor for the file.
+ * If wait is zero, fail instead of blocking.
+ */
+#ifdef F_OFD_SETLK
+#define WAL_SETLK	F_OFD_SETLK
+#define WAL_SETLKW	F_OFD_SETLKW
+#else
+#define WAL_SETLK	F_SETLK
+#define WAL_SETLKW	F_SETLKW
+#endif
+
+static int
+_db_walown(int fd, int type, int wait)
+{
+	struct flock	lock;
+
+	memset(&lock, 0, sizeof(lock));		/* l_pid must be 0 for OFD locks */
+	lock.l_type = type;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = WAL_OWNER;
+	lock.l_len = 1;
+	return(fcntl(fd, wait ? WAL_SETLKW : WAL_SETLK, &lock));
+}
+
+/*
+ * Append one write to the current transaction.  Nothing reaches
+ * the log or the database files until _db_commit.
+ */
+static void
+_db_logwrite(DB *db, int file, off_t offset, struct iovec *iov, int cnt)
+{
+	WALENT	ent;
+	size_t	need;
+	int		i;
+
+	ent.off  = offset;
+	ent.file = file;
+	ent.len  = 0;
+	for (i = 0; i < cnt; i++)
+		ent.len += iov[i].iov_len;
+
+	if (db->wallen == 0)
+		db->wallen = sizeof(WALHDR);	/* room for header */
+	need = db->wallen + sizeof(WALENT) + ent.len;
+	if (need > db->walmax) {
+		db->walmax = max(need, 2 * db->walmax);
+		if ((db->walbuf = realloc(db->walbuf, db->walmax)) == NULL)
+			err_dump("_db_logwrite: realloc error for log buffer");
+	}
+
+	/*
+	 * WALENTs aren't aligned in the buffer, so copy them in and out.
+	 */
+	memcpy(db->walbuf + db->wallen, &ent, sizeof(WALENT));
+	db->wallen += sizeof(WALENT);
+	for (i = 0; i < cnt; i++) {
+		memcpy(db->walbuf + db->wallen, iov[i].iov_base, iov[i].iov_len);
+		db->wallen += iov[i].iov_len;
+	}
+}
+
+/*
+ * Overlay the writes of the current transaction that fall within
+ * the given range onto bytes just read from the file.
+ */
+static void
+_db_walpatch(DB *db, int file, off_t offset, char *buf, size_t len)
+{
+	WALENT	ent;
+	char	*ptr, *end;
+	off_t	lo, hi;
+
+	ptr = db->walbuf + sizeof(WALHDR);
+	end = db->walbuf + db->wallen;
+	while (ptr < end) {
+		memcpy(&ent, ptr, sizeof(WALENT));
+		ptr += sizeof(WALENT);
+		lo = max(offset, (off_t)ent.off);
+		hi = min(offset + (off_t)len, (off_t)ent.off + (off_t)ent.len);
+		if (ent.file == file && lo < hi)
+			memcpy(buf + (lo - offset), ptr + (lo - ent.off), hi - lo);
+		ptr += ent.len;
+	}
+}
+
+/*
+ * Make the writes of one transaction to the index and data files.
+ * Used by _db_commit and, after a crash, by _db_recover.  Returns
+ * -1 if the WALENTs don't exactly fill the buffer.
+ */
+static int
+_db_walapply(DB *db, const char *buf, size_t len)
+{
+	WALENT		ent;
+	const char	*end = buf + len;
+	int			fd;
+
+	while (buf < end) {
+		if (end - buf < sizeof(WALENT))
+			return(-1);
+		memcpy(&ent, buf, sizeof(WALENT));
+		buf += sizeof(WALENT);
+		if (ent.len > end - buf || ent.off < 0 || ent.file > WAL_BPT)
+			return(-1);
+		if (ent.file == WAL_IDX)
+			fd = db->idxfd;
+		else if (ent.file == WAL_DAT)
+			fd = db->datfd;
+		else
+			fd = db->bptfd;		/* -1 if it was removed */
+		if (fd >= 0 && pwrite(fd, buf, ent.len, ent.off) != ent.len)
+			err_dump("_db_walapply: pwrite error");
+		buf += ent.len;
+	}
+	return(0);
+}
+
+/*
+ * Commit the current transaction.  Called by db_store and
+ * db_delete, with the hash chain still locked.  The transaction is
+ * forced to the log with one sequential write and fdatasync; only
+ * then are the index and data files updated.  Those updates aren't
+ * synced until the next checkpoint, since the log can redo them.
+ */
+static void
+_db_commit(DB *db)
+{
+	WALHDR	hdr;
+	off_t	logsize = 0;
+
+	if (db->wallen > 0) {
+		hdr.magic = WAL_MAGIC;
+		hdr.len = db->wallen - sizeof(WALHDR);
+		hdr.crc = _db_crc32(db->walbuf + sizeof(WALHDR), hdr.len);
+		hdr.pad = 0;
+		memcpy(db->walbuf, &hdr, sizeof(WALHDR));
+
+		/*
+		 * A read lock on the log keeps a checkpoint from truncating
+		 * it between our append and our writes to the files.
+		 */
+		_db_lock(db, LK_WAL, F_RDLCK);
+		if (write(db->walfd, db->walbuf, db->wallen) != db->wallen)
+			err_dump("_db_commit: write error to log");
+		if (fdatasync(db->walfd) < 0)
+			err_dump("_db_commit: fdatasync error");
+		if (_db_walapply(db, db->walbuf + sizeof(WALHDR), hdr.len) < 0)
+			err_dump("_db_commit: bad transaction");
+		if ((logsize = lseek(db->walfd, 0, SEEK_END)) == -1)
+			err_dump("_db_commit: lseek error");
+		_db_unlock(db, LK_WAL, F_RDLCK);
+		db->wallen = 0;
+		db->cnt_commit++;
+	}
+
+	/*
+	 * Now other processes may see what we wrote.
+	 */
+	if (db->txnlocks & TXN_IDXAPP)
+		_db_unlock(db, LK_IDXAPP, F_WRLCK);
+	if (db->txnlocks & TXN_DATAPP)
+		_db_unlock(db, LK_DATAPP, F_WRLCK);
+	if (db->txnlocks & TXN_FREE)
+		_db_unlock(db, LK_FREE, F_WRLCK);
+	if (db->txnlocks & TXN_BPT)
+		_db_unlock(db, LK_BPT, F_WRLCK);
+	db->txnlocks = 0;
+
+	if (logsize > db->walckpt)
+		_db_checkpoint(db);
+}
+
+/*
+ * Flush the index and data files to disk, after which the log
+ * is no longer needed.  Write locking the whole log waits for
+ * any transaction that's been logged but not yet applied.
+ */
+static void
+_db_checkpoint(DB *db)
+{
+	_db_lock(db, LK_WAL, F_WRLCK);
+	if (fsync(db->idxfd) < 0 || fsync(db->datfd) < 0)
+		err_dump("_db_checkpoint: fsync error");
+	if (ftruncate(db->walfd, 0) < 0)
+		err_dump("_db_checkpoint: ftruncate error");
+	_db_unlock(db, LK_WAL, F_WRLCK);
+	db->cnt_ckpt++;
+}
+
+/*
+ * Replay the log, if there is one.  Called by db_open.  Every
+ * transaction with a good checksum is written again (the writes
+ * are idempotent, so it doesn't matter if they had already been
+ * made).  A torn transaction at the end of the log was never
+ * applied to the files, so we just discard it.  If any handle is
+ * still using the log, no one crashed, and we leave it alone.
+ */
+static void
+_db_recover(DB *db, int namelen)
+{
+	int			fd, ntxn = 0;
+	DBHASH		i;
+	char		*buf = NULL;
+	size_t		bufsz = 0;
+	off_t		pos;
+	WALHDR		hdr;
+	struct stat	statbuff;
+
+	strcpy(db->name + namelen, ".wal");
+	if ((fd = open(db->name, O_RDWR)) < 0) {
+		if (errno == ENOENT)
+			return;		/* never logged */
+		err_sys("_db_recover: can't open %s", db->name);
+	}
+	if (_db_walown(fd, F_WRLCK, 0) < 0) {
+		if (errno != EAGAIN && errno != EACCES)
+			err_dump("_db_recover: can't lock %s", db->name);
+		close(fd);
+		return;
+	}
+	if (fstat(fd, &statbuff) < 0)
+		err_sys("_db_recover: fstat error");
+
+	if (statbuff.st_size > 0) {
+		pos = 0;
+		while (read(fd, &hdr, sizeof(WALHDR)) == sizeof(WALHDR)) {
+			pos += sizeof(WALHDR);
+			if (hdr.magic != WAL_MAGIC || hdr.len > statbuff.st_size - pos)
+				break;
+			if (hdr.len > bufsz) {
+				bufsz = hdr.len;
+				if ((buf = realloc(buf, bufsz)) == NULL)
+					err_dump("_db_recover: realloc error");
+			}
+			if (read(fd, buf, hdr.len) != hdr.len ||
+			  _db_crc32(buf, hdr.len) != hdr.crc ||
+			  _db_walapply(db, buf, hdr.len) < 0)
+				break;		/* torn transaction */
+			pos += hdr.len;
+			ntxn++;
+		}
+		free(buf);
+
+		/*
+		 * Other processes may have cached what the dead writer
+		 * left half-written, so we change every chain's generation,
+		 * and the index's, in case we wrote its pages.
+		 */
+		if (ntxn > 0 && db->gen != NULL)
+			for (i = 0; i <= db->nhash; i++)
+				__sync_fetch_and_add(&db->gen[i], 1);
+
+		if (fsync(db->idxfd) < 0 || fsync(db->datfd) < 0)
+			err_dump("_db_recover: fsync error");
+		if (ftruncate(fd, 0) < 0)
+			err_dump("_db_recover: ftruncate error");
+	}
+	close(fd);		/* releases the lock */
+}
+
+/*
+ * CRC-32 (the one used by Ethernet and zlib), a nibble at a time.
+ */
+static uint32_t
+_db_crc32(const char *buf, size_t len)
+{
+	static const uint32_t	tab[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	uint32_t	crc = 0xffffffff;
+
+	while (len-- > 0) {
+		crc ^= (unsigned char)*buf++;
+		crc = (crc >> 4) ^ tab[crc & 0xf];
+		crc = (crc >> 4) ^ tab[crc & 0xf];
+	}
+	return(~crc);
+}
+
+/*
+ * Map the chain generation counters.  Called by db_open.  Anyone
+ * who can write the database creates the file if it's missing;
+ * without it, a handle opened read-only just can't use a cache.
+ */
+static void
+_db_genopen(DB *db, int namelen, int oflag)
+{
+	int			fd, prot;
+	size_t		size;
+	struct stat	statbuff;
+	void		*p;
+
+	size = (db->nhash + 2) * sizeof(uint32_t);	/* +2: index and log */
+	strcpy(db->name + namelen, ".gen");
+	if ((oflag & O_ACCMODE) == O_RDONLY) {
+		if ((fd = open(db->name, O_RDONLY)) < 0)
+			return;
+		prot = PROT_READ;
+	} else {
+		if (fstat(db->idxfd, &statbuff) < 0)
+			err_sys("_db_genopen: fstat error");
+		if ((fd = open(db->name, O_RDWR | O_CREAT,
+		  statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0)
+			err_sys("_db_genopen: can't open %s", db->name);
+		prot = PROT_READ | PROT_WRITE;
+	}
+	if (fstat(fd, &statbuff) < 0)
+		err_sys("_db_genopen: fstat error");
+	if (statbuff.st_size < size) {
+		/*
+		 * New file; extending it is harmless if another process
+		 * does the same thing at the same time.
+		 */
+		if (prot == PROT_READ || ftruncate(fd, size) < 0) {
+			close(fd);
+			return;
+		}
+	}
+	if ((p = mmap(NULL, size, prot, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err_sys("_db_genopen: mmap error");
+	db->gen = p;
+	close(fd);
+}
+
+/*
+ * Set the byte budget of the record cache, throwing away whatever
+ * was cached.  A budget of 0 turns the cache off.
+ */
+static int
+_db_cachesize(DB *db, size_t budget)
+{
+	DBCACHE	*cp;
+
+	if ((cp = db->cache) != NULL) {
+		while (cp->hand != NULL)
+			_db_cacheremove(db, cp->hand);
+		free(cp->bucket);
+		free(cp);
+		db->cache = NULL;
+	}
+	if (budget == 0)
+		return(0);
+	if (db->gen == NULL) {
+		errno = ENOTSUP;	/* no way to know when it's stale */
+		return(-1);
+	}
+
+	if ((cp = calloc(1, sizeof(DBCACHE))) == NULL)
+		err_dump("_db_cachesize: calloc error for cache");
+	cp->budget = budget;
+	for (cp->nbucket = 64; cp->nbucket * CACHE_BUCKET < budget; )
+		cp->nbucket <<= 1;
+	if ((cp->bucket = calloc(cp->nbucket, sizeof(DBCENT *))) == NULL)
+		err_dump("_db_cachesize: calloc error for hash table");
+	db->cache = cp;
+	return(0);
+}
+
+/*
+ * Hash a key into the cache's hash table (FNV-1a).
+ */
+static DBCENT **
+_db_cachebucket(DBCACHE *cp, const char *key)
+{
+	uint32_t	hval = 2166136261U;
+
+	while (*key != 0)
+		hval = (hval ^ (unsigned char)*key++) * 16777619U;
+	return(&cp->bucket[hval & (cp->nbucket - 1)]);
+}
+
+/*
+ * Look for a record in the cache.  If it's there and its hash chain
+ * hasn't been written since, copy the data into the data buffer and
+ * return a pointer to it, the same as _db_readdat.
+ */
+static char *
+_db_cacheget(DB *db, const char *key)
+{
+	DBCENT	*ep;
+	char	*ptr = NULL;
+
+	if (db->share != NULL)
+		pthread_mutex_lock(&db->share->mutex);
+	for (ep = *_db_cachebucket(db->cache, key); ep != NULL; ep = ep->hnext)
+		if (strcmp(ep->key, key) == 0)
+			break;
+	if (ep != NULL) {
+		if (ep->gen == db->gen[ep->chain]) {
+			ep->ref = 1;
+			ptr = strcpy(db->datbuf, ep->data);
+		} else {
+			_db_cacheremove(db, ep);	/* stale */
+		}
+	}
+	if (db->share != NULL)
+		pthread_mutex_unlock(&db->share->mutex);
+	if (ptr != NULL)
+		db->cnt_cachehit++;
+	else
+		db->cnt_cachemiss++;
+	return(ptr);
+}
+
+/*
+ * Add a record just read by db_fetch to the cache.  The caller
+ * holds the read lock on the record's hash chain, so its generation
+ * can't change until we're done.
+ */
+static void
+_db_cacheput(DB *db, const char *key, const char *data)
+{
+	DBCACHE	*cp = db->cache;
+	DBCENT	*ep, **bp;
+	size_t	keylen, datlen, size;
+
+	keylen = strlen(key);
+	datlen = strlen(data);
+	size = sizeof(DBCENT) + keylen + datlen + 1;
+	if (size > cp->budget)
+		return;
+	if (db->share != NULL)
+		pthread_mutex_lock(&db->share->mutex);
+
+	/*
+	 * Make room: the hand sweeps the ring, clearing reference bits,
+	 * until it finds an entry that hasn't been used since the last
+	 * time around.
+	 */
+	while (cp->used + size > cp->budget) {
+		while (cp->hand->ref) {
+			cp->hand->ref = 0;
+			cp->hand = cp->hand->next;
+		}
+		_db_cacheremove(db, cp->hand);
+	}
+
+	if ((ep = malloc(size)) == NULL)
+		err_dump("_db_cacheput: malloc error for cache entry");
+	ep->chain = (db->chainoff - db->hashoff) / PTR_SZ;
+	ep->gen = db->gen[ep->chain];
+	ep->ref = 1;
+	ep->size = size;
+	memcpy(ep->key, key, keylen + 1);
+	ep->data = ep->key + keylen + 1;
+	memcpy(ep->data, data, datlen + 1);
+
+	bp = _db_cachebucket(cp, key);
+	ep->hnext = *bp;
+	*bp = ep;
+	if (cp->hand == NULL) {
+		ep->prev = ep->next = cp->hand = ep;
+	} else {	/* just behind the hand: last to be looked at */
+		ep->next = cp->hand;
+		ep->prev = cp->hand->prev;
+		ep->prev->next = ep;
+		cp->hand->prev = ep;
+	}
+	cp->used += size;
+	if (db->share != NULL)
+		pthread_mutex_unlock(&db->share->mutex);
+}
+
+/*
+ * Remove an entry from the cache and free it.
+ */
+static void
+_db_cacheremove(DB *db, DBCENT *ep)
+{
+	DBCACHE	*cp = db->cache;
+	DBCENT	**bp;
+
+	for (bp = _db_cachebucket(cp, ep->key); *bp != ep; bp = &(*bp)->hnext)
+		;
+	*bp = ep->hnext;
+	if (ep->next == ep) {
+		cp->hand = NULL;		/* that was the last one */
+	} else {
+		ep->prev->next = ep->next;
+		ep->next->prev = ep->prev;
+		if (cp->hand == ep)
+			cp->hand = ep->next;
+	}
+	cp->used -= ep->size;
+	free(ep);
+}
+
+/*
+ * Return the descriptor and byte range of one of the record locks.
+ */
+static int
+_db_lockfd(DB *db, int which, off_t *offsetp, off_t *lenp)
+{
+	*offsetp = 0;
+	*lenp = 0;		/* to EOF */
+	switch (which) {
+	case LK_CHAIN:
+		*offsetp = db->chainoff;
+		*lenp = 1;
+		return(db->idxfd);
+	case LK_FREE:
+		*offsetp = FREE_OFF;
+		*lenp = 1;
+		return(db->idxfd);
+	case LK_IDXAPP:
+		*offsetp = ((db->nhash+1)*PTR_SZ)+1;
+		return(db->idxfd);
+	case LK_DATAPP:
+		return(db->datfd);
+	case LK_WAL:
+		*offsetp = WAL_LOCK;	/* not WAL_OWNER */
+		*lenp = 1;
+		return(db->walfd);
+	}
+	return(db->bptfd);
+}
+
+/*
+ * Take one of the record locks, LK_xxx, for the calling thread.
+ * Outside thread mode this is just the fcntl lock.
+ */
+static void
+_db_lock(DB *db, int which, int type)
+{
+	int		fd, *nreadp = NULL;
+	off_t	offset, len;
+	DBLOCK	*lp = NULL;
+
+	fd = _db_lockfd(db, which, &offset, &len);
+
+	if (db->share != NULL) {
+		if (which == LK_CHAIN) {
+			which = (db->chainoff - db->hashoff) / PTR_SZ;
+			lp = &db->share->lock[which % NSTRIPE];
+		} else {
+			lp = &db->share->lock[NSTRIPE + which - 1];
+			which += db->nhash - 1;
+		}
+		nreadp = &db->share->nread[which];
+
+		if (type == F_WRLCK) {
+			pthread_rwlock_wrlock(&lp->rwlock);
+		} else {
+			pthread_rwlock_rdlock(&lp->rwlock);
+			pthread_mutex_lock(&lp->mutex);
+			if ((*nreadp)++ > 0) {	/* process already has it */
+				pthread_mutex_unlock(&lp->mutex);
+				return;
+			}
+		}
+	}
+
+	/*
+	 * The kernel looks for deadlocks between processes, not threads,
+	 * so when another thread of ours holds the lock some process is
+	 * waiting for, it can see a cycle that isn't there.  We always
+	 * take our locks in the same order, so it's safe to try again.
+	 */
+	while (lock_reg(fd, F_SETLKW, type, offset, SEEK_SET, len) < 0) {
+		if (errno != EDEADLK)
+			err_dump("_db_lock: lock_reg error");
+		sleep_us(1000);
+	}
+	if (lp != NULL && type == F_RDLCK)
+		pthread_mutex_unlock(&lp->mutex);
+}
+
+/*
+ * Release a lock taken by _db_lock.
+ */
+static void
+_db_unlock(DB *db, int which, int type)
+{
+	int		fd, *nreadp = NULL;
+	off_t	offset, len;
+	DBLOCK	*lp = NULL;
+
+	fd = _db_lockfd(db, which, &offset, &len);
+
+	if (db->share != NULL) {
+		if (which == LK_CHAIN) {
+			which = (db->chainoff - db->hashoff) / PTR_SZ;
+			lp = &db->share->lock[which % NSTRIPE];
+		} else {
+			lp = &db->share->lock[NSTRIPE + which - 1];
+			which += db->nhash - 1;
+		}
+		nreadp = &db->share->nread[which];
+
+		if (type == F_RDLCK) {
+			pthread_mutex_lock(&lp->mutex);
+			if (--(*nreadp) > 0) {	/* other readers still need it */
+				pthread_mutex_unlock(&lp->mutex);
+				pthread_rwlock_unlock(&lp->rwlock);
+				return;
+			}
+		}
+	}
+
+	if (un_lock(fd, offset, SEEK_SET, len) < 0)
+		err_dump("_db_unlock: un_lock error");
+	if (lp != NULL) {
+		if (type == F_RDLCK)
+			pthread_mutex_unlock(&lp->mutex);
+		pthread_rwlock_unlock(&lp->rwlock);
+	}
+}
+
+/*
+ * Wait until no other process is in the middle of changing a hash
+ * chain, by locking them all for a moment.  Writers that look at a
+ * counter in <name>.gen with their chain locked, and missed it being
+ * bumped before we were called, are then done with their writes.
+ */
+static void
+_db_waitwriters(DB *db)
+{
+	if (writew_lock(db->idxfd, db->hashoff, SEEK_SET,
+	  db->nhash * PTR_SZ) < 0)
+		err_dump("_db_waitwriters: writew_lock error");
+	if (un_lock(db->idxfd, db->hashoff, SEEK_SET, db->nhash * PTR_SZ) < 0)
+		err_dump("_db_waitwriters: un_lock error");
+}
+
+/*
+ * Switch a handle to thread mode.  Called by db_ctl.
+ */
+static int
+_db_threadinit(DB *db)
+{
+	DBSHARE	*sp;
+	int		i, err;
+
+	if ((sp = calloc(1, sizeof(DBSHARE))) == NULL)
+		err_dump("_db_threadinit: calloc error");
+	if ((sp->nread = calloc(db->nhash + LK_NLOCKS - 1, sizeof(int))) == NULL)
+		err_dump("_db_threadinit: calloc error");
+	if ((err = pthread_key_create(&sp->key, _db_endthread)) != 0) {
+		free(sp->nread);
+		free(sp);
+		errno = err;
+		return(-1);
+	}
+	pthread_mutex_init(&sp->mutex, NULL);
+	for (i = 0; i < NSTRIPE + LK_NLOCKS - 1; i++) {
+		pthread_rwlock_init(&sp->lock[i].rwlock, NULL);
+		pthread_mutex_init(&sp->lock[i].mutex, NULL);
+	}
+	db->share = sp;
+	return(0);
+}
+
+/*
+ * Return the calling thread's struct db: a copy of the handle's,
+ * sharing its descriptors and cache but with its own buffers and
+ * offsets, so threads don't trample each other's cursor state.
+ */
+static DB *
+_db_thread(DB *db)
+{
+	DB		*tdb;
+
+	if (db->share == NULL)
+		return(db);
+	if ((tdb = pthread_getspecific(db->share->key)) != NULL)
+		return(tdb);
+
+	if ((tdb = malloc(sizeof(DB))) == NULL)
+		err_dump("_db_thread: malloc error for DB");
+	*tdb = *db;
+	if ((tdb->idxbuf = malloc(IDXLEN_MAX + 2)) == NULL)
+		err_dump("_db_thread: malloc error for index buffer");
+	if ((tdb->datbuf = malloc(DATLEN_MAX + 2)) == NULL)
+		err_dump("_db_thread: malloc error for data buffer");
+	tdb->walbuf = NULL;
+	tdb->wallen = tdb->walmax = 0;
+	tdb->ordpg = NULL;
+	tdb->ordkey = NULL;
+	tdb->txnlocks = 0;
+	tdb->parent = db;
+	tdb->cnt_delok = tdb->cnt_delerr = 0;
+	tdb->cnt_fetchok = tdb->cnt_fetcherr = tdb->cnt_nextrec = 0;
+	tdb->cnt_stor1 = tdb->cnt_stor2 = tdb->cnt_stor3 = 0;
+	tdb->cnt_stor4 = tdb->cnt_storerr = 0;
+	tdb->cnt_commit = tdb->cnt_ckpt = 0;
+	tdb->cnt_cachehit = tdb->cnt_cachemiss = 0;
+	tdb->scanoff = ((db->nhash + 1) * PTR_SZ) + 1;	/* as db_rewind */
+
+	pthread_mutex_lock(&db->share->mutex);
+	tdb->tnext = db->share->list;
+	db->share->list = tdb;
+	pthread_mutex_unlock(&db->share->mutex);
+	if (pthread_setspecific(db->share->key, tdb) != 0)
+		err_dump("_db_thread: pthread_setspecific error");
+	return(tdb);
+}
+
+/*
+ * A thread that used the handle is exiting: add its counts to the
+ * handle's and free its struct db.
+ */
+static void
+_db_endthread(void *arg)
+{
+	DB		*tdb = arg, *db = tdb->parent, **pp;
+
+	pthread_mutex_lock(&db->share->mutex);
+	for (pp = &db->share->list; *pp != tdb; pp = &(*pp)->tnext)
+		;
+	*pp = tdb->tnext;
+	_db_addcounts(db, tdb);
+	pthread_mutex_unlock(&db->share->mutex);
+
+	free(tdb->idxbuf);
+	free(tdb->datbuf);
+	free(tdb->walbuf);
+	free(tdb->ordpg);
+	free(tdb->ordkey);
+	free(tdb);
+}
+
+/*
+ * Position the handle for db_nextkey at the first key >= key.
+ * With key "" that's the smallest key in the database.
+ */
+int
+db_seek(DBHANDLE h, const char *key)
+{
+	DB		*db = _db_thread(h);
+
+	if (_db_bptnew(db))
+		_db_bptopen(db);
+	if (db->bptfd < 0) {
+		errno = ENOTSUP;	/* no ordered index */
+		return(-1);
+	}
+	if (strlen(key) > IDXLEN_MAX) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if (db->ordpg == NULL) {
+		if ((db->ordpg = malloc(sizeof(BPTBUF))) == NULL)
+			err_dump("db_seek: malloc error for page buffer");
+		if ((db->ordkey = malloc(IDXLEN_MAX + 1)) == NULL)
+			err_dump("db_seek: malloc error for key");
+	}
+	strcpy(db->ordkey, key);
+	db->ordstate = ORD_SEEK;
+	return(0);
+}
+
+/*
+ * Return the next record in key order, after db_seek.  Like
+ * db_nextrec, we copy the key to the caller's buffer if it's not
+ * NULL and return a pointer to the data.
+ *
+ * We keep a copy of the current leaf and walk along it; only if
+ * the tree has changed since we read it do we search the tree again
+ * for the key after the one we returned last.  So reading k keys
+ * costs O(log n + k), plus a db_fetch for the data of each one.
+ */
+char *
+db_nextkey(DBHANDLE h, char *key)
+{
+	DB		*db = _db_thread(h);
+	BPTBUF	hb;
+	char	*ptr;
+	uint16_t klen;
+
+	if (db->ordpg == NULL) {
+		errno = EINVAL;		/* db_seek wasn't called */
+		return(NULL);
+	}
+	for ( ; ; ) {
+		_db_lock(db, LK_BPT, F_RDLCK);
+		_db_bptread(db, 0, &hb);
+		if (db->ordstate == ORD_SEEK || hb.hdr.stamp != db->ordstamp) {
+			_db_bptfind(db, db->ordpg, db->ordkey, strlen(db->ordkey),
+			  db->ordstate == ORD_NEXT);
+			db->ordstamp = hb.hdr.stamp;
+			db->ordstate = ORD_NEXT;
+		}
+
+		/*
+		 * Leaves can be empty, so we may have to skip several.
+		 */
+		while (db->ordoff >= db->ordpg->pg.used &&
+		  db->ordpg->pg.link != 0) {
+			_db_bptread(db, db->ordpg->pg.link, db->ordpg);
+			db->ordoff = 0;
+		}
+		if (db->ordoff >= db->ordpg->pg.used) {
+			_db_unlock(db, LK_BPT, F_RDLCK);
+			return(NULL);		/* no more keys */
+		}
+		memcpy(&klen, BPT_ENT(db->ordpg) + db->ordoff, 2);
+		memcpy(db->ordkey, BPT_ENT(db->ordpg) + db->ordoff + 2, klen);
+		db->ordkey[klen] = 0;
+		db->ordoff += 2 + klen;
+		_db_unlock(db, LK_BPT, F_RDLCK);
+
+		/*
+		 * If the record was deleted since we let go of the
+		 * tree, go on to the next key.
+		 */
+		if ((ptr = db_fetch(h, db->ordkey)) != NULL) {
+			if (key != NULL)
+				strcpy(key, db->ordkey);
+			return(ptr);
+		}
+	}
+}
+
+/*
+ * Create the ordered index, building it from the records already in
+ * the database.  Called by db_ctl.  Without the generation counters
+ * we couldn't tell the handles that already have the database open,
+ * so we refuse.
+ */
+static int
+_db_bptcreate(DB *db)
+{
+	BPTBUF		hb, pb;
+	struct stat	statbuff;
+	off_t		saveoff;
+	int			len, walfd;
+	char		*ptr;
+
+	if (db->bptfd >= 0)
+		return(0);
+	if (db->gen == NULL) {
+		errno = ENOTSUP;
+		return(-1);
+	}
+	if (fstat(db->idxfd, &statbuff) < 0)
+		err_sys("_db_bptcreate: fstat error");
+	len = strlen(db->name) - 4;
+	strcpy(db->name + len, ".bpt");
+	if ((db->bptfd = open(db->name, O_RDWR | O_CREAT,
+	  statbuff.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO))) < 0)
+		return(-1);
+
+	/*
+	 * Maybe someone else just built it.
+	 */
+	_db_lock(db, LK_BPT, F_WRLCK);
+	if (pread(db->bptfd, &hb, sizeof(BPTHDR), 0) == sizeof(BPTHDR) &&
+	  hb.hdr.magic == BPT_MAGIC) {
+		_db_unlock(db, LK_BPT, F_WRLCK);
+		return(0);
+	}
+
+	/*
+	 * Tell the other handles.  Those that missed it will be done
+	 * with their writes when _db_waitwriters returns, so our scan
+	 * will see them.  The rest wait for us in _db_bptopen, after
+	 * letting go of their chains.
+	 */
+	__sync_fetch_and_add(&db->gen[db->nhash], 1);
+	_db_waitwriters(db);
+
+	/*
+	 * Start with an empty leaf as the root.  The magic number isn't
+	 * written until we're done, so a half-built index is ignored.
+	 * Building isn't logged, even if the log is on: it would be one
+	 * enormous transaction, and we can just start over instead.
+	 */
+	if (ftruncate(db->bptfd, 0) < 0)
+		err_sys("_db_bptcreate: ftruncate error");
+	memset(&hb, 0, sizeof(hb));
+	hb.hdr.root = 1;
+	hb.hdr.npage = 2;
+	memset(&pb, 0, sizeof(pb));
+	pb.pg.leaf = 1;
+	walfd = db->walfd;
+	db->walfd = -1;
+	_db_bptwrite(db, 0, &hb, sizeof(BPTHDR));
+	_db_bptwrite(db, 1, &pb, BPT_PAGESZ);
+
+	/*
+	 * Same as db_nextrec, without disturbing the caller's scan.
+	 */
+	_db_lock(db, LK_FREE, F_RDLCK);
+	saveoff = db->scanoff;
+	db->scanoff = ((db->nhash + 1) * PTR_SZ) + 1;
+	while (_db_readidx(db, 0) >= 0) {
+		for (ptr = db->idxbuf; *ptr == SPACE; ptr++)
+			;
+		if (*ptr != 0)		/* skip deleted records */
+			_db_bptinsert(db, db->idxbuf);
+	}
+	db->scanoff = saveoff;
+	_db_unlock(db, LK_FREE, F_RDLCK);
+	db->walfd = walfd;
+
+	if (fsync(db->bptfd) < 0)
+		err_sys("_db_bptcreate: fsync error");
+	_db_bptread(db, 0, &hb);
+	hb.hdr.magic = BPT_MAGIC;
+	if (pwrite(db->bptfd, &hb, sizeof(BPTHDR), 0) != sizeof(BPTHDR))
+		err_dump("_db_bptcreate: pwrite error");
+	if (fsync(db->bptfd) < 0)
+		err_sys("_db_bptcreate: fsync error");
+	_db_unlock(db, LK_BPT, F_WRLCK);
+	return(0);
+}
+
+/*
+ * Has an ordered index been created since we last looked?
+ */
+static int
+_db_bptnew(DB *db)
+{
+	return(db->bptfd < 0 && db->gen != NULL &&
+	  db->gen[db->nhash] != db->bptgen);
+}
+
+/*
+ * Open an ordered index created by another handle, waiting for it
+ * to be built.  If its builder died first, there's still none.  In
+ * thread mode the descriptor is the handle's, shared by all threads;
+ * we can't open it twice, since closing either one would drop the
+ * process's locks on the file.
+ */
+static void
+_db_bptopen(DB *db)
+{
+	DB			*hdb = (db->share != NULL) ? db->parent : db;
+	BPTHDR		hdr;
+	uint32_t	gen;
+	char		*name;
+	int			len, mode, ok;
+
+	if (db->share != NULL) {
+		pthread_mutex_lock(&db->share->mutex);
+		if (hdb->bptfd >= 0) {
+			db->bptfd = hdb->bptfd;
+			pthread_mutex_unlock(&db->share->mutex);
+			return;
+		}
+	}
+	len = strlen(db->name) - 4;
+	if ((name = malloc(len + 5)) == NULL)
+		err_dump("_db_bptopen: malloc error for name");
+	memcpy(name, db->name, len);
+	strcpy(name + len, ".bpt");
+
+	gen = db->gen[db->nhash];
+	mode = fcntl(db->idxfd, F_GETFL) & O_ACCMODE;	/* same as db_open's */
+	if ((db->bptfd = open(name, mode)) < 0) {
+		if (errno != ENOENT)
+			err_sys("_db_bptopen: can't open %s", name);
+		db->bptgen = gen;	/* not even started */
+	} else {
+		_db_lock(db, LK_BPT, F_RDLCK);
+		db->bptgen = db->gen[db->nhash];
+		ok = pread(db->bptfd, &hdr, sizeof(BPTHDR), 0) == sizeof(BPTHDR) &&
+		  hdr.magic == BPT_MAGIC;
+		_db_unlock(db, LK_BPT, F_RDLCK);
+		if (!ok) {
+			close(db->bptfd);
+			db->bptfd = -1;
+		}
+	}
+	free(name);
+	if (db->share != NULL) {
+		hdb->bptfd = db->bptfd;
+		hdb->bptgen = db->bptgen;
+		pthread_mutex_unlock(&db->share->mutex);
+	}
+}
+
+/*
+ * Read a page of the ordered index.  Pages past the end of the file
+ * can only be new ones our own transaction is writing.
+ */
+static void
+_db_bptread(DB *db, uint32_t pgno, BPTBUF *bp)
+{
+	ssize_t	n;
+
+	if ((n = pread(db->bptfd, bp, BPT_PAGESZ,
+	  (off_t)pgno * BPT_PAGESZ)) < 0)
+		err_dump("_db_bptread: pread error");
+	if (n < BPT_PAGESZ)
+		memset(bp->buf + n, 0, BPT_PAGESZ - n);
+	if (db->wallen > 0)
+		_db_walpatch(db, WAL_BPT, (off_t)pgno * BPT_PAGESZ, bp->buf,
+		  BPT_PAGESZ);
+}
+
+/*
+ * Write the first len bytes of a page of the ordered index.
+ */
+static void
+_db_bptwrite(DB *db, uint32_t pgno, BPTBUF *bp, size_t len)
+{
+	struct iovec	iov;
+
+	if (db->walfd >= 0) {
+		iov.iov_base = bp->buf;
+		iov.iov_len  = len;
+		_db_logwrite(db, WAL_BPT, (off_t)pgno * BPT_PAGESZ, &iov, 1);
+	} else if (pwrite(db->bptfd, bp->buf, len,
+	  (off_t)pgno * BPT_PAGESZ) != len) {
+		err_dump("_db_bptwrite: pwrite error");
+	}
+}
+
+/*
+ * Return the offset of the first entry in a page whose key is >=
+ * the given key, or pg.used if there's none.  *foundp is set if the
+ * key is equal.  Interior pages use this to find the first
+ * separator > key: the subtree to descend is the one just before it.
+ */
+static size_t
+_db_bptsearch(BPTBUF *bp, const char *key, size_t keylen, int *foundp)
+{
+	size_t		off, n;
+	uint16_t	klen;
+	int			cmp;
+	char		*ent = BPT_ENT(bp);
+
+	*foundp = 0;
+	for (off = 0; off < bp->pg.used; ) {
+		memcpy(&klen, ent + off, 2);
+		n = (klen < keylen) ? klen : keylen;
+		if ((cmp = memcmp(ent + off + 2, key, n)) == 0)
+			cmp = (klen > keylen) - (klen < keylen);
+		if (cmp >= 0) {
+			*foundp = (cmp == 0);
+			break;
+		}
+		off += 2 + klen + (bp->pg.leaf ? 0 : 4);
+	}
+	return(off);
+}
+
+/*
+ * In an interior page, return the page number of the subtree that
+ * would hold the key.
+ */
+static uint32_t
+_db_bptchild(BPTBUF *bp, const char *key, size_t keylen)
+{
+	size_t		off, prev;
+	uint16_t	klen;
+	uint32_t	child;
+	int			found;
+
+	off = _db_bptsearch(bp, key, keylen, &found);
+	if (found) {	/* subtree of the equal separator */
+		memcpy(&klen, BPT_ENT(bp) + off, 2);
+		memcpy(&child, BPT_ENT(bp) + off + 2 + klen, 4);
+		return(child);
+	}
+	if (off == 0)
+		return(bp->pg.link);
+
+	/*
+	 * Need the entry before off; entries only go forward.
+	 */
+	for (prev = 0; ; prev += 2 + klen + 4) {
+		memcpy(&klen, BPT_ENT(bp) + prev, 2);
+		if (prev + 2 + klen + 4 == off)
+			break;
+	}
+	memcpy(&child, BPT_ENT(bp) + prev + 2 + klen, 4);
+	return(child);
+}
+
+/*
+ * Read into bp the leaf that would hold key, and set db->ordoff to
+ * its first entry >= key (> key if after is set).
+ */
+static void
+_db_bptfind(DB *db, BPTBUF *bp, const char *key, size_t keylen, int after)
+{
+	BPTBUF		hb;
+	uint32_t	pgno;
+	uint16_t	klen;
+	int			found;
+
+	_db_bptread(db, 0, &hb);
+	for (pgno = hb.hdr.root; ; pgno = _db_bptchild(bp, key, keylen)) {
+		_db_bptread(db, pgno, bp);
+		if (bp->pg.leaf)
+			break;
+	}
+	db->ordoff = _db_bptsearch(bp, key, keylen, &found);
+	if (found && after) {
+		memcpy(&klen, BPT_ENT(bp) + db->ordoff, 2);
+		db->ordoff += 2 + klen;
+	}
+}
+
+/*
+ * Add a key to the ordered index.  Called by db_store for a new key,
+ * with the tree write locked.  Returns 1 if the key was already there.
+ */
+static int
+_db_bptinsert(DB *db, const char *key)
+{
+	BPTBUF		hb, pb, rb;
+	uint32_t	path[BPT_MAXDEPTH], pgno, newpg;
+	int			depth, found, leaf, nkey;
+	size_t		keylen, off, entlen, total, half, n;
+	uint16_t	klen;
+	char		ent[BPT_ENTMAX], tmp[BPT_ROOM + BPT_ENTMAX];
+
+	/*
+	 * Go down to the leaf, remembering the way back up.
+	 */
+	keylen = strlen(key);
+	_db_bptread(db, 0, &hb);
+	depth = 0;
+	for (pgno = hb.hdr.root; ; pgno = _db_bptchild(&pb, key, keylen)) {
+		_db_bptread(db, pgno, &pb);
+		if (pb.pg.leaf)
+			break;
+		if (depth == BPT_MAXDEPTH)
+			err_dump("_db_bptinsert: tree too deep");
+		path[depth++] = pgno;
+	}
+	off = _db_bptsearch(&pb, key, keylen, &found);
+	if (found) {
+		return(1);
+	}
+	klen = keylen;
+	memcpy(ent, &klen, 2);
+	memcpy(ent + 2, key, keylen);
+	entlen = 2 + keylen;
+
+	for ( ; ; ) {
+		/*
+		 * Insert the entry at off.  If it fits, we're done.
+		 */
+		leaf = pb.pg.leaf;
+		if (pb.pg.used + entlen <= BPT_ROOM) {
+			memmove(BPT_ENT(&pb) + off + entlen, BPT_ENT(&pb) + off,
+			  pb.pg.used - off);
+			memcpy(BPT_ENT(&pb) + off, ent, entlen);
+			pb.pg.used += entlen;
+			pb.pg.nkey++;
+			_db_bptwrite(db, pgno, &pb, BPT_PAGESZ);
+			break;
+		}
+
+		/*
+		 * Split the page.  Lay out all the entries in tmp, and
+		 * give the first half of the bytes to the left page.
+		 */
+		memcpy(tmp, BPT_ENT(&pb), off);
+		memcpy(tmp + off, ent, entlen);
+		memcpy(tmp + off + entlen, BPT_ENT(&pb) + off, pb.pg.used - off);
+		total = pb.pg.used + entlen;
+		nkey = pb.pg.nkey + 1;
+		for (half = 0, n = 0; ; n++) {
+			memcpy(&klen, tmp + half, 2);
+			if (half > 0 && half + 2 + klen + (leaf ? 0 : 4) > total / 2)
+				break;
+			half += 2 + klen + (leaf ? 0 : 4);
+		}
+
+		memset(&rb, 0, sizeof(rb));
+		rb.pg.leaf = leaf;
+		newpg = hb.hdr.npage++;
+		pb.pg.used = half;
+		pb.pg.nkey = n;
+		memcpy(BPT_ENT(&pb), tmp, half);
+		if (leaf) {
+			/*
+			 * The right page's first key becomes the separator.
+			 */
+			rb.pg.link = pb.pg.link;
+			pb.pg.link = newpg;
+			rb.pg.used = total - half;
+			rb.pg.nkey = nkey - n;
+			memcpy(BPT_ENT(&rb), tmp + half, rb.pg.used);
+			entlen = 2 + klen;
+			memcpy(ent, tmp + half, entlen);
+		} else {
+			/*
+			 * The middle entry moves up: its key becomes the
+			 * separator and its subtree the right page's link.
+			 */
+			entlen = 2 + klen;
+			memcpy(ent, tmp + half, entlen);
+			memcpy(&rb.pg.link, tmp + half + entlen, 4);
+			half += entlen + 4;
+			rb.pg.used = total - half;
+			rb.pg.nkey = nkey - n - 1;
+			memcpy(BPT_ENT(&rb), tmp + half, rb.pg.used);
+		}
+		memcpy(ent + entlen, &newpg, 4);
+		entlen += 4;
+
+		/*
+		 * New page first, so the tree is never linked to a page
+		 * that hasn't been written.
+		 */
+		_db_bptwrite(db, newpg, &rb, BPT_PAGESZ);
+		_db_bptwrite(db, pgno, &pb, BPT_PAGESZ);
+
+		if (depth == 0) {
+			/*
+			 * We split the root, so the tree grows a level.
+			 */
+			memset(&rb, 0, sizeof(rb));
+			rb.pg.link = pgno;
+			rb.pg.used = entlen;
+			rb.pg.nkey = 1;
+			memcpy(BPT_ENT(&rb), ent, entlen);
+			hb.hdr.root = hb.hdr.npage++;
+			_db_bptwrite(db, hb.hdr.root, &rb, BPT_PAGESZ);
+			break;
+		}
+		pgno = path[--depth];
+		_db_bptread(db, pgno, &pb);
+		off = _db_bptsearch(&pb, ent + 2, entlen - 6, &found);
+	}
+	hb.hdr.stamp++;
+	_db_bptwrite(db, 0, &hb, sizeof(BPTHDR));
+	return(0);
+}
+
+/*
+ * Remove a key from the ordered index.  Called by db_delete, with
+ * the tree write locked.  Returns -1 if the key wasn't there.
+ */
+static int
+_db_bptdelete(DB *db, const char *key)
+{
+	BPTBUF		hb, pb;
+	uint32_t	pgno;
+	size_t		keylen, off, entlen;
+	int			found;
+
+	keylen = strlen(key);
+	_db_bptread(db, 0, &hb);
+	for (pgno = hb.hdr.root; ; pgno = _db_bptchild(&pb, key, keylen)) {
+		_db_bptread(db, pgno, &pb);
+		if (pb.pg.leaf)
+			break;
+	}
+	off = _db_bptsearch(&pb, key, keylen, &found);
+	if (found) {
+		entlen = 2 + keylen;
+		memmove(BPT_ENT(&pb) + off, BPT_ENT(&pb) + off + entlen,
+		  pb.pg.used - off - entlen);
+		pb.pg.used -= entlen;
+		pb.pg.nkey--;
+		_db_bptwrite(db, pgno, &pb, BPT_PAGESZ);
+		hb.hdr.stamp++;
+		_db_bptwrite(db, 0, &hb, sizeof(BPTHDR));
+	}
+	return(found ? 0 : -1);
+}
+
+/*
+ * Done changing the tree.  When logging, it stays locked until the
+ * transaction commits, so no one reads pages that aren't written yet.
+ */
+static void
+_db_bptdone(DB *db)
+{
+	if (db->walfd >= 0)
+		db->txnlocks |= TXN_BPT;	/* until _db_commit */
+	else
+		_db_unlock(db, LK_BPT, F_WRLCK);
+}
@@ -0,0 +1,64 @@
+/*
+ * Print statistics about a database: the counters of our handle,
+ * the hash chain lengths, and how much space deleted records take.
+ * With -x, write every record to standard output instead, as
+ * "key<TAB>data" lines in no particular order.  Both read the
+ * index file with -j threads (default 4).
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+
+static int	export(void *, const char *, const char *);
+
+int
+main(int argc, char *argv[])
+{
+	DBHANDLE	db;
+	int			c, err, xflag, nthreads;
+
+	err = xflag = 0;
+	nthreads = 4;
+	opterr = 0;		/* don't want getopt() writing to stderr */
+	while ((c = getopt(argc, argv, "j:x")) != -1) {
+		switch (c) {
+		case 'j':
+			if ((nthreads = atoi(optarg)) < 1)
+				err = 1;
+			break;
+
+		case 'x':
+			xflag = 1;
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || (optind != argc - 1))
+		err_quit("usage: db_stats [-j nthreads] [-x] dbname");
+	if ((db = db_open(argv[optind], O_RDONLY)) == NULL)
+		err_sys("db_stats: can't open %s", argv[optind]);
+
+	if (xflag) {
+		if (db_scan(db, nthreads, export, stdout) != 0)
+			err_sys("db_stats: write error");
+	} else if (db_dumpstats(db, stdout, nthreads) < 0) {
+		err_sys("db_stats: db_dumpstats error");
+	}
+	db_close(db);
+	exit(0);
+}
+
+/*
+ * Called by all the scanning threads at once; stdio locks the
+ * stream for each call, so lines don't get mixed up.
+ */
+static int
+export(void *arg, const char *key, const char *data)
+{
+	if (fprintf(arg, "%s\t%s\n", key, data) < 0)
+		return(-1);
+	return(0);
+}
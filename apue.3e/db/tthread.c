@@ -0,0 +1,192 @@
+/*
+ * Stress test for DB_THREADS.  Several threads share one handle and
+ * mix db_store, db_delete, db_fetch_r and db_nextrec.  Each thread
+ * owns its own keys, so it knows what they should hold; it can only
+ * check that other threads' records look right.  At the end, the
+ * database must hold exactly what the threads think it does, both
+ * through the shared handle and after reopening it.  We do it all
+ * four ways: with and without the log, and with and without a cache.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+#define NTHREADS	4
+#define NKEYS		100		/* keys per thread */
+#define NOPS		5000	/* default number of operations per thread */
+
+static void	 run(int, int);
+static void	*worker(void *);
+static void	 check(const char *, const char *);
+static void	 verify(DBHANDLE);
+
+static DBHANDLE	db;
+static int		nops;
+static int		ndots[NTHREADS][NKEYS];		/* -1 if not stored */
+
+int
+main(int argc, char *argv[])
+{
+	nops = (argc > 1) ? atoi(argv[1]) : NOPS;
+	run(0, 0);
+	run(1, 0);
+	run(0, 1);
+	run(1, 1);
+	exit(0);
+}
+
+static void
+run(int wal, int cache)
+{
+	pthread_t	tid[NTHREADS];
+	long		i;
+	int			err, k;
+
+	if ((db = db_open("tthread", O_RDWR | O_CREAT | O_TRUNC,
+	  FILE_MODE)) == NULL)
+		err_sys("db_open error");
+	if (wal && db_ctl(db, DB_WAL, 16384L) < 0)	/* checkpoint often */
+		err_sys("db_ctl error");
+	if (cache && db_ctl(db, DB_CACHE, 16384L) < 0)
+		err_sys("db_ctl error");
+	if (db_ctl(db, DB_THREADS) < 0)
+		err_sys("db_ctl error");
+
+	for (i = 0; i < NTHREADS; i++)
+		for (k = 0; k < NKEYS; k++)
+			ndots[i][k] = -1;
+	for (i = 0; i < NTHREADS; i++)
+		if ((err = pthread_create(&tid[i], NULL, worker, (void *)i)) != 0)
+			err_exit(err, "can't create thread");
+	for (i = 0; i < NTHREADS; i++)
+		if ((err = pthread_join(tid[i], NULL)) != 0)
+			err_exit(err, "can't join thread");
+
+	verify(db);
+	db_close(db);
+	if ((db = db_open("tthread", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	verify(db);
+	db_close(db);
+	printf("log %s, cache %s: %d threads x %d operations OK\n",
+	  wal ? "on" : "off", cache ? "on" : "off", NTHREADS, nops);
+}
+
+/*
+ * The data for each record is its key, an '=', and a random number
+ * of dots, so records change size and move around the files.
+ */
+static void *
+worker(void *arg)
+{
+	int			t = (long)arg;
+	unsigned	seed = t + 1;
+	int			i, k, n, rc;
+	char		key[16], data[64], buf[64], *ptr;
+
+	for (i = 0; i < nops; i++) {
+		k = rand_r(&seed) % NKEYS;
+		sprintf(key, "t%d-%d", t, k);
+		switch (rand_r(&seed) % 8) {
+		case 0:
+		case 1:
+		case 2:
+			n = sprintf(data, "%s=", key);
+			ndots[t][k] = rand_r(&seed) % 32;
+			memset(data + n, '.', ndots[t][k]);
+			data[n + ndots[t][k]] = 0;
+			if (db_store(db, key, data, DB_STORE) < 0)
+				err_sys("db_store error for %s", key);
+			break;
+
+		case 3:
+			rc = db_delete(db, key);
+			if ((rc == 0) != (ndots[t][k] >= 0))
+				err_quit("db_delete of %s returned %d", key, rc);
+			ndots[t][k] = -1;
+			break;
+
+		case 4:
+		case 5:
+			ptr = db_fetch_r(db, key, buf, sizeof(buf));
+			if ((ptr != NULL) != (ndots[t][k] >= 0))
+				err_quit("%s: db_fetch_r %s", key,
+				  ptr == NULL ? "missed it" : "found a deleted record");
+			if (ptr != NULL) {
+				check(key, ptr);
+				if (strlen(ptr) != strlen(key) + 1 + ndots[t][k])
+					err_quit("%s: lost an update: %s", key, ptr);
+			}
+			break;
+
+		case 6:
+			/*
+			 * Someone else's key: we don't know if it's there.
+			 */
+			sprintf(key, "t%d-%d", rand_r(&seed) % NTHREADS, k);
+			if ((ptr = db_fetch_r(db, key, buf, sizeof(buf))) != NULL)
+				check(key, ptr);
+			break;
+
+		case 7:
+			/*
+			 * Once in a while, a scan of the whole database.
+			 */
+			if (rand_r(&seed) % 16 != 0)
+				break;
+			db_rewind(db);
+			while ((ptr = db_nextrec(db, key)) != NULL)
+				check(key, ptr);
+			break;
+		}
+	}
+	return((void *)0);
+}
+
+static void
+check(const char *key, const char *data)
+{
+	int		n = strlen(key);
+
+	if (strncmp(data, key, n) != 0 || data[n] != '=' ||
+	  strspn(data + n + 1, ".") != strlen(data + n + 1))
+		err_quit("bad data for %s: %s", key, data);
+}
+
+/*
+ * Every key must hold what its thread last stored, and a scan
+ * must find no other records.
+ */
+static void
+verify(DBHANDLE h)
+{
+	char	key[IDXLEN_MAX], *ptr;
+	int		t, k, n, nstored;
+
+	nstored = 0;
+	for (t = 0; t < NTHREADS; t++) {
+		for (k = 0; k < NKEYS; k++) {
+			sprintf(key, "t%d-%d", t, k);
+			ptr = db_fetch(h, key);
+			if ((ptr != NULL) != (ndots[t][k] >= 0))
+				err_quit("%s: expected %s", key,
+				  ptr == NULL ? "a record" : "none");
+			if (ptr == NULL)
+				continue;
+			check(key, ptr);
+			if (strlen(ptr) != strlen(key) + 1 + ndots[t][k])
+				err_quit("%s: wrong data %s", key, ptr);
+			nstored++;
+		}
+	}
+
+	n = 0;
+	db_rewind(h);
+	while ((ptr = db_nextrec(h, key)) != NULL) {
+		check(key, ptr);
+		n++;
+	}
+	if (n != nstored)
+		err_quit("db_nextrec found %d records, expected %d", n, nstored);
+}
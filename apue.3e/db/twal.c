@@ -0,0 +1,402 @@
+/*
+ * Crash test for the write-ahead log.  A child stores and deletes
+ * records as fast as it can until the parent kills it at a random
+ * moment.  The parent then reopens the database, which replays the
+ * log, and checks that every record is intact, on its hash chain,
+ * and in the ordered index.  First, though, we check that a cached
+ * record goes stale when another process changes it, that a handle
+ * keeps up an ordered index created after it was opened, that
+ * opening the database doesn't replay a log someone is still using,
+ * and that replaying one makes other processes' caches stale.
+ */
+#include "apue.h"
+#include "apue_db.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+
+#define NKEYS	200		/* distinct keys the writer uses */
+#define NLOOPS	100		/* default number of crashes */
+
+static void	coherence(void);
+static void	lateindex(void);
+static void	livelog(void);
+static void	replaycache(void);
+static void	expect(const char *, const char *);
+static void	writer(void);
+static void	verify(void);
+static int	scanned(void *, const char *, const char *);
+
+static pthread_mutex_t	scanlock = PTHREAD_MUTEX_INITIALIZER;
+static int				nscanned;
+
+int
+main(int argc, char *argv[])
+{
+	DBHANDLE	db;
+	pid_t		pid;
+	int			i, nloops;
+
+	nloops = (argc > 1) ? atoi(argv[1]) : NLOOPS;
+	if ((db = db_open("twal", O_RDWR | O_CREAT | O_TRUNC,
+	  FILE_MODE)) == NULL)
+		err_sys("db_open error");
+	db_close(db);
+	coherence();
+	lateindex();
+	livelog();
+	replaycache();
+
+	srand(getpid());
+	for (i = 0; i < nloops; i++) {
+		if ((pid = fork()) < 0)
+			err_sys("fork error");
+		else if (pid == 0)
+			writer();		/* doesn't return */
+
+		sleep_us(rand() % 20000);
+		if (kill(pid, SIGKILL) < 0)
+			err_sys("kill error");
+		if (waitpid(pid, NULL, 0) < 0)
+			err_sys("waitpid error");
+		verify();
+	}
+	printf("recovered from %d crashes\n", nloops);
+	exit(0);
+}
+
+/*
+ * Handle A caches a record; a child overwrites it in place through
+ * its own handle, then deletes it.  Each time, A's next db_fetch must
+ * see the change, not what's in its cache.
+ */
+static void
+coherence(void)
+{
+	DBHANDLE	db, db2;
+	pid_t		pid;
+	char		*ptr;
+	int			i, status;
+	static char	*steps[] = { "key0=new", NULL };
+
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	if (db_ctl(db, DB_CACHE, 65536L) < 0)
+		err_sys("db_ctl error");
+	if (db_store(db, "key0", "key0=old", DB_INSERT) != 0)
+		err_sys("db_store error");
+	if ((ptr = db_fetch(db, "key0")) == NULL || strcmp(ptr, "key0=old") != 0)
+		err_quit("key0: fetched %s", ptr == NULL ? "nothing" : ptr);
+
+	for (i = 0; i < 2; i++) {
+		if ((pid = fork()) < 0) {
+			err_sys("fork error");
+		} else if (pid == 0) {
+			if ((db2 = db_open("twal", O_RDWR)) == NULL)
+				err_sys("db_open error");
+			if (steps[i] != NULL)
+				status = db_store(db2, "key0", steps[i], DB_REPLACE);
+			else
+				status = db_delete(db2, "key0");
+			if (status != 0)
+				err_sys("child: can't change key0");
+			db_close(db2);
+			exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0)
+			err_sys("waitpid error");
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			err_quit("child failed");
+
+		ptr = db_fetch(db, "key0");
+		if (steps[i] == NULL ? ptr != NULL :
+		  ptr == NULL || strcmp(ptr, steps[i]) != 0)
+			err_quit("key0: stale cache returned %s",
+			  ptr == NULL ? "nothing" : ptr);
+	}
+	db_close(db);
+}
+
+/*
+ * A child creates the ordered index while we have the database open.
+ * The keys we store and delete afterwards must make it into the index
+ * anyway.
+ */
+static void
+lateindex(void)
+{
+	DBHANDLE	db, db2;
+	pid_t		pid;
+	char		key[16], data[32];
+	int			i, status;
+
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	for (i = 0; i < NKEYS; i++) {
+		if (i == NKEYS / 2) {
+			if ((pid = fork()) < 0) {
+				err_sys("fork error");
+			} else if (pid == 0) {
+				if ((db2 = db_open("twal", O_RDWR)) == NULL)
+					err_sys("db_open error");
+				if (db_ctl(db2, DB_ORDERED) < 0)
+					err_sys("db_ctl error");
+				db_close(db2);
+				exit(0);
+			}
+			if (waitpid(pid, &status, 0) < 0)
+				err_sys("waitpid error");
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				err_quit("child failed");
+		}
+		sprintf(key, "key%d", i);
+		sprintf(data, "%s=", key);
+		if (db_store(db, key, data, DB_INSERT) != 0)
+			err_sys("db_store error for %s", key);
+	}
+	for (i = 0; i < NKEYS; i += 3) {
+		sprintf(key, "key%d", i);
+		if (db_delete(db, key) < 0)
+			err_sys("db_delete error for %s", key);
+	}
+	db_close(db);
+	verify();
+}
+
+/*
+ * A child starts logging and stores key1, then stays alive.  Our
+ * handle, opened before there was a log, replaces key1.  Opening the
+ * database again must not replay the child's log over our write,
+ * and once everyone is gone, replaying it must end with ours, too.
+ */
+static void
+livelog(void)
+{
+	DBHANDLE	db, db2;
+	pid_t		pid;
+	int			fd1[2], fd2[2];
+	char		c;
+
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	if (pipe(fd1) < 0 || pipe(fd2) < 0)
+		err_sys("pipe error");
+	if ((pid = fork()) < 0) {
+		err_sys("fork error");
+	} else if (pid == 0) {
+		close(fd2[1]);
+		if ((db2 = db_open("twal", O_RDWR)) == NULL)
+			err_sys("db_open error");
+		if (db_ctl(db2, DB_WAL, 0L) < 0)
+			err_sys("db_ctl error");
+		if (db_store(db2, "key1", "key1=AAAA", DB_STORE) != 0)
+			err_sys("db_store error");
+		if (write(fd1[1], "x", 1) != 1 || read(fd2[0], &c, 1) < 0)
+			err_sys("pipe I/O error");
+		exit(0);
+	}
+	if (read(fd1[0], &c, 1) != 1)
+		err_quit("child failed");
+
+	if (db_store(db, "key1", "key1=BBBB", DB_REPLACE) != 0)
+		err_sys("db_store error");
+	expect("key1", "key1=BBBB");
+
+	close(fd2[1]);		/* let the child go */
+	if (waitpid(pid, NULL, 0) < 0)
+		err_sys("waitpid error");
+	close(fd1[0]);
+	close(fd1[1]);
+	close(fd2[0]);
+	db_close(db);
+	expect("key1", "key1=BBBB");
+	verify();
+}
+
+/*
+ * A child logs key2 and dies without a checkpoint; we scribble over
+ * the record in the data file, as if it died halfway through writing
+ * it, and cache what we find there.  Once another handle has replayed
+ * the log, our cache must not return the scribble any more.  Our own
+ * handle is read-only, so it doesn't use the log, and the replay isn't
+ * skipped.
+ */
+static void
+replaycache(void)
+{
+	DBHANDLE	db, db2;
+	pid_t		pid;
+	int			fd, status;
+	char		*ptr, *p, buf[8192];
+	ssize_t		n;
+
+	if ((db = db_open("twal", O_RDONLY)) == NULL)
+		err_sys("db_open error");
+	if (db_ctl(db, DB_CACHE, 65536L) < 0)
+		err_sys("db_ctl error");
+	if ((pid = fork()) < 0) {
+		err_sys("fork error");
+	} else if (pid == 0) {
+		if ((db2 = db_open("twal", O_RDWR)) == NULL)
+			err_sys("db_open error");
+		if (db_ctl(db2, DB_WAL, 0L) < 0)
+			err_sys("db_ctl error");
+		if (db_store(db2, "key2", "key2=NEW1", DB_STORE) != 0)
+			err_sys("db_store error");
+		_exit(0);		/* no checkpoint */
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		err_sys("waitpid error");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		err_quit("child failed");
+
+	if ((fd = open("twal.dat", O_RDWR)) < 0)
+		err_sys("can't open twal.dat");
+	if ((n = read(fd, buf, sizeof(buf) - 1)) < 0)
+		err_sys("read error");
+	buf[n] = 0;
+	if ((p = strstr(buf, "key2=NEW1")) == NULL)
+		err_quit("key2 isn't in twal.dat");
+	if (pwrite(fd, "key2=XXXX", 9, p - buf) != 9)
+		err_sys("pwrite error");
+	close(fd);
+	if ((ptr = db_fetch(db, "key2")) == NULL || strcmp(ptr, "key2=XXXX") != 0)
+		err_quit("key2: fetched %s", ptr == NULL ? "nothing" : ptr);
+
+	expect("key2", "key2=NEW1");	/* replays the log */
+	if ((ptr = db_fetch(db, "key2")) == NULL || strcmp(ptr, "key2=NEW1") != 0)
+		err_quit("key2: stale cache returned %s",
+		  ptr == NULL ? "nothing" : ptr);
+	db_close(db);
+	verify();
+}
+
+/*
+ * Open the database and check one record.
+ */
+static void
+expect(const char *key, const char *data)
+{
+	DBHANDLE	db;
+	char		*ptr;
+
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	if ((ptr = db_fetch(db, key)) == NULL || strcmp(ptr, data) != 0)
+		err_quit("%s: expected %s, got %s", key, data,
+		  ptr == NULL ? "nothing" : ptr);
+	db_close(db);
+}
+
+/*
+ * The data for each record is its key, an '=', and a random number
+ * of dots, so records change size and move around the files.
+ */
+static void
+writer(void)
+{
+	DBHANDLE	db;
+	char		key[16], data[64];
+	int			n;
+
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+	if (db_ctl(db, DB_WAL, 16384L) < 0)	/* checkpoint often */
+		err_sys("db_ctl error");
+
+	srand(getpid());
+	for ( ; ; ) {
+		sprintf(key, "key%d", rand() % NKEYS);
+		if (rand() % 4 == 0) {
+			db_delete(db, key);
+			continue;
+		}
+		n = sprintf(data, "%s=", key);
+		memset(data + n, '.', rand() % 32);
+		data[n + rand() % 32] = 0;
+		if (db_store(db, key, data, DB_STORE) < 0)
+			err_sys("db_store error for %s", key);
+	}
+}
+
+/*
+ * Every record db_nextrec finds must have the right data and be
+ * found again by db_fetch, and every key db_fetch finds must have
+ * turned up in the sequential scan.
+ */
+static void
+verify(void)
+{
+	DBHANDLE	db;
+	char		key[IDXLEN_MAX], prev[IDXLEN_MAX], *ptr;
+	char		seen[NKEYS];
+	int			i, n, nseen;
+
+	/*
+	 * A damaged hash chain can loop forever; SIGALRM's default
+	 * action turns that into a failure.
+	 */
+	alarm(10);
+	if ((db = db_open("twal", O_RDWR)) == NULL)
+		err_sys("db_open error");
+
+	memset(seen, 0, sizeof(seen));
+	nseen = 0;
+	while ((ptr = db_nextrec(db, key)) != NULL) {
+		n = strlen(key);
+		if (strncmp(ptr, key, n) != 0 || ptr[n] != '=')
+			err_quit("bad data for %s: %s", key, ptr);
+		if (sscanf(key, "key%d", &i) != 1 || i < 0 || i >= NKEYS)
+			err_quit("bad key %s", key);
+		if (seen[i]++)
+			err_quit("duplicate key %s", key);
+		nseen++;
+	}
+
+	/*
+	 * Now make sure the hash chains agree with the scan.
+	 */
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(key, "key%d", i);
+		if ((db_fetch(db, key) != NULL) != seen[i])
+			err_quit("%s: hash chain doesn't match index", key);
+	}
+
+	/*
+	 * And the ordered index must have every key, in order.
+	 */
+	if (db_seek(db, "") < 0)
+		err_sys("db_seek error");
+	prev[0] = 0;
+	for (n = 0; db_nextkey(db, key) != NULL; n++) {
+		if (strcmp(prev, key) >= 0)
+			err_quit("%s out of order after %s", key, prev);
+		strcpy(prev, key);
+	}
+	if (n != nseen)
+		err_quit("ordered index has %d keys, expected %d", n, nseen);
+
+	/*
+	 * A parallel scan must see the same records.
+	 */
+	nscanned = 0;
+	if (db_scan(db, 4, scanned, NULL) != 0)
+		err_quit("db_scan found bad data");
+	if (nscanned != nseen)
+		err_quit("db_scan found %d keys, expected %d", nscanned, nseen);
+	db_close(db);
+	alarm(0);
+}
+
+static int
+scanned(void *arg, const char *key, const char *data)
+{
+	int		n = strlen(key);
+
+	if (strncmp(data, key, n) != 0 || data[n] != '=')
+		return(1);
+	pthread_mutex_lock(&scanlock);
+	nscanned++;
+	pthread_mutex_unlock(&scanlock);
+	return(0);
+}
@@ -27,6 +27,7 @@
 #include <signal.h>		/* for SIG_ERR */
 
 #define	MAXLINE	4096			/* max line length */
+#define	MAXFDS	64				/* max descriptors for send_fds() */
 
 /*
  * Default file access permissions for new files.
@@ -63,11 +64,16 @@ void	 daemonize(const char *);			/* {Prog daemoninit} */
 void	 sleep_us(unsigned int);			/* {Ex sleepus} */
 ssize_t	 readn(int, void *, size_t);		/* {Prog readn_writen} */
 ssize_t	 writen(int, const void *, size_t);	/* {Prog readn_writen} */
+int		 uring_copy(int, int, off_t, off_t, int,
+		         void (*)(unsigned char *, size_t, void *), void *);
 
 int		 fd_pipe(int *);					/* {Prog sock_fdpipe} */
 int		 recv_fd(int, ssize_t (*func)(int,
 		         const void *, size_t));	/* {Prog recvfd_sockets} */
 int		 send_fd(int, int);					/* {Prog sendfd_sockets} */
+int		 recv_fds(int, int *, int, ssize_t (*func)(int,
+		          const void *, size_t));
+int		 send_fds(int, const int *, int);
 int		 send_err(int, int,
 		          const char *);			/* {Prog senderr} */
 int		 serv_listen(const char *);			/* {Prog servlisten_sockets} */
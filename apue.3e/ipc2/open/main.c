@@ -3,29 +3,117 @@
 
 #define	BUFFSIZE	8192
 
+void	cat(int, int);
+
+/*
+ * Cat the files named on the command line, asking the server
+ * for up to MAXPATHS of them at a time, or else the files named
+ * on standard input, with up to depth (-p) opens in flight at
+ * once.  With -s, the files on standard input may come from the
+ * server's descriptor cache.
+ */
 int
 main(int argc, char *argv[])
 {
-	int		n, fd;
-	char	buf[BUFFSIZE], line[MAXLINE];
+	int			c, i, j, n, id, fd, shared, depth;
+	int			fds[MAXPATHS], ids[MAXPATHS];
+	static char	names[MAXPATHS][MAXLINE];
+
+	shared = 0;
+	depth = 1;
+	while ((c = getopt(argc, argv, "p:s")) != EOF) {
+		switch (c) {
+		case 'p':
+			if ((depth = atoi(optarg)) < 1 || depth > MAXPATHS)
+				err_quit("depth must be 1 to %d", MAXPATHS);
+			break;
+
+		case 's':
+			shared = 1;
+			break;
 
-	/* read filename to cat from stdin */
-	while (fgets(line, MAXLINE, stdin) != NULL) {
-		if (line[strlen(line) - 1] == '\n')
-			line[strlen(line) - 1] = 0; /* replace newline with null */
+		default:
+			err_quit("usage: openclient [-s] [-p depth] [file ...]");
+		}
+	}
+	for (i = optind; i < argc; i += n) {
+		n = argc - i < MAXPATHS ? argc - i : MAXPATHS;
+		if (csopenv(&argv[i], n, O_RDONLY, fds) < 0)
+			err_sys("csopenv error");
+		for (j = 0; j < n; j++) {
+			if (fds[j] < 0) {
+				err_msg("can't open %s: %s", argv[i+j],
+				  strerror(-fds[j]));
+				continue;
+			}
+			cat(fds[j], 0);
+		}
+	}
+	if (optind < argc)
+		exit(0);
 
-		/* open the file */
-		if ((fd = csopen(line, O_RDONLY)) < 0)
-			continue;	/* csopen() prints error from server */
+	/* read filenames to cat from stdin */
+	for ( ; ; ) {
+		for (n = 0; n < depth && fgets(names[n], MAXLINE, stdin) != NULL;
+		  n++) {
+			i = strlen(names[n]);
+			if (i > 0 && names[n][i-1] == '\n')
+				names[n][i-1] = 0;	/* replace newline with null */
+			if ((ids[n] = csopen_start(names[n], O_RDONLY, 0,
+			  shared ? CS_SHARED : 0)) < 0)
+				exit(1);	/* csopen_start() printed why */
+		}
+		if (n == 0)
+			break;
 
-		/* and cat to stdout */
+		/* the answers can come in any order */
+		for (j = 0; j < n; j++) {
+			if ((id = csopen_wait(&fd)) < 0)
+				exit(1);
+			for (i = 0; i < n && ids[i] != id; i++)
+				;
+			if (i == n)
+				err_quit("answer to a request we didn't make");
+			fds[i] = fd < 0 ? -errno : fd;
+		}
+
+		/* and cat them to stdout in order */
+		for (j = 0; j < n; j++) {
+			if (fds[j] < 0)
+				err_msg("can't open %s: %s", names[j],
+				  strerror(-fds[j]));
+			else
+				cat(fds[j], shared);
+		}
+	}
+
+	exit(0);
+}
+
+/*
+ * Copy a file to standard output, and close it.
+ */
+void
+cat(int fd, int shared)
+{
+	int		n;
+	off_t	off;
+	char	buf[BUFFSIZE];
+
+	/*
+	 * A shared descriptor's offset isn't ours to move,
+	 * so read it with pread.
+	 */
+	if (shared) {
+		for (off = 0; (n = pread(fd, buf, BUFFSIZE, off)) > 0; off += n)
+			if (write(STDOUT_FILENO, buf, n) != n)
+				err_sys("write error");
+	} else {
 		while ((n = read(fd, buf, BUFFSIZE)) > 0)
 			if (write(STDOUT_FILENO, buf, n) != n)
 				err_sys("write error");
-		if (n < 0)
-			err_sys("read error");
-		close(fd);
 	}
-
-	exit(0);
+	if (n < 0)
+		err_sys("read error");
+	close(fd);
 }
@@ -1,17 +1,59 @@
 #include	"open.h"
+#include	<fcntl.h>
+#include	<sys/socket.h>
 #include	<sys/uio.h>		/* struct iovec */
 
+static int		csfd = -1;
+static uint32_t	nextid;
+
 /*
  * Open the file by sending the "name" and "oflag" to the
  * connection server and reading a file descriptor back.
+ * Returns -1 with errno set if it can't be opened.  Not to
+ * be used while requests from csopen_start() are in flight.
  */
 int
 csopen(char *name, int oflag)
+{
+	int		id, fd;
+
+	if ((id = csopen_start(name, oflag, FILE_MODE, 0)) < 0)
+		return(-1);
+	if (csopen_wait(&fd) != id)
+		return(-1);
+	return(fd);
+}
+
+/*
+ * Open a file read-only, and let the server answer from its cache
+ * of descriptors.  The file offset is shared with everyone else
+ * who got the file that way, so read it with pread().
+ */
+int
+csopen_shared(char *name)
+{
+	int		id, fd;
+
+	if ((id = csopen_start(name, O_RDONLY, 0, CS_SHARED)) < 0)
+		return(-1);
+	if (csopen_wait(&fd) != id)
+		return(-1);
+	return(fd);
+}
+
+/*
+ * Ask the server to open a file, without waiting for the answer,
+ * so several opens can be in flight at once.  Returns an ID to
+ * match with what csopen_wait() returns, or -1 on error.  The
+ * server stops reading while it has opens of ours outstanding, so
+ * keep no more than a few dozen in flight before waiting.
+ */
+int
+csopen_start(char *name, int oflag, mode_t mode, int flags)
 {
 	int				len;
-	char			buf[12];
-	struct iovec	iov[3];
-	static int		csfd = -1;
+	struct csreq	req;
+	struct iovec	iov[2];
 
 	if (csfd < 0) {		/* open connection to conn server */
 		if ((csfd = cli_conn(CS_OPEN)) < 0) {
@@ -20,19 +62,127 @@ csopen(char *name, int oflag)
 		}
 	}
 
-	sprintf(buf, " %d", oflag);		/* oflag to ascii */
-	iov[0].iov_base = CL_OPEN " ";	/* string concatenation */
-	iov[0].iov_len  = strlen(CL_OPEN) + 1;
+	memset(&req, 0, sizeof(req));
+	req.magic = CS_BINARY;
+	req.op = CS_OPENOP;
+	req.flags = flags;
+	req.id = nextid;
+	nextid = (nextid + 1) & 0x7fffffff;		/* IDs are ints >= 0 */
+	req.oflag = oflag;
+	req.mode = mode;
+	req.pathlen = strlen(name) + 1;		/* null always sent */
+	if (req.pathlen > MAXLINE) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	iov[0].iov_base = (char *)&req;
+	iov[0].iov_len  = sizeof(req);
 	iov[1].iov_base = name;
-	iov[1].iov_len  = strlen(name);
-	iov[2].iov_base = buf;
-	iov[2].iov_len  = strlen(buf) + 1;	/* null always sent */
-	len = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
-	if (writev(csfd, &iov[0], 3) != len) {
+	iov[1].iov_len  = req.pathlen;
+	len = iov[0].iov_len + iov[1].iov_len;
+	if (writev(csfd, &iov[0], 2) != len) {
 		err_ret("writev error");
 		return(-1);
 	}
+	return(req.id);
+}
 
-	/* read back descriptor; returned errors handled by write() */
-	return(recv_fd(csfd, write));
+/*
+ * Wait for the answer to one of the opens we've started.  Returns
+ * its ID, and sets *fdp to the descriptor, or to -1 with errno set
+ * if the server couldn't open the file.  Returns -1 on error.
+ */
+int
+csopen_wait(int *fdp)
+{
+	int				n;
+	struct csresp	resp;
+	struct iovec	iov[1];
+	struct msghdr	msg;
+	union {
+		struct cmsghdr	cm;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	iov[0].iov_base = (char *)&resp;
+	iov[0].iov_len  = sizeof(resp);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if ((n = recvmsg(csfd, &msg, 0)) < 0) {
+		err_ret("recvmsg error");
+		return(-1);
+	} else if (n == 0) {
+		err_ret("connection closed by server");
+		return(-1);
+	}
+	if (n < sizeof(resp) &&
+	  readn(csfd, (char *)&resp + n, sizeof(resp) - n) != sizeof(resp) - n) {
+		err_ret("short answer from server");
+		return(-1);
+	}
+	if (resp.err != 0) {
+		*fdp = -1;
+		errno = resp.err;
+	} else if (msg.msg_controllen >= CMSG_LEN(sizeof(int))) {
+		memcpy(fdp, CMSG_DATA(&ctl.cm), sizeof(int));
+	} else {
+		*fdp = -1;
+		errno = EPROTO;		/* the descriptor didn't come */
+	}
+	return(resp.id);
+}
+
+/*
+ * Open n files, at most MAXPATHS, with one request to the
+ * connection server.  All the descriptors come back in one
+ * message.  fds[i] gets the descriptor for names[i], or -errno
+ * if the server couldn't open it.  Returns 0, or -1 on error.
+ */
+int
+csopenv(char **names, int n, int oflag, int *fds)
+{
+	int				i, len;
+	char			buf[16];
+	struct iovec	iov[2 + 2*MAXPATHS];
+
+	if (n < 1 || n > MAXPATHS) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if (csfd < 0) {		/* open connection to conn server */
+		if ((csfd = cli_conn(CS_OPEN)) < 0) {
+			err_ret("cli_conn error");
+			return(-1);
+		}
+	}
+
+	sprintf(buf, " %d", oflag);
+	iov[0].iov_base = CL_OPENV;
+	iov[0].iov_len  = strlen(CL_OPENV);
+	iov[1].iov_base = buf;
+	iov[1].iov_len  = strlen(buf);
+	len = iov[0].iov_len + iov[1].iov_len;
+	for (i = 0; i < n; i++) {
+		iov[2+2*i].iov_base = " ";
+		iov[2+2*i].iov_len  = 1;
+		iov[3+2*i].iov_base = names[i];
+		iov[3+2*i].iov_len  = strlen(names[i]) + (i == n-1);
+		len += 1 + iov[3+2*i].iov_len;		/* null sent after last */
+	}
+	if (len > MAXLINE) {
+		errno = ENAMETOOLONG;
+		return(-1);
+	}
+	if (writev(csfd, &iov[0], 2 + 2*n) != len) {
+		err_ret("writev error");
+		return(-1);
+	}
+
+	/* read back the descriptors; an error message goes to stderr */
+	if (recv_fds(csfd, fds, n, write) != n)
+		return(-1);
+	return(0);
 }
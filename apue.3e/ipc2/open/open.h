@@ -1,7 +1,39 @@
 #include "apue.h"
 #include <errno.h>
+#include <stdint.h>
 
 #define	CL_OPEN "open"			/* client's request for server */
+#define	CL_OPENV "openv"		/* request for several files */
 #define CS_OPEN "/tmp/opend.socket"	/* server's well-known name */
 
+#define	MAXPATHS	32			/* most files in one request */
+
+/*
+ * A binary request: this header, then the pathname.  The answer is
+ * a csresp, with the descriptor if err is 0.  Answers to several
+ * requests in flight can come back in any order.
+ */
+#define	CS_BINARY	0			/* first byte of a binary request */
+#define	CS_OPENOP	1			/* op: open the file */
+#define	CS_SHARED	0x01		/* flags: a cached descriptor will do */
+
+struct csreq {
+  unsigned char		magic;		/* CS_BINARY */
+  unsigned char		op;
+  unsigned short	flags;
+  uint32_t			id;
+  int32_t			oflag;
+  uint32_t			mode;		/* for O_CREAT */
+  uint32_t			pathlen;	/* including the null */
+};
+
+struct csresp {
+  uint32_t			id;
+  int32_t			err;		/* errno, or 0 if an fd came with it */
+};
+
 int		csopen(char *, int);
+int		csopen_shared(char *);
+int		csopen_start(char *, int, mode_t, int);
+int		csopen_wait(int *);
+int		csopenv(char **, int, int, int *);
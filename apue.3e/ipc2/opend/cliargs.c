@@ -1,18 +1,43 @@
 #include	"opend.h"
+#include	<fcntl.h>
 
 /*
  * This function is called by buf_args(), which is called by
  * handle_request().  buf_args() has broken up the client's
  * buffer into an argv[] style array, which we now process.
+ * The pathnames are left pointing into the request's buffer.
  */
 int
 cli_args(int argc, char **argv)
 {
-	if (argc != 3 || strcmp(argv[0], CL_OPEN) != 0) {
-		strcpy(errmsg, "usage: <pathname> <oflag>\n");
-		return(-1);
+	int		i;
+
+	curreq->shared = 0;
+	if ((argc == 3 || (argc == 4 && strcmp(argv[3], CL_SHARED) == 0)) &&
+	  strcmp(argv[0], CL_OPEN) == 0) {
+		curreq->multi = 0;
+		curreq->paths[0] = argv[1];	/* save ptr to pathname to open */
+		curreq->npaths = 1;
+		curreq->oflag = atoi(argv[2]);
+		if (argc == 4) {
+			if (curreq->oflag != O_RDONLY) {
+				strcpy(errmsg, "only O_RDONLY opens can be shared\n");
+				return(-1);
+			}
+			curreq->shared = 1;
+		}
+		return(0);
+	}
+	if (argc >= 3 && argc - 2 <= MAXPATHS &&
+	  strcmp(argv[0], CL_OPENV) == 0) {
+		curreq->multi = 1;
+		curreq->oflag = atoi(argv[1]);
+		for (i = 2; i < argc; i++)
+			curreq->paths[i-2] = argv[i];
+		curreq->npaths = argc - 2;
+		return(0);
 	}
-	pathname = argv[1];		/* save ptr to pathname to open */
-	oflag = atoi(argv[2]);
-	return(0);
+	sprintf(errmsg, "usage: <pathname> <oflag> [%s], or %s <oflag> "
+	  "<pathname> ... (at most %d)\n", CL_SHARED, CL_OPENV, MAXPATHS);
+	return(-1);
 }
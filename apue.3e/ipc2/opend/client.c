@@ -2,6 +2,10 @@
 
 #define	NALLOC	10		/* # client structs to alloc/realloc for */
 
+static int	 freeslot = -1;	/* first available entry, or -1 */
+static int	*fdindex;		/* client[] index, by descriptor */
+static int	 fdindex_size;
+
 static void
 client_alloc(void)		/* alloc more entries in the client[] array */
 {
@@ -14,9 +18,15 @@ client_alloc(void)		/* alloc more entries in the client[] array */
 	if (client == NULL)
 		err_sys("can't alloc for client array");
 
-	/* initialize the new entries */
-	for (i = client_size; i < client_size + NALLOC; i++)
+	/*
+	 * Initialize the new entries, and put them on the free list,
+	 * lowest index first.  We're only called when the list is empty.
+	 */
+	for (i = client_size + NALLOC - 1; i >= client_size; i--) {
 		client[i].fd = -1;	/* fd of -1 means entry available */
+		client[i].nextfree = freeslot;
+		freeslot = i;
+	}
 
 	client_size += NALLOC;
 }
@@ -27,22 +37,53 @@ client_alloc(void)		/* alloc more entries in the client[] array */
 int
 client_add(int fd, uid_t uid)
 {
-	int		i;
+	int		i, n;
 
-	if (client == NULL)		/* first time we're called */
-		client_alloc();
-again:
-	for (i = 0; i < client_size; i++) {
-		if (client[i].fd == -1) {	/* find an available entry */
-			client[i].fd = fd;
-			client[i].uid = uid;
-			return(i);	/* return index in client[] array */
-		}
+	if (fd >= fdindex_size) {
+		for (n = fdindex_size == 0 ? 64 : fdindex_size; n <= fd; n *= 2)
+			;
+		if ((fdindex = realloc(fdindex, n * sizeof(int))) == NULL)
+			err_sys("can't alloc for client index");
+		for (i = fdindex_size; i < n; i++)
+			fdindex[i] = -1;
+		fdindex_size = n;
 	}
+	if (freeslot < 0)		/* first time, or client array full */
+		client_alloc();
+	i = freeslot;
+	freeslot = client[i].nextfree;
+	client[i].fd = fd;
+	client[i].uid = uid;
+	client[i].nbusy = 0;
+	client[i].pend = NULL;
+	client[i].npend = 0;
+	fdindex[fd] = i;
+	return(i);	/* return index in client[] array */
+}
 
-	/* client array full, time to realloc for more */
-	client_alloc();
-	goto again;		/* and search again (will work this time) */
+/*
+ * Return the index in client[] of the client using fd, or -1.
+ */
+int
+client_find(int fd)
+{
+	if (fd < 0 || fd >= fdindex_size)
+		return(-1);
+	return(fdindex[fd]);
+}
+
+/*
+ * Give back the entry at index i in client[].
+ */
+void
+client_free(int i)
+{
+	fdindex[client[i].fd] = -1;
+	free(client[i].pend);
+	client[i].pend = NULL;
+	client[i].fd = -1;
+	client[i].nextfree = freeslot;
+	freeslot = i;
 }
 
 /*
@@ -53,11 +94,7 @@ client_del(int fd)
 {
 	int		i;
 
-	for (i = 0; i < client_size; i++) {
-		if (client[i].fd == fd) {
-			client[i].fd = -1;
-			return;
-		}
-	}
-	log_quit("can't find client entry for fd %d", fd);
+	if ((i = client_find(fd)) < 0)
+		log_quit("can't find client entry for fd %d", fd);
+	client_free(i);
 }
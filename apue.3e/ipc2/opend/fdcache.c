@@ -0,0 +1,228 @@
+#include	"opend.h"
+#include	<fcntl.h>
+#include	<pthread.h>
+
+/*
+ * A cache of read-only descriptors, for clients that open the
+ * same files over and over.  A hit costs a stat() and a dup()
+ * instead of an open() and a close().  Every descriptor handed
+ * out for a file shares one file offset, so clients have to ask
+ * for this (CL_SHARED), and read with pread().
+ *
+ * An entry is good as long as its path still names the same file,
+ * unchanged: same device, i-node and ctime.  Changing the file's
+ * contents, owner or mode changes its ctime.  We hold at most
+ * "budget" descriptors, and close the least recently used first.
+ */
+#if defined(LINUX)
+#define	CTIME_NS(sbp)	((sbp)->st_ctim.tv_nsec)
+#else
+#define	CTIME_NS(sbp)	0L
+#endif
+
+typedef struct Entry {
+  struct Entry	*hnext;		/* hash chain */
+  struct Entry	*prev;		/* LRU list, most recent first */
+  struct Entry	*next;
+  int		 fd;
+  dev_t		 dev;
+  ino_t		 ino;
+  time_t	 ctime;
+  long		 ctime_ns;
+  char		*path;
+} Entry;
+
+static Entry	**hashtab;
+static int		  hashsize;		/* a power of 2 */
+static Entry	 *lruhead, *lrutail;
+static int		  nentries, budget;
+static long		  nhits, nmisses;
+static pthread_mutex_t	cachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int
+hash(const char *s)
+{
+	unsigned int	h = 5381;
+
+	while (*s != '\0')
+		h = h * 33 + (unsigned char)*s++;
+	return(h);
+}
+
+/*
+ * Unlink an entry from its hash chain and the LRU list, and
+ * free it.  Caller holds cachelock.
+ */
+static void
+entry_del(Entry *ep)
+{
+	Entry	**epp;
+
+	for (epp = &hashtab[hash(ep->path) & (hashsize-1)]; *epp != ep;
+	  epp = &(*epp)->hnext)
+		;
+	*epp = ep->hnext;
+	if (ep->prev != NULL)
+		ep->prev->next = ep->next;
+	else
+		lruhead = ep->next;
+	if (ep->next != NULL)
+		ep->next->prev = ep->prev;
+	else
+		lrutail = ep->prev;
+	close(ep->fd);
+	free(ep->path);
+	free(ep);
+	nentries--;
+}
+
+/*
+ * Find the entry for a path.  Caller holds cachelock.
+ */
+static Entry *
+fdcache_find(const char *path)
+{
+	Entry	*ep;
+
+	for (ep = hashtab[hash(path) & (hashsize-1)]; ep != NULL;
+	  ep = ep->hnext)
+		if (strcmp(ep->path, path) == 0)
+			break;
+	return(ep);
+}
+
+/*
+ * Put an entry at the front of the LRU list.
+ * Caller holds cachelock.
+ */
+static void
+entry_front(Entry *ep)
+{
+	ep->prev = NULL;
+	if ((ep->next = lruhead) != NULL)
+		lruhead->prev = ep;
+	else
+		lrutail = ep;
+	lruhead = ep;
+}
+
+/*
+ * Can uid read a file with these attributes, going by its owner
+ * and the permissions for others?  We don't know the client's
+ * groups, so group permission doesn't count.
+ */
+static int
+may_read(const struct stat *sbp, uid_t uid)
+{
+	if (uid == 0)
+		return(1);
+	if (sbp->st_uid == uid)
+		return((sbp->st_mode & S_IRUSR) != 0);
+	return((sbp->st_mode & S_IROTH) != 0);
+}
+
+/*
+ * Set the most descriptors the cache may hold; 0 turns it off.
+ * We leave at least half our descriptors for everything else.
+ */
+void
+fdcache_init(int nfds)
+{
+	long	openmax;
+
+	if ((openmax = sysconf(_SC_OPEN_MAX)) > 0 && nfds > openmax / 2)
+		nfds = openmax / 2;
+	if ((budget = nfds) <= 0)
+		return;
+	for (hashsize = 16; hashsize < 2 * budget; hashsize *= 2)
+		;
+	if ((hashtab = calloc(hashsize, sizeof(Entry *))) == NULL)
+		log_sys("calloc error");
+}
+
+/*
+ * Open a regular file read-only for a client, through the cache.
+ * Returns a descriptor the caller must close, or -errno.  Files
+ * that aren't regular files are opened the usual way.  A client
+ * only gets files it could read itself.
+ */
+int
+fdcache_open(const char *path, uid_t uid)
+{
+	int			fd;
+	struct stat	sb, fsb;
+	Entry		*ep;
+
+	if (stat(path, &sb) < 0)
+		return(-errno);
+	if (!S_ISREG(sb.st_mode) || budget <= 0) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return(-errno);
+		return(fd);
+	}
+	if (!may_read(&sb, uid))
+		return(-EACCES);
+
+	pthread_mutex_lock(&cachelock);
+	if ((ep = fdcache_find(path)) != NULL) {
+		if (ep->dev == sb.st_dev && ep->ino == sb.st_ino &&
+		  ep->ctime == sb.st_ctime && ep->ctime_ns == CTIME_NS(&sb)) {
+			fd = dup(ep->fd);
+			if (ep != lruhead) {
+				ep->prev->next = ep->next;
+				if (ep->next != NULL)
+					ep->next->prev = ep->prev;
+				else
+					lrutail = ep->prev;
+				entry_front(ep);
+			}
+			if (++nhits % 10000 == 0)
+				log_msg("fd cache: %ld hits, %ld misses", nhits,
+				  nmisses);
+			pthread_mutex_unlock(&cachelock);
+			return(fd < 0 ? -errno : fd);
+		}
+		entry_del(ep);		/* stale */
+	}
+	nmisses++;
+	pthread_mutex_unlock(&cachelock);
+
+	/*
+	 * Open it outside the lock; this is what can be slow.  If
+	 * the file changed since the stat, don't cache it.
+	 */
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return(-errno);
+	if (fstat(fd, &fsb) < 0 || fsb.st_dev != sb.st_dev ||
+	  fsb.st_ino != sb.st_ino || fsb.st_ctime != sb.st_ctime ||
+	  CTIME_NS(&fsb) != CTIME_NS(&sb))
+		return(fd);
+	if ((ep = malloc(sizeof(Entry))) == NULL)
+		return(fd);
+	if ((ep->path = strdup(path)) == NULL || (ep->fd = dup(fd)) < 0) {
+		free(ep->path);
+		free(ep);
+		return(fd);
+	}
+	ep->dev = sb.st_dev;
+	ep->ino = sb.st_ino;
+	ep->ctime = sb.st_ctime;
+	ep->ctime_ns = CTIME_NS(&sb);
+
+	pthread_mutex_lock(&cachelock);
+	if (fdcache_find(path) != NULL) {	/* another worker beat us */
+		pthread_mutex_unlock(&cachelock);
+		close(ep->fd);
+		free(ep->path);
+		free(ep);
+		return(fd);
+	}
+	while (nentries >= budget)
+		entry_del(lrutail);
+	ep->hnext = hashtab[hash(path) & (hashsize-1)];
+	hashtab[hash(path) & (hashsize-1)] = ep;
+	entry_front(ep);
+	nentries++;
+	pthread_mutex_unlock(&cachelock);
+	return(fd);
+}
@@ -0,0 +1,91 @@
+#include	"opend.h"
+#include	<sys/epoll.h>
+
+#define	NEVENTS	64		/* most events we take from one epoll_wait */
+#define	LISTEN	0		/* client[] index of the listening socket */
+#define	DONE	1		/* and of the workers' pipe */
+
+static int	epfd;
+
+/*
+ * Watch fd, and tag its events with its index in client[], so we
+ * never have to search for it.  A client is one-shot: after we see
+ * it's readable, we hear nothing more until it's armed again.
+ */
+static void
+arm(int op, int fd, int i)
+{
+	struct epoll_event	ev;
+
+	ev.events = EPOLLIN;
+	if (i != LISTEN && i != DONE)
+		ev.events |= EPOLLONESHOT;
+	ev.data.u64 = 0;
+	ev.data.u32 = i;
+	if (epoll_ctl(epfd, op, fd, &ev) < 0)
+		log_sys("epoll_ctl error on fd %d", fd);
+}
+
+/*
+ * Called by handle_done() when a client's request has been
+ * answered, so we listen to it again.
+ */
+static void
+client_ready(int clifd)
+{
+	arm(EPOLL_CTL_MOD, clifd, client_find(clifd));
+}
+
+void
+loop(void)
+{
+	int					i, j, n, listenfd, clifd, nread;
+	char				buf[MAXLINE];
+	uid_t				uid;
+	struct epoll_event	events[NEVENTS];
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		log_sys("epoll_create1 error");
+
+	/* obtain fd to listen for client requests on */
+	if ((listenfd = serv_listen(CS_OPEN)) < 0)
+		log_sys("serv_listen error");
+	arm(EPOLL_CTL_ADD, listenfd, client_add(listenfd, 0));	/* [0] */
+	arm(EPOLL_CTL_ADD, donefd, client_add(donefd, 0));		/* [1] */
+
+	for ( ; ; ) {
+		if ((n = epoll_wait(epfd, events, NEVENTS, -1)) < 0)
+			log_sys("epoll_wait error");
+
+		for (j = 0; j < n; j++) {
+			i = events[j].data.u32;
+			if (i == DONE) {
+				handle_done(client_ready);
+				continue;
+			}
+			if (i == LISTEN) {
+				/* accept new client request */
+				if ((clifd = serv_accept(listenfd, &uid)) < 0)
+					log_sys("serv_accept error: %d", clifd);
+				i = client_add(clifd, uid);
+				arm(EPOLL_CTL_ADD, clifd, i);
+				log_msg("new connection: uid %d, fd %d", uid, clifd);
+				continue;
+			}
+
+			/* read argument buffer from client */
+			clifd = client[i].fd;
+			if ((nread = read(clifd, buf, MAXLINE)) < 0) {
+				log_sys("read error on fd %d", clifd);
+			} else if (nread == 0) {
+				/* the client closed the connection */
+				log_msg("closed: uid %d, fd %d", client[i].uid, clifd);
+				client_free(i);
+				close(clifd);	/* and epoll forgets it */
+			} else {		/* process client's request */
+				if (!handle_request(buf, nread, clifd))
+					arm(EPOLL_CTL_MOD, clifd, i);
+			}
+		}
+	}
+}
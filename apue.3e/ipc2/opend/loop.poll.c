@@ -3,6 +3,9 @@
 
 #define NALLOC	10	/* # pollfd structs to alloc/realloc */
 
+static struct pollfd	*pollfd;
+static int				 numfd = 2;
+
 static struct pollfd *
 grow_pollfd(struct pollfd *pfd, int *maxfd)
 {
@@ -21,14 +24,30 @@ grow_pollfd(struct pollfd *pfd, int *maxfd)
 	return(pfd);
 }
 
+/*
+ * Called by handle_done() when a client's request has been
+ * answered.  While it was being worked on, its fd was negated
+ * so poll would ignore it.
+ */
+static void
+client_ready(int clifd)
+{
+	int		i;
+
+	for (i = 2; i < numfd; i++) {
+		if (pollfd[i].fd == -clifd - 1) {
+			pollfd[i].fd = clifd;
+			return;
+		}
+	}
+}
+
 void
 loop(void)
 {
 	int				i, listenfd, clifd, nread;
 	char			buf[MAXLINE];
 	uid_t			uid;
-	struct pollfd	*pollfd;
-	int				numfd = 1;
 	int				maxfd = NALLOC;
 
 	if ((pollfd = malloc(NALLOC * sizeof(struct pollfd))) == NULL)
@@ -44,11 +63,16 @@ loop(void)
 		log_sys("serv_listen error");
 	client_add(listenfd, 0);	/* we use [0] for listenfd */
 	pollfd[0].fd = listenfd;
+	client_add(donefd, 0);		/* and [1] for the workers' pipe */
+	pollfd[1].fd = donefd;
 
 	for ( ; ; ) {
 		if (poll(pollfd, numfd, -1) < 0)
 			log_sys("poll error");
 
+		if (pollfd[1].revents & POLLIN)
+			handle_done(client_ready);
+
 		if (pollfd[0].revents & POLLIN) {
 			/* accept new client request */
 			if ((clifd = serv_accept(listenfd, &uid)) < 0)
@@ -65,7 +89,7 @@ loop(void)
 			log_msg("new connection: uid %d, fd %d", uid, clifd);
 		}
 
-		for (i = 1; i < numfd; i++) {
+		for (i = 2; i < numfd; i++) {
 			if (pollfd[i].revents & POLLHUP) {
 				goto hungup;
 			} else if (pollfd[i].revents & POLLIN) {
@@ -76,7 +100,7 @@ loop(void)
 hungup:
 					/* the client closed the connection */
 					log_msg("closed: uid %d, fd %d",
-					  client[i].uid, pollfd[i].fd);
+					  client[client_find(pollfd[i].fd)].uid, pollfd[i].fd);
 					client_del(pollfd[i].fd);
 					close(pollfd[i].fd);
 					if (i < (numfd-1)) {
@@ -88,8 +112,8 @@ hungup:
 					}
 					numfd--;
 				} else {		/* process client's request */
-					handle_request(buf, nread, pollfd[i].fd,
-					  client[i].uid);
+					if (handle_request(buf, nread, pollfd[i].fd))
+						pollfd[i].fd = -pollfd[i].fd - 1;
 				}
 			}
 		}
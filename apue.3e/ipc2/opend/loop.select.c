@@ -1,13 +1,25 @@
 #include	"opend.h"
 #include	<sys/select.h>
 
+static fd_set	allset;
+
+/*
+ * Called by handle_done() when a client's request has been
+ * answered, so we listen to it again.
+ */
+static void
+client_ready(int clifd)
+{
+	FD_SET(clifd, &allset);
+}
+
 void
 loop(void)
 {
 	int		i, n, maxfd, maxi, listenfd, clifd, nread;
 	char	buf[MAXLINE];
 	uid_t	uid;
-	fd_set	rset, allset;
+	fd_set	rset;
 
 	FD_ZERO(&allset);
 
@@ -15,7 +27,8 @@ loop(void)
 	if ((listenfd = serv_listen(CS_OPEN)) < 0)
 		log_sys("serv_listen error");
 	FD_SET(listenfd, &allset);
-	maxfd = listenfd;
+	FD_SET(donefd, &allset);
+	maxfd = listenfd > donefd ? listenfd : donefd;
 	maxi = -1;
 
 	for ( ; ; ) {
@@ -23,6 +36,9 @@ loop(void)
 		if ((n = select(maxfd + 1, &rset, NULL, NULL, NULL)) < 0)
 			log_sys("select error");
 
+		if (FD_ISSET(donefd, &rset))
+			handle_done(client_ready);
+
 		if (FD_ISSET(listenfd, &rset)) {
 			/* accept new client request */
 			if ((clifd = serv_accept(listenfd, &uid)) < 0)
@@ -51,7 +67,8 @@ loop(void)
 					FD_CLR(clifd, &allset);
 					close(clifd);
 				} else {	/* process client's request */
-					handle_request(buf, nread, clifd, client[i].uid);
+					if (handle_request(buf, nread, clifd))
+						FD_CLR(clifd, &allset);	/* until answered */
 				}
 			}
 		}
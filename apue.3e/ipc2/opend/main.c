@@ -1,25 +1,35 @@
 #include	"opend.h"
 #include	<syslog.h>
 
-int		 debug, oflag, client_size, log_to_stderr;
+int		 debug, client_size, log_to_stderr;
 char	 errmsg[MAXLINE];
-char	*pathname;
 Client	*client = NULL;
 
 int
 main(int argc, char *argv[])
 {
-	int		c;
+	int		c, nworkers, ncachefds;
 
 	log_open("open.serv", LOG_PID, LOG_USER);
 
 	opterr = 0;		/* don't want getopt() writing to stderr */
-	while ((c = getopt(argc, argv, "d")) != EOF) {
+	nworkers = NWORKERS;
+	ncachefds = NCACHEFDS;
+	while ((c = getopt(argc, argv, "c:dt:")) != EOF) {
 		switch (c) {
 		case 'd':		/* debug */
 			debug = log_to_stderr = 1;
 			break;
 
+		case 'c':		/* # descriptors to cache; 0 for none */
+			ncachefds = atoi(optarg);
+			break;
+
+		case 't':		/* # worker threads */
+			if ((nworkers = atoi(optarg)) < 1)
+				err_quit("-t needs at least 1 thread");
+			break;
+
 		case '?':
 			err_quit("unrecognized option: -%c", optopt);
 		}
@@ -27,6 +37,10 @@ main(int argc, char *argv[])
 
 	if (debug == 0)
 		daemonize("opend");
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)	/* client went away */
+		log_sys("can't ignore SIGPIPE");
 
+	fdcache_init(ncachefds);
+	workers_init(nworkers);
 	loop();		/* never returns */
 }
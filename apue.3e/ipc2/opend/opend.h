@@ -1,24 +1,91 @@
 #include "apue.h"
 #include <errno.h>
+#include <stdint.h>
 
 #define	CS_OPEN "/tmp/opend.socket"	/* well-known name */
 #define	CL_OPEN "open"				/* client's request for server */
+#define	CL_OPENV "openv"			/* request for several files */
+#define	CL_SHARED "shared"			/* CL_OPEN may use the fd cache */
+
+/*
+ * A binary request is this header followed by the pathname, and
+ * is answered with a csresp, carrying the descriptor if err is 0.
+ * A client can send several before reading the answers, which can
+ * come back in any order; the id tells them apart.  No text
+ * request starts with a null byte.
+ */
+#define	CS_BINARY	0		/* first byte of a binary request */
+#define	CS_OPENOP	1		/* op: open the file */
+#define	CS_SHARED	0x01	/* flags: the fd cache may answer */
+
+struct csreq {
+  unsigned char		magic;		/* CS_BINARY */
+  unsigned char		op;
+  unsigned short	flags;
+  uint32_t			id;
+  int32_t			oflag;
+  uint32_t			mode;		/* for O_CREAT */
+  uint32_t			pathlen;	/* including the null */
+};
+
+struct csresp {
+  uint32_t			id;
+  int32_t			err;		/* errno, or 0 if an fd came with it */
+};
+
+#define	MAXPATHS	32		/* most files in one request */
+#define	NWORKERS	8		/* default # threads doing the opens */
+#define	NCACHEFDS	128		/* default # descriptors cached */
 
 extern int	 debug;		/* nonzero if interactive (not daemon) */
 extern char	 errmsg[];	/* error message string to return to client */
-extern int	 oflag;		/* open flag: O_xxx ... */
-extern char	*pathname;	/* of file to open for client */
+extern int	 donefd;	/* readable when requests are done */
 
 typedef struct {	/* one Client struct per connected client */
   int	fd;			/* fd, or -1 if available */
   uid_t	uid;
+  int	nextfree;	/* next available entry, if this one is */
+  int	nbusy;		/* # requests the workers have for it */
+  char	*pend;		/* start of a binary request, if npend > 0 */
+  int	npend;
 } Client;
 
 extern Client	*client;		/* ptr to malloc'ed array */
 extern int		 client_size;	/* # entries in client[] array */
 
+/*
+ * A client's request, handed to a worker thread to do the opens,
+ * and back to the main thread to send the results.  While it's
+ * being worked on, we don't read anything more from the client.
+ */
+typedef struct Request {
+  struct Request	*next;
+  int	 clifd;
+  uid_t	 uid;
+  int	 multi;				/* CL_OPENV: answer with send_fds() */
+  int	 binary;			/* csreq: answer with a csresp */
+  uint32_t id;				/* of a binary request */
+  mode_t mode;
+  int	 shared;			/* CL_SHARED: may come from the cache */
+  int	 oflag;
+  int	 npaths;
+  char	*paths[MAXPATHS];	/* point into buf[] */
+  int	 fds[MAXPATHS];		/* descriptor, or -errno */
+  char	 buf[MAXLINE];		/* copy of the client's request */
+} Request;
+
+extern Request	*curreq;		/* request cli_args() is filling in */
+
 int		 cli_args(int, char **);
 int		 client_add(int, uid_t);
 void	 client_del(int);
+void	 client_free(int);
+int		 client_find(int);
 void	 loop(void);
-void	 handle_request(char *, int, int, uid_t);
+int		 handle_request(char *, int, int);
+void	 handle_done(void (*)(int));
+void	 workers_init(int);
+void	 work_add(Request *);
+Request	*work_done(void);
+void	 fdcache_init(int);
+int		 fdcache_open(const char *, uid_t);
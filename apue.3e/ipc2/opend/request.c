@@ -1,38 +1,229 @@
 #include	"opend.h"
 #include	<fcntl.h>
+#include	<sys/socket.h>
 
-void
-handle_request(char *buf, int nread, int clifd, uid_t uid)
+Request	*curreq;
+
+static int	binary_requests(Client *, char *, int);
+static int	send_reply(int, uint32_t, int);
+static int	client_gone(int);
+
+/*
+ * Parse a client's request and hand it to the worker threads.
+ * Returns 1 if anything was queued; the caller stops reading from
+ * the client until handle_done() says it's all answered.  Returns
+ * 0 if there's nothing to wait for.
+ */
+int
+handle_request(char *buf, int nread, int clifd)
 {
-	int		newfd;
+	Request	*rp;
+	Client	*cp;
+
+	cp = &client[client_find(clifd)];
+	if (cp->npend > 0 || buf[0] == CS_BINARY)
+		return(binary_requests(cp, buf, nread));
 
 	if (buf[nread-1] != 0) {
 		snprintf(errmsg, MAXLINE-1,
 		  "request from uid %d not null terminated: %*.*s\n",
-		  uid, nread, nread, buf);
+		  cp->uid, nread, nread, buf);
 		send_err(clifd, -1, errmsg);
-		return;
+		return(0);
 	}
-	log_msg("request: %s, from uid %d", buf, uid);
+	log_msg("request: %s, from uid %d", buf, cp->uid);
+
+	if ((rp = malloc(sizeof(Request))) == NULL)
+		log_sys("malloc error");
+	memcpy(rp->buf, buf, nread);
+	rp->clifd = clifd;
+	rp->uid = cp->uid;
+	rp->binary = 0;
+	rp->mode = FILE_MODE;
 
 	/* parse the arguments, set options */
-	if (buf_args(buf, cli_args) < 0) {
+	curreq = rp;
+	if (buf_args(rp->buf, cli_args) < 0) {
 		send_err(clifd, -1, errmsg);
 		log_msg(errmsg);
-		return;
+		free(rp);
+		return(0);
 	}
+	cp->nbusy++;
+	work_add(rp);
+	return(1);
+}
 
-	if ((newfd = open(pathname, oflag)) < 0) {
-		snprintf(errmsg, MAXLINE-1, "can't open %s: %s\n",
-		  pathname, strerror(errno));
-		send_err(clifd, -1, errmsg);
-		log_msg(errmsg);
-		return;
+/*
+ * Queue every complete binary request in what the client sent,
+ * after whatever was left over from last time, and keep the
+ * start of an incomplete one for next time.  Returns 1 if any
+ * were queued.  Once a header makes no sense we can't find the
+ * next one, so we stop listening to the client; it sees the
+ * connection close after its good requests are answered.
+ */
+static int
+binary_requests(Client *cp, char *buf, int nread)
+{
+	int				n, len, nqueued;
+	char			*p;
+	struct csreq	req;
+	Request			*rp;
+	static char		inbuf[sizeof(struct csreq) + 2*MAXLINE];
+
+	if (cp->npend > 0) {
+		memcpy(inbuf, cp->pend, cp->npend);
+		memcpy(inbuf + cp->npend, buf, nread);
+		p = inbuf;
+		n = cp->npend + nread;
+	} else {
+		p = buf;
+		n = nread;
+	}
+	for (nqueued = 0; n >= sizeof(struct csreq); p += len, n -= len) {
+		memcpy(&req, p, sizeof(struct csreq));	/* p may be unaligned */
+		if (req.magic != CS_BINARY || req.op != CS_OPENOP ||
+		  req.pathlen < 1 || req.pathlen > MAXLINE) {
+			log_msg("bad request from uid %d, fd %d", cp->uid, cp->fd);
+			shutdown(cp->fd, SHUT_RD);
+			n = 0;
+			break;
+		}
+		len = sizeof(struct csreq) + req.pathlen;
+		if (n < len)
+			break;
+		if (p[len-1] != 0 || ((req.flags & CS_SHARED) &&
+		  req.oflag != O_RDONLY)) {
+			send_reply(cp->fd, req.id, -EINVAL);
+			continue;
+		}
+
+		if ((rp = malloc(sizeof(Request))) == NULL)
+			log_sys("malloc error");
+		memcpy(rp->buf, p + sizeof(struct csreq), req.pathlen);
+		rp->clifd = cp->fd;
+		rp->uid = cp->uid;
+		rp->binary = 1;
+		rp->multi = 0;
+		rp->id = req.id;
+		rp->shared = (req.flags & CS_SHARED) != 0;
+		rp->oflag = req.oflag;
+		rp->mode = req.mode;
+		rp->paths[0] = rp->buf;
+		rp->npaths = 1;
+		work_add(rp);
+		nqueued++;
+	}
+
+	/* keep the start of the next request */
+	if (n > 0 && cp->pend == NULL &&
+	  (cp->pend = malloc(sizeof(struct csreq) + MAXLINE)) == NULL)
+		log_sys("malloc error");
+	if (n > 0)
+		memmove(cp->pend, p, n);
+	cp->npend = n;
+	cp->nbusy += nqueued;
+	return(nqueued > 0);
+}
+
+/*
+ * Answer a binary request with a csresp, and the descriptor if
+ * fd >= 0; otherwise -fd is the errno.
+ */
+static int
+send_reply(int clifd, uint32_t id, int fd)
+{
+	struct csresp	resp;
+	struct iovec	iov[1];
+	struct msghdr	msg;
+	union {
+		struct cmsghdr	cm;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+
+	resp.id = id;
+	resp.err = fd < 0 ? -fd : 0;
+	iov[0].iov_base = (char *)&resp;
+	iov[0].iov_len  = sizeof(resp);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov     = iov;
+	msg.msg_iovlen  = 1;
+	if (fd >= 0) {
+		ctl.cm.cmsg_level = SOL_SOCKET;
+		ctl.cm.cmsg_type  = SCM_RIGHTS;
+		ctl.cm.cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(&ctl.cm), &fd, sizeof(int));
+		msg.msg_control    = ctl.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int));
 	}
+	if (sendmsg(clifd, &msg, 0) != sizeof(resp))
+		return(-1);
+	return(0);
+}
 
-	/* send the descriptor */
-	if (send_fd(clifd, newfd) < 0)
-		log_sys("send_fd error");
-	log_msg("sent fd %d over fd %d for %s", newfd, clifd, pathname);
-	close(newfd);		/* we're done with descriptor */
+/*
+ * Send the results of the requests the workers are done with, and
+ * call ready() for each client with nothing more outstanding, so
+ * the caller can listen to it again.  Called when donefd is readable.
+ */
+void
+handle_done(void (*ready)(int))
+{
+	int		i, err;
+	Request	*rp;
+	Client	*cp;
+
+	while ((rp = work_done()) != NULL) {
+		if (rp->binary) {
+			if (send_reply(rp->clifd, rp->id, rp->fds[0]) < 0 &&
+			  !client_gone(rp->clifd))
+				log_ret("can't answer request %lu over fd %d",
+				  (unsigned long)rp->id, rp->clifd);
+		} else if (rp->multi) {
+			/* all the descriptors go in one message */
+			if (send_fds(rp->clifd, rp->fds, rp->npaths) < 0) {
+				if (!client_gone(rp->clifd))
+					log_ret("send_fds error");
+			} else
+				log_msg("sent %d results over fd %d", rp->npaths,
+				  rp->clifd);
+		} else if (rp->fds[0] < 0) {
+			err = -rp->fds[0];
+			snprintf(errmsg, MAXLINE-1, "can't open %s: %s\n",
+			  rp->paths[0], strerror(err));
+			if (send_err(rp->clifd, -1, errmsg) < 0 &&
+			  !client_gone(rp->clifd))
+				log_ret("send_err error");
+			log_msg(errmsg);
+		} else {
+			/* send the descriptor */
+			if (send_fd(rp->clifd, rp->fds[0]) < 0) {
+				if (!client_gone(rp->clifd))
+					log_sys("send_fd error");
+			} else
+					log_msg("sent fd %d over fd %d for %s", rp->fds[0],
+				  rp->clifd, rp->paths[0]);
+		}
+		for (i = 0; i < rp->npaths; i++)
+			if (rp->fds[i] >= 0)
+				close(rp->fds[i]);	/* we're done with descriptor */
+		cp = &client[client_find(rp->clifd)];
+		if (--cp->nbusy == 0)
+			(*ready)(rp->clifd);
+		free(rp);
+	}
+}
+
+/*
+ * After a send to a client fails, see if it's because the client
+ * closed its end with requests outstanding.  That isn't our error;
+ * we'll see the hangup once we listen to the client again.
+ */
+static int
+client_gone(int clifd)
+{
+	if (errno != EPIPE && errno != ECONNRESET)
+		return(0);
+	log_msg("client on fd %d went away", clifd);
+	return(1);
 }
@@ -0,0 +1,118 @@
+#include	"opend.h"
+#include	<fcntl.h>
+#include	<pthread.h>
+
+/*
+ * The opens are done by a pool of worker threads, so a slow
+ * file system holds up only the clients waiting on it.  Requests
+ * wait for a worker on the work queue.  Finished requests go on
+ * the done queue, and a byte is written to a pipe so the main
+ * thread's poll or select wakes up to send the results.
+ */
+int		donefd;					/* read end of the pipe */
+static int		donewfd;		/* write end */
+
+static Request	*workhead, *worktail;
+static Request	*donehead, *donetail;
+static pthread_mutex_t	worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	workready = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t	donelock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+worker(void *arg)
+{
+	int		i;
+	Request	*rp;
+
+	for ( ; ; ) {
+		pthread_mutex_lock(&worklock);
+		while (workhead == NULL)
+			pthread_cond_wait(&workready, &worklock);
+		rp = workhead;
+		if ((workhead = rp->next) == NULL)
+			worktail = NULL;
+		pthread_mutex_unlock(&worklock);
+
+		for (i = 0; i < rp->npaths; i++) {
+			if (rp->shared)
+				rp->fds[i] = fdcache_open(rp->paths[i], rp->uid);
+			else if ((rp->fds[i] = open(rp->paths[i], rp->oflag,
+			  rp->mode)) < 0)
+				rp->fds[i] = -errno;
+		}
+
+		pthread_mutex_lock(&donelock);
+		rp->next = NULL;
+		if (donetail == NULL) {
+			donehead = donetail = rp;
+			if (write(donewfd, "", 1) != 1)	/* wake up main thread */
+				log_sys("write error");
+		} else {
+			donetail->next = rp;
+			donetail = rp;
+		}
+		pthread_mutex_unlock(&donelock);
+	}
+	return((void *)0);
+}
+
+/*
+ * Start nthreads workers, and create the pipe they wake the
+ * main thread with.
+ */
+void
+workers_init(int nthreads)
+{
+	int			i, err, fd[2];
+	pthread_t	tid;
+
+	if (pipe(fd) < 0)
+		log_sys("pipe error");
+	donefd = fd[0];
+	donewfd = fd[1];
+	set_fl(donefd, O_NONBLOCK);
+	for (i = 0; i < nthreads; i++) {
+		if ((err = pthread_create(&tid, NULL, worker, NULL)) != 0)
+			log_exit(err, "can't create thread");
+		pthread_detach(tid);
+	}
+}
+
+/*
+ * Queue a request for the workers.
+ */
+void
+work_add(Request *rp)
+{
+	rp->next = NULL;
+	pthread_mutex_lock(&worklock);
+	if (worktail == NULL)
+		workhead = rp;
+	else
+		worktail->next = rp;
+	worktail = rp;
+	pthread_mutex_unlock(&worklock);
+	pthread_cond_signal(&workready);
+}
+
+/*
+ * Return the next request the workers are done with, or NULL if
+ * there are no more.  The pipe is emptied first, so a worker
+ * that finishes after we've looked wakes us up again.
+ */
+Request *
+work_done(void)
+{
+	char	buf[64];
+	Request	*rp;
+
+	while (read(donefd, buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&donelock);
+	if ((rp = donehead) != NULL) {
+		if ((donehead = rp->next) == NULL)
+			donetail = NULL;
+	}
+	pthread_mutex_unlock(&donelock);
+	return(rp);
+}
@@ -30,7 +30,6 @@ cli_conn(const char *name)
 	memset(&un, 0, sizeof(un));
 	un.sun_family = AF_UNIX;
 	sprintf(un.sun_path, "%s%05ld", CLI_PATH, (long)getpid());
-printf("file is %s\n", un.sun_path);
 	len = offsetof(struct sockaddr_un, sun_path) + strlen(un.sun_path);
 
 	unlink(un.sun_path);		/* in case it already exists */
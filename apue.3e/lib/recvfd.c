@@ -1,5 +1,6 @@
 #include "apue.h"
 #include <sys/socket.h>		/* struct msghdr */
+#include <errno.h>
 
 /* size of control buffer to send/recv one file descriptor */
 #define	CONTROLLEN	CMSG_LEN(sizeof(int))
@@ -72,3 +73,91 @@ recv_fd(int fd, ssize_t (*userfunc)(int, const void *, size_t))
 			return(newfd);	/* descriptor, or -status */
 	}
 }
+
+/*
+ * Receive the descriptors sent by send_fds().  For each entry,
+ * fds[] gets the descriptor, or -status if the server couldn't
+ * open it.  Data before the null byte is passed to userfunc, as
+ * with recv_fd().  Returns the number of entries, or -1 on error.
+ * If the server answered with send_err() instead, errno is set
+ * to its status.
+ */
+int
+recv_fds(int fd, int *fds, int maxfds,
+         ssize_t (*userfunc)(int, const void *, size_t))
+{
+	int				i, n, nr, nfds, len;
+	char			*ptr;
+	int				*fdp;
+	char			buf[MAXLINE];
+	struct iovec	iov[1];
+	struct msghdr	msg;
+	struct cmsghdr	*cmp;
+
+	if (maxfds < 1 || maxfds > MAXFDS) {
+		errno = EINVAL;
+		return(-1);
+	}
+	len = CMSG_SPACE(maxfds * sizeof(int));
+	if ((cmp = malloc(len)) == NULL)
+		return(-1);
+	nfds = -1;
+	while (nfds < 0) {
+		iov[0].iov_base = buf;
+		iov[0].iov_len  = sizeof(buf);
+		msg.msg_iov     = iov;
+		msg.msg_iovlen  = 1;
+		msg.msg_name    = NULL;
+		msg.msg_namelen = 0;
+		msg.msg_control    = cmp;
+		msg.msg_controllen = len;
+		if ((nr = recvmsg(fd, &msg, 0)) < 0) {
+			err_ret("recvmsg error");
+			goto errout;
+		} else if (nr == 0) {
+			err_ret("connection closed by server");
+			goto errout;
+		}
+
+		/*
+		 * The final data is a null byte, the count, and
+		 * the status bytes, which can be null themselves.
+		 */
+		if ((ptr = memchr(buf, 0, nr)) != NULL) {
+			if (ptr + 2 == &buf[nr]) {
+				/* send_err(): the whole request failed */
+				nr = ptr - buf;
+				if (nr > 0 && (*userfunc)(STDERR_FILENO, buf, nr) != nr)
+					goto errout;
+				errno = ptr[1] & 0xFF;
+				goto errout;
+			}
+			if (ptr + 1 >= &buf[nr] ||
+			  (nfds = ptr[1] & 0xFF) > maxfds ||
+			  ptr + 2 + nfds != &buf[nr])
+				err_dump("message format error");
+			if (msg.msg_flags & MSG_CTRUNC)
+				err_dump("descriptors truncated");
+			fdp = (int *)CMSG_DATA(cmp);
+			for (i = n = 0; i < nfds; i++) {
+				if ((fds[i] = -(ptr[2+i] & 0xFF)) == 0)
+					n++;
+			}
+			if (n > 0 && (msg.msg_controllen RELOP
+			  CMSG_LEN(n * sizeof(int))))
+				err_dump("status = 0 but no fd");
+			for (i = 0; i < nfds; i++)
+				if (fds[i] == 0)
+					fds[i] = *fdp++;
+			nr = ptr - buf;
+		}
+		if (nr > 0 && (*userfunc)(STDERR_FILENO, buf, nr) != nr)
+			goto errout;
+	}
+	free(cmp);
+	return(nfds);
+
+errout:
+	free(cmp);
+	return(-1);
+}
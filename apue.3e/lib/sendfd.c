@@ -1,5 +1,6 @@
 #include "apue.h"
 #include <sys/socket.h>
+#include <errno.h>
 
 /* size of control buffer to send/recv one file descriptor */
 #define	CONTROLLEN	CMSG_LEN(sizeof(int))
@@ -47,3 +48,66 @@ send_fd(int fd, int fd_to_send)
 		return(-1);
 	return(0);
 }
+
+/*
+ * Pass several file descriptors to another process in one message.
+ * For each fds[i] < 0, -fds[i] is sent back as that entry's error
+ * status instead.  The 2-byte protocol of send_fd() becomes a null
+ * byte, the number of entries, and a status byte for each one;
+ * the descriptors go in a single SCM_RIGHTS array, in order.
+ */
+int
+send_fds(int fd, const int *fds, int nfds)
+{
+	int				i, n, len, rval;
+	struct iovec	iov[1];
+	struct msghdr	msg;
+	struct cmsghdr	*cmp;
+	int				*fdp;
+	char			buf[2 + MAXFDS];
+
+	if (nfds < 1 || nfds > MAXFDS) {
+		errno = EINVAL;
+		return(-1);
+	}
+	buf[0] = 0;			/* null byte flag to recv_fds() */
+	buf[1] = nfds;
+	for (i = n = 0; i < nfds; i++) {
+		if (fds[i] >= 0) {
+			buf[2+i] = 0;	/* zero status means OK */
+			n++;
+		} else {
+			buf[2+i] = -fds[i];
+			if (buf[2+i] == 0)
+				buf[2+i] = 1;
+		}
+	}
+	iov[0].iov_base = buf;
+	iov[0].iov_len  = 2 + nfds;
+	msg.msg_iov     = iov;
+	msg.msg_iovlen  = 1;
+	msg.msg_name    = NULL;
+	msg.msg_namelen = 0;
+	msg.msg_flags   = 0;
+	cmp = NULL;
+	if (n == 0) {
+		msg.msg_control    = NULL;
+		msg.msg_controllen = 0;
+	} else {
+		len = CMSG_SPACE(n * sizeof(int));
+		if ((cmp = calloc(1, len)) == NULL)
+			return(-1);
+		cmp->cmsg_level  = SOL_SOCKET;
+		cmp->cmsg_type   = SCM_RIGHTS;
+		cmp->cmsg_len    = CMSG_LEN(n * sizeof(int));
+		fdp = (int *)CMSG_DATA(cmp);
+		for (i = 0; i < nfds; i++)
+			if (fds[i] >= 0)
+				*fdp++ = fds[i];
+		msg.msg_control    = cmp;
+		msg.msg_controllen = len;
+	}
+	rval = sendmsg(fd, &msg, 0) == 2 + nfds ? 0 : -1;
+	free(cmp);
+	return(rval);
+}
@@ -0,0 +1,351 @@
+#include "apue.h"
+#include <errno.h>
+
+#ifdef LINUX
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define	UBSZ	(64*1024)	/* size of each buffer */
+
+struct uring {
+	int					fd;
+	unsigned			*sqtail, *sqmask, *sqarray;
+	unsigned			*cqhead, *cqtail, *cqmask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void				*sqptr, *cqptr;
+	size_t				sqlen, cqlen, sqeslen;
+	unsigned			tail;		/* where the next SQE goes */
+	unsigned			nsqe;		/* queued, not yet submitted */
+};
+
+struct slot {
+	off_t	off;		/* file offset of this buffer's data */
+	size_t	len;		/* bytes asked for */
+	int		rres;		/* result of a linked read */
+};
+
+/*
+ * Set up a ring with room for entries submissions, and map its
+ * queues.  Returns 0, or -1 with errno set.
+ */
+static int
+uring_init(struct uring *ur, unsigned entries)
+{
+	struct io_uring_params	p;
+	char					*sq, *cq;
+
+	memset(ur, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	if ((ur->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return(-1);
+	ur->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur->cqlen > ur->sqlen)
+			ur->sqlen = ur->cqlen;
+		ur->cqlen = 0;		/* shares the SQ mapping */
+	}
+	ur->sqptr = mmap(NULL, ur->sqlen, PROT_READ|PROT_WRITE,
+	  MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ur->sqptr == MAP_FAILED)
+		goto errout;
+	if (ur->cqlen == 0) {
+		ur->cqptr = ur->sqptr;
+	} else {
+		ur->cqptr = mmap(NULL, ur->cqlen, PROT_READ|PROT_WRITE,
+		  MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+		if (ur->cqptr == MAP_FAILED)
+			goto errout;
+	}
+	ur->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqeslen, PROT_READ|PROT_WRITE,
+	  MAP_SHARED|MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ur->sqes == MAP_FAILED)
+		goto errout;
+
+	sq = ur->sqptr;
+	cq = ur->cqptr;
+	ur->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	ur->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur->sqarray = (unsigned *)(sq + p.sq_off.array);
+	ur->cqhead = (unsigned *)(cq + p.cq_off.head);
+	ur->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	ur->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ur->tail = *ur->sqtail;
+	return(0);
+
+errout:
+	if (ur->cqlen != 0 && ur->cqptr != NULL && ur->cqptr != MAP_FAILED)
+		munmap(ur->cqptr, ur->cqlen);
+	if (ur->sqptr != MAP_FAILED)
+		munmap(ur->sqptr, ur->sqlen);
+	close(ur->fd);
+	return(-1);
+}
+
+static void
+uring_free(struct uring *ur)
+{
+	munmap(ur->sqes, ur->sqeslen);
+	if (ur->cqlen != 0)
+		munmap(ur->cqptr, ur->cqlen);
+	munmap(ur->sqptr, ur->sqlen);
+	close(ur->fd);
+}
+
+/*
+ * Queue a read or write of one registered buffer.  The caller never
+ * has more than the ring's entries queued, and the kernel takes them
+ * all on every uring_wait(), so there's always room.
+ */
+static void
+uring_prep(struct uring *ur, int op, int fd, int bufi, char *buf,
+  size_t len, off_t off, int flags, unsigned long long data)
+{
+	unsigned			i;
+	struct io_uring_sqe	*sqe;
+
+	i = ur->tail++ & *ur->sqmask;
+	sqe = &ur->sqes[i];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->flags = flags;
+	sqe->fd = fd;
+	sqe->off = off;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->buf_index = bufi;
+	sqe->user_data = data;
+	ur->sqarray[i] = i;
+	ur->nsqe++;
+}
+
+/*
+ * Submit whatever is queued and wait for at least one completion.
+ * Returns 0, or -1 with errno set.
+ */
+static int
+uring_wait(struct uring *ur)
+{
+	int		n;
+
+	__atomic_store_n(ur->sqtail, ur->tail, __ATOMIC_RELEASE);
+	while ((n = syscall(__NR_io_uring_enter, ur->fd, ur->nsqe, 1,
+	  IORING_ENTER_GETEVENTS, NULL, 0)) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return(-1);
+	}
+	ur->nsqe -= n;
+	return(0);
+}
+
+/*
+ * pread and pwrite until all of it is done, for the rare short
+ * transfer.  Returns the number of bytes read (less only at end
+ * of file), or -1.
+ */
+static ssize_t
+preadn(int fd, char *buf, size_t n, off_t off)
+{
+	size_t	done;
+	ssize_t	nr;
+
+	for (done = 0; done < n; done += nr) {
+		if ((nr = pread(fd, buf + done, n - done, off + done)) < 0)
+			return(-1);
+		if (nr == 0)
+			break;
+	}
+	return(done);
+}
+
+static int
+pwriten(int fd, const char *buf, size_t n, off_t off)
+{
+	size_t	done;
+	ssize_t	nw;
+
+	for (done = 0; done < n; done += nw) {
+		if ((nw = pwrite(fd, buf + done, n - done, off + done)) < 0)
+			return(-1);
+	}
+	return(0);
+}
+
+/*
+ * Copy len bytes at offset off of ifd to the same offset of ofd,
+ * with up to depth buffers of io_uring reads and writes in flight.
+ * The buffers are registered with the kernel once, so it doesn't map
+ * them on every request.  Without a translate function, each read is
+ * linked to the write of its buffer: both are queued together, and
+ * we only hear back when the write is done.  With one, each buffer
+ * is translated when its read completes, and then written.
+ * Returns 0 if all OK, -1 on an I/O error with errno set, or -2 if
+ * io_uring can't be used here; then nothing has been done, and the
+ * caller should use read and write instead.
+ */
+int
+uring_copy(int ifd, int ofd, off_t off, off_t len, int depth,
+  void (*xlate)(unsigned char *, size_t, void *), void *arg)
+{
+	int					i, inflight, nfree, err, *freelist;
+	unsigned			head, tail;
+	off_t				end, next;
+	ssize_t				n;
+	char				*bufs, *buf;
+	struct slot			*slots, *sp;
+	struct iovec		*iov;
+	struct uring		ur;
+	struct io_uring_cqe	*cqe;
+
+	if (depth < 1)
+		depth = 1;
+	if (uring_init(&ur, 2 * depth) < 0)
+		return(-2);
+	inflight = 0;
+	bufs = NULL;
+	slots = NULL;
+	freelist = NULL;
+	iov = NULL;
+	if (posix_memalign((void **)&bufs, 4096, (size_t)depth * UBSZ) != 0 ||
+	  (slots = malloc(depth * sizeof(struct slot))) == NULL ||
+	  (freelist = malloc(depth * sizeof(int))) == NULL ||
+	  (iov = malloc(depth * sizeof(struct iovec))) == NULL) {
+		err = -2;
+		goto out;
+	}
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = bufs + (size_t)i * UBSZ;
+		iov[i].iov_len = UBSZ;
+		freelist[i] = depth - 1 - i;
+	}
+	if (syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_BUFFERS,
+	  iov, depth) < 0) {
+		err = -2;			/* e.g. over RLIMIT_MEMLOCK */
+		goto out;
+	}
+
+	/*
+	 * user_data is the slot number times two, plus one for a write.
+	 */
+	err = 0;
+	nfree = depth;
+	end = off + len;
+	for (next = off; ; ) {
+		while (err == 0 && nfree > 0 && next < end) {
+			i = freelist[--nfree];
+			sp = &slots[i];
+			buf = iov[i].iov_base;
+			sp->off = next;
+			sp->len = end - next < UBSZ ? end - next : UBSZ;
+			sp->rres = 0;
+			next += sp->len;
+			uring_prep(&ur, IORING_OP_READ_FIXED, ifd, i, buf, sp->len,
+			  sp->off, xlate == NULL ? IOSQE_IO_LINK : 0, 2 * i);
+			if (xlate == NULL)
+				uring_prep(&ur, IORING_OP_WRITE_FIXED, ofd, i, buf,
+				  sp->len, sp->off, 0, 2 * i + 1);
+			inflight++;
+		}
+		if (inflight == 0)
+			break;
+		if (uring_wait(&ur) < 0) {
+			err = errno;
+			break;
+		}
+
+		head = *ur.cqhead;
+		tail = __atomic_load_n(ur.cqtail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ur.cqes[head & *ur.cqmask];
+			i = cqe->user_data / 2;
+			sp = &slots[i];
+			buf = iov[i].iov_base;
+			if ((cqe->user_data & 1) == 0) {
+				/*
+				 * A read.  If linked, just remember how it went;
+				 * the write's completion follows.
+				 */
+				if (xlate == NULL) {
+					sp->rres = cqe->res;
+					continue;
+				}
+				n = cqe->res;
+				if (n >= 0 && (size_t)n < sp->len)
+					n = preadn(ifd, buf, sp->len, sp->off);
+				if (n < 0) {
+					if (err == 0)
+						err = cqe->res < 0 ? -cqe->res : errno;
+					freelist[nfree++] = i;
+					inflight--;
+					continue;
+				}
+				sp->len = n;		/* less if the file shrank */
+				xlate((unsigned char *)buf, sp->len, arg);
+				uring_prep(&ur, IORING_OP_WRITE_FIXED, ofd, i, buf,
+				  sp->len, sp->off, 0, 2 * i + 1);
+				continue;
+			}
+
+			/*
+			 * A write.  A short or failed linked read cancels its
+			 * write; then do the whole buffer over by hand.
+			 */
+			if (cqe->res == -ECANCELED && xlate == NULL) {
+				if (sp->rres < 0) {
+					if (err == 0)
+						err = -sp->rres;
+				} else if ((n = preadn(ifd, buf, sp->len, sp->off)) < 0 ||
+				  pwriten(ofd, buf, n, sp->off) < 0) {
+					if (err == 0)
+						err = errno;
+				}
+			} else if (cqe->res < 0) {
+				if (err == 0)
+					err = -cqe->res;
+			} else if ((size_t)cqe->res < sp->len) {
+				if (pwriten(ofd, buf + cqe->res, sp->len - cqe->res,
+				  sp->off + cqe->res) < 0 && err == 0)
+					err = errno;
+			}
+			freelist[nfree++] = i;
+			inflight--;
+		}
+		__atomic_store_n(ur.cqhead, head, __ATOMIC_RELEASE);
+	}
+	if (err != 0) {
+		errno = err;
+		err = -1;
+	}
+
+	/*
+	 * If uring_wait failed, the kernel may still be reading into our
+	 * buffers.  Closing the ring cancels those requests, but doesn't
+	 * wait for them, so we can't let malloc hand the memory out again.
+	 */
+	if (inflight > 0)
+		bufs = NULL;
+
+out:
+	uring_free(&ur);
+	free(iov);
+	free(freelist);
+	free(slots);
+	free(bufs);
+	return(err);
+}
+
+#else	/* !LINUX */
+
+int
+uring_copy(int ifd, int ofd, off_t off, off_t len, int depth,
+  void (*xlate)(unsigned char *, size_t, void *), void *arg)
+{
+	return(-2);		/* no io_uring here */
+}
+
+#endif
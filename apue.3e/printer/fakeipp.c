@@ -0,0 +1,240 @@
+/*
+ * A fake IPP printer, for testing the printer spooling daemon
+ * without a real printer.  It accepts Print-Job requests on the
+ * IPP port of the given address, throws the documents away, and
+ * prints a line for each one.  Connections are kept alive, and
+ * pipelined requests are answered in order.  Usage:
+ * 	fakeipp [-f | -e] [-d msec] [-k nreq] [-i secs] address
+ * -f answers every request with an HTTP error, and -e with an IPP
+ * error.  -d delays each answer.  -k closes each connection after
+ * nreq requests, and -i after it's been idle for secs seconds.
+ */
+#include "apue.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+
+#include "print.h"
+#include "ipp.h"
+
+/*
+ * Needed for logging funtions.
+ */
+int log_to_stderr = 1;
+
+int		httpfail;		/* answer with HTTP 500 */
+int		ippfail;		/* answer with an IPP error */
+int		delay;			/* msec to wait before answering */
+int		maxreqs;		/* close after this many; 0 means never */
+int		idlesecs = 60;	/* close after this long idle */
+long	nconns;			/* connections accepted */
+
+pthread_mutex_t	outlock = PTHREAD_MUTEX_INITIALIZER;
+
+struct conn {
+	int		sockfd;
+	long	id;			/* numbered in the order accepted */
+};
+
+void	*serve(void *);
+int		get_request(int, char *, int *, int *, int32_t *, long *);
+
+int
+main(int argc, char *argv[])
+{
+	int				c, err, sockfd, clfd;
+	struct conn		*cp;
+	pthread_t		tid;
+	pthread_attr_t	attr;
+	struct addrinfo	*ailist;
+
+	err = 0;
+	while ((c = getopt(argc, argv, "fed:k:i:")) != -1) {
+		switch (c) {
+		case 'f':
+			httpfail = 1;
+			break;
+
+		case 'e':
+			ippfail = 1;
+			break;
+
+		case 'd':
+			delay = atoi(optarg);
+			break;
+
+		case 'k':
+			maxreqs = atoi(optarg);
+			break;
+
+		case 'i':
+			idlesecs = atoi(optarg);
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || optind != argc - 1)
+		err_quit("usage: fakeipp [-f | -e] [-d msec] [-k nreq] "
+		  "[-i secs] address");
+	if ((err = getaddrlist(argv[optind], "ipp", &ailist)) != 0)
+		err_quit("fakeipp: getaddrinfo error: %s", gai_strerror(err));
+	if ((sockfd = initserver(SOCK_STREAM, ailist->ai_addr,
+	  ailist->ai_addrlen, QLEN)) < 0)
+		err_sys("fakeipp: can't listen on %s", argv[optind]);
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		err_sys("fakeipp: can't ignore SIGPIPE");
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	for (;;) {
+		if ((clfd = accept(sockfd, NULL, NULL)) < 0) {
+			err_ret("fakeipp: accept error");
+			continue;
+		}
+		if ((cp = malloc(sizeof(struct conn))) == NULL)
+			err_sys("fakeipp: malloc error");
+		cp->sockfd = clfd;
+		cp->id = ++nconns;
+		if ((err = pthread_create(&tid, &attr, serve, cp)) != 0)
+			err_exit(err, "fakeipp: can't create thread");
+	}
+}
+
+/*
+ * Answer the requests on one connection until the client closes
+ * it, or we decide to.
+ */
+void *
+serve(void *arg)
+{
+	int				sockfd, len, nreq, keep, hlen;
+	long			conn, size;
+	int32_t			reqid;
+	struct timespec	ts;
+	struct timeval	tv;
+	char			buf[IOBUFSZ], resp[HBUFSZ];
+	unsigned char	ipp[9];
+
+	sockfd = ((struct conn *)arg)->sockfd;
+	conn = ((struct conn *)arg)->id;
+	free(arg);
+	tv.tv_sec = idlesecs;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	len = 0;
+	for (nreq = 1; get_request(sockfd, buf, &len, &keep, &reqid,
+	  &size) == 0; nreq++) {
+		pthread_mutex_lock(&outlock);
+		printf("%d %ld conn %ld req %d\n", reqid, size, conn, nreq);
+		pthread_mutex_unlock(&outlock);
+		if (delay > 0) {
+			ts.tv_sec = delay / 1000;
+			ts.tv_nsec = (delay % 1000) * 1000000L;
+			nanosleep(&ts, NULL);
+		}
+		if (maxreqs > 0 && nreq >= maxreqs)
+			keep = 0;
+		if (httpfail) {
+			hlen = sprintf(resp, "HTTP/1.1 500 Internal Error\r\n"
+			  "Content-Length: 0\r\n%s\r\n",
+			  keep ? "" : "Connection: close\r\n");
+		} else {
+			ipp[0] = 1;
+			ipp[1] = 1;
+			ipp[2] = ippfail ? 5 : 0;	/* 0x0500 is an error */
+			ipp[3] = 0;
+			ipp[4] = reqid >> 24;
+			ipp[5] = reqid >> 16;
+			ipp[6] = reqid >> 8;
+			ipp[7] = reqid;
+			ipp[8] = TAG_END_OF_ATTR;
+			hlen = sprintf(resp, "HTTP/1.1 200 OK\r\n"
+			  "Content-Type: application/ipp\r\n"
+			  "Content-Length: %d\r\n%s\r\n", (int)sizeof(ipp),
+			  keep ? "" : "Connection: close\r\n");
+			memcpy(resp + hlen, ipp, sizeof(ipp));
+			hlen += sizeof(ipp);
+		}
+		if (writen(sockfd, resp, hlen) != hlen || !keep)
+			break;
+	}
+	close(sockfd);
+	return((void *)0);
+}
+
+/*
+ * Read one request.  buf holds *lenp bytes already read, which
+ * can be the start of the next request; on return, it holds
+ * whatever follows this one.  Returns 0 with the request ID, the
+ * size of the body, and whether the client wants the connection
+ * kept, or -1 at end of file or on error.
+ */
+int
+get_request(int sockfd, char *buf, int *lenp, int *keepp, int32_t *reqidp,
+  long *sizep)
+{
+	int			len, hlen, nr;
+	long		clen, left;
+	char		*cp, *ep;
+
+	len = *lenp;
+	for (;;) {
+		buf[len] = '\0';
+		if ((ep = strstr(buf, "\r\n\r\n")) != NULL)
+			break;
+		if (len >= IOBUFSZ - 1)
+			return(-1);		/* header too long */
+		if ((nr = read(sockfd, buf + len, IOBUFSZ - 1 - len)) <= 0)
+			return(-1);
+		len += nr;
+	}
+	hlen = ep + 4 - buf;
+	*ep = '\0';
+	clen = -1;
+	if ((cp = strchr(buf, '\r')) != NULL)
+		*cp++ = '\0';
+	*keepp = strstr(buf, "HTTP/1.0") == NULL;	/* 1.1 keeps by default */
+	for (; cp != NULL; cp = strchr(cp, '\n')) {
+		cp++;
+		if (strncasecmp(cp, "Content-Length:", 15) == 0)
+			clen = atol(cp + 15);
+		else if (strncasecmp(cp, "Connection:", 11) == 0)
+			*keepp = strstr(cp, "close") == NULL;
+	}
+	if (clen < 0)
+		return(-1);		/* we need the length */
+
+	/*
+	 * Read enough of the body to get the request ID,
+	 * and skip the rest.
+	 */
+	memmove(buf, buf + hlen, len - hlen);
+	len -= hlen;
+	while (len < 8 && len < clen) {
+		if ((nr = read(sockfd, buf + len, IOBUFSZ - 1 - len)) <= 0)
+			return(-1);
+		len += nr;
+	}
+	if (clen < 8)
+		return(-1);
+	*reqidp = ((buf[4] & 0xff) << 24) | ((buf[5] & 0xff) << 16) |
+	  ((buf[6] & 0xff) << 8) | (buf[7] & 0xff);
+	*sizep = clen;
+	if (len >= clen) {
+		memmove(buf, buf + clen, len - clen);
+		*lenp = len - clen;
+		return(0);
+	}
+	for (left = clen - len; left > 0; left -= nr) {
+		if ((nr = read(sockfd, buf,
+		  left < IOBUFSZ - 1 ? left : IOBUFSZ - 1)) <= 0)
+			return(-1);
+	}
+	*lenp = 0;
+	return(0);
+}
@@ -0,0 +1,167 @@
+/*
+ * Load generator for the printer spooling daemon.  Starts nclients
+ * threads that each submit njobs small jobs, one after another, as
+ * fast as the daemon takes them, and reports how many were accepted,
+ * how many were turned away as busy, and the job rate.  Usage:
+ * 	pbench [-c nclients] [-n njobs] [-s size]
+ */
+#include "apue.h"
+#include "print.h"
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Needed for logging funtions.
+ */
+int log_to_stderr = 1;
+
+struct addrinfo	*ailist;
+int				njobs = 100;
+size_t			jobsize = 1024;
+char			*jobdata;
+
+pthread_mutex_t	countlock = PTHREAD_MUTEX_INITIALIZER;
+long			nok, nbusy, nerr;
+double			maxlat, totlat;
+
+void	*bench_thread(void *);
+int		submit(struct printreq *);
+
+int
+main(int argc, char *argv[])
+{
+	int				c, err, i, nclients;
+	char			*host;
+	pthread_t		*tids;
+	struct timespec	start, end;
+	double			secs;
+
+	err = 0;
+	nclients = 100;
+	while ((c = getopt(argc, argv, "c:n:s:")) != -1) {
+		switch (c) {
+		case 'c':
+			nclients = atoi(optarg);
+			break;
+
+		case 'n':
+			njobs = atoi(optarg);
+			break;
+
+		case 's':
+			jobsize = atol(optarg);
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || optind != argc || nclients <= 0 || njobs <= 0)
+		err_quit("usage: pbench [-c nclients] [-n njobs] [-s size]");
+
+	if ((host = get_printserver()) == NULL)
+		err_quit("pbench: no print server defined");
+	if ((err = getaddrlist(host, "print", &ailist)) != 0)
+		err_quit("pbench: getaddrinfo error: %s", gai_strerror(err));
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		err_sys("pbench: can't ignore SIGPIPE");
+
+	/*
+	 * Plain text, so the daemon flags it PR_TEXT.
+	 */
+	if ((jobdata = malloc(jobsize)) == NULL ||
+	  (tids = malloc(nclients * sizeof(pthread_t))) == NULL)
+		err_sys("pbench: malloc error");
+	memset(jobdata, 'x', jobsize);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nclients; i++) {
+		if ((err = pthread_create(&tids[i], NULL, bench_thread,
+		  NULL)) != 0)
+			err_exit(err, "pbench: can't create thread");
+	}
+	for (i = 0; i < nclients; i++)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	  (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d clients x %d jobs of %lu bytes in %.2f s\n", nclients,
+	  njobs, (unsigned long)jobsize, secs);
+	printf("accepted %ld (%.0f jobs/s, %.1f MB/s), busy %ld, errors %ld\n",
+	  nok, nok / secs, nok * (double)jobsize / secs / 1e6, nbusy, nerr);
+	if (nok + nbusy > 0)
+		printf("latency: mean %.1f ms, max %.1f ms\n",
+		  totlat / (nok + nbusy) * 1000, maxlat * 1000);
+	exit(0);
+}
+
+/*
+ * Submit njobs jobs, one after another.
+ */
+void *
+bench_thread(void *arg)
+{
+	int				i, rc;
+	struct printreq	req;
+	struct timespec	start, end;
+	double			lat;
+
+	memset(&req, 0, sizeof(req));
+	req.size = htonl(jobsize);
+	strcpy(req.usernm, "pbench");
+	strcpy(req.jobnm, "pbench");
+	for (i = 0; i < njobs; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rc = submit(&req);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		lat = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) / 1e9;
+		pthread_mutex_lock(&countlock);
+		if (rc == 0)
+			nok++;
+		else if (rc == EBUSY)
+			nbusy++;
+		else
+			nerr++;
+		if (rc == 0 || rc == EBUSY) {
+			totlat += lat;
+			if (lat > maxlat)
+				maxlat = lat;
+		}
+		pthread_mutex_unlock(&countlock);
+	}
+	return((void *)0);
+}
+
+/*
+ * Send one job.  We shut down our side of the connection when we're
+ * done, so the daemon sees end of file right away.  Returns 0 on
+ * success, the daemon's error code if it refused the job, or -1.
+ */
+int
+submit(struct printreq *reqp)
+{
+	int					sockfd;
+	struct printresp	res;
+
+	if ((sockfd = connect_retry(AF_INET, SOCK_STREAM, 0,
+	  ailist->ai_addr, ailist->ai_addrlen)) < 0)
+		return(-1);
+
+	/*
+	 * If we're turned away, the writes can fail, but the
+	 * response is still there to read.
+	 */
+	if (writen(sockfd, reqp, sizeof(struct printreq)) ==
+	  sizeof(struct printreq))
+		writen(sockfd, jobdata, jobsize);
+	shutdown(sockfd, SHUT_WR);
+	if (readn(sockfd, &res, sizeof(res)) != sizeof(res)) {
+		close(sockfd);
+		return(-1);
+	}
+	close(sockfd);
+	return(ntohl(res.retcode));
+}
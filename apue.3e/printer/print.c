@@ -1,7 +1,9 @@
 /*
  * The client command for printing documents.  Opens the file
  * and sends it to the printer spooling daemon.  Usage:
- * 	print [-t] filename
+ * 	print [-t] [-u | -l] [-p printer] filename
+ * -u asks for the job to be printed ahead of normal jobs, and
+ * -l for it to wait until they're done.
  */
 #include "apue.h"
 #include "print.h"
@@ -13,22 +15,38 @@
  */
 int log_to_stderr = 1;
 
-void submit_file(int, int, const char *, size_t, int);
+void submit_file(int, int, const char *, size_t, uint32_t, const char *);
 
 int
 main(int argc, char *argv[])
 {
-	int				fd, sfd, err, text, c;
+	int				fd, sfd, err, c;
+	uint32_t		flags;
 	struct stat		sbuf;
-	char			*host;
+	char			*host, *prname;
 	struct addrinfo	*ailist, *aip;
 
 	err = 0;
-	text = 0;
-	while ((c = getopt(argc, argv, "t")) != -1) {
+	flags = 0;
+	prname = "";
+	while ((c = getopt(argc, argv, "tulp:")) != -1) {
 		switch (c) {
 		case 't':
-			text = 1;
+			flags |= PR_TEXT;
+			break;
+
+		case 'u':
+			flags = (flags & ~PR_LOW) | PR_HIGH;
+			break;
+
+		case 'l':
+			flags = (flags & ~PR_HIGH) | PR_LOW;
+			break;
+
+		case 'p':
+			if (strlen(optarg) >= PRINTERNM_MAX)
+				err_quit("print: printer name too long");
+			prname = optarg;
 			break;
 
 		case '?':
@@ -37,7 +55,7 @@ main(int argc, char *argv[])
 		}
 	}
 	if (err || (optind != argc - 1))
-		err_quit("usage: print [-t] filename");
+		err_quit("usage: print [-t] [-u | -l] [-p printer] filename");
 	if ((fd = open(argv[optind], O_RDONLY)) < 0)
 		err_sys("print: can't open %s", argv[optind]);
 	if (fstat(fd, &sbuf) < 0)
@@ -53,12 +71,20 @@ main(int argc, char *argv[])
 	if ((err = getaddrlist(host, "print", &ailist)) != 0)
 		err_quit("print: getaddrinfo error: %s", gai_strerror(err));
 
+	/*
+	 * A busy server can answer before reading the file, and close
+	 * the connection.  We want to print its answer, not die.
+	 */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		err_sys("print: can't ignore SIGPIPE");
+
 	for (aip = ailist; aip != NULL; aip = aip->ai_next) {
 		if ((sfd = connect_retry(AF_INET, SOCK_STREAM, 0,
 		  aip->ai_addr, aip->ai_addrlen)) < 0) {
 			err = errno;
 		} else {
-			submit_file(fd, sfd, argv[optind], sbuf.st_size, text);
+			submit_file(fd, sfd, argv[optind], sbuf.st_size, flags,
+			  prname);
 			exit(0);
 		}
 	}
@@ -70,7 +96,7 @@ main(int argc, char *argv[])
  */
 void
 submit_file(int fd, int sockfd, const char *fname, size_t nbytes,
-            int text)
+            uint32_t flags, const char *prname)
 {
 	int					nr, nw, len;
 	struct passwd		*pwd;
@@ -89,10 +115,7 @@ submit_file(int fd, int sockfd, const char *fname, size_t nbytes,
 	}
 	req.size = htonl(nbytes);
 
-	if (text)
-		req.flags = htonl(PR_TEXT);
-	else
-		req.flags = 0;
+	req.flags = htonl(flags);
 
 	if ((len = strlen(fname)) >= JOBNM_MAX) {
 		/*
@@ -104,12 +127,16 @@ submit_file(int fd, int sockfd, const char *fname, size_t nbytes,
 	} else {
 		strcpy(req.jobnm, fname);
 	}
+	memset(req.prname, 0, PRINTERNM_MAX);
+	strcpy(req.prname, prname);
 
 	/*
 	 * Send the header to the server.
 	 */
 	nw = writen(sockfd, &req, sizeof(struct printreq));
 	if (nw != sizeof(struct printreq)) {
+		if (nw < 0 && (errno == EPIPE || errno == ECONNRESET))
+			goto response;		/* turned away */
 		if (nw < 0)
 			err_sys("can't write to print server");
 		else
@@ -123,6 +150,8 @@ submit_file(int fd, int sockfd, const char *fname, size_t nbytes,
 	while ((nr = read(fd, buf, IOBUFSZ)) != 0) {
 		nw = writen(sockfd, buf, nr);
 		if (nw != nr) {
+			if (nw < 0 && (errno == EPIPE || errno == ECONNRESET))
+				break;			/* turned away */
 			if (nw < 0)
 				err_sys("can't write to print server");
 			else
@@ -134,6 +163,7 @@ submit_file(int fd, int sockfd, const char *fname, size_t nbytes,
 	/*
 	 * Read the response.
 	 */
+response:
 	if ((nr = readn(sockfd, &res, sizeof(struct printresp))) !=
 	  sizeof(struct printresp))
 		err_sys("can't read response from server");
@@ -12,6 +12,8 @@
 #define CONFIG_FILE    "/etc/printer.conf"
 #define SPOOLDIR       "/var/spool/printer"
 #define JOBFILE        "jobno"
+#define JNLFILE        "jobs.jnl"
+#define CTLFILE        "printd.ctl"
 #define DATADIR        "data"
 #define REQDIR         "reqs"
 
@@ -28,6 +30,7 @@
 
 #define USERNM_MAX      64
 #define JOBNM_MAX       256
+#define PRINTERNM_MAX   64
 #define MSGLEN_MAX      512
 
 #ifndef HOST_NAME_MAX
@@ -35,7 +38,10 @@
 #endif
 
 #define IPP_PORT        631
-#define QLEN            10
+#define QLEN            SOMAXCONN	/* clients wait here for accept */
+
+#define CLIENT_THREADS  16	/* default #threads taking print jobs */
+#define CLIENT_QLEN     64	/* default #connections waiting for one */
 
 #define IBUFSZ          512	/* IPP header buffer size */
 #define HBUFSZ          512	/* HTTP header buffer size */
@@ -48,7 +54,9 @@
 extern int getaddrlist(const char *, const char *,
   struct addrinfo **);
 extern char *get_printserver(void);
-extern struct addrinfo *get_printaddr(void);
+extern char *get_printer(int);
+extern int get_confignum(char *, int);
+extern struct addrinfo *get_printaddr(const char *);
 extern ssize_t tread(int, void *, size_t, unsigned int);
 extern ssize_t treadn(int, void *, size_t, unsigned int);
 extern int connect_retry(int, int, int, const struct sockaddr *,
@@ -64,12 +72,15 @@ struct printreq {
 	uint32_t flags;				/* see below */
 	char usernm[USERNM_MAX];	/* user's name */
 	char jobnm[JOBNM_MAX];		/* job's name */
+	char prname[PRINTERNM_MAX];	/* printer; "" for the default */
 };
 
 /*
  * Request flags.
  */
 #define PR_TEXT		0x01	/* treat file as plain text */
+#define PR_HIGH		0x02	/* print before normal jobs */
+#define PR_LOW		0x04	/* print after normal jobs */
 
 /*
  * The response from the spooling daemon to the print command.
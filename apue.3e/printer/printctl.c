@@ -0,0 +1,55 @@
+/*
+ * Ask the printer spooling daemon what it's doing, through its
+ * control socket.  Usage:
+ * 	printctl [status | jobs | hist | cancel jobid]
+ * With no command, asks for the status.
+ */
+#include "apue.h"
+#include "print.h"
+
+/*
+ * Needed for logging funtions.
+ */
+int log_to_stderr = 1;
+
+int
+main(int argc, char *argv[])
+{
+	int		fd, n, len, failed;
+	char	name[FILENMSZ];
+	char	buf[IOBUFSZ];
+
+	if (argc == 1) {
+		strcpy(buf, "status\n");
+	} else if ((argc == 2 && (strcmp(argv[1], "status") == 0 ||
+	  strcmp(argv[1], "jobs") == 0 || strcmp(argv[1], "hist") == 0))) {
+		sprintf(buf, "%s\n", argv[1]);
+	} else if (argc == 3 && strcmp(argv[1], "cancel") == 0 &&
+	  atol(argv[2]) > 0) {
+		sprintf(buf, "cancel %ld\n", atol(argv[2]));
+	} else {
+		err_quit("usage: printctl [status | jobs | hist | cancel jobid]");
+	}
+
+	sprintf(name, "%s/%s", SPOOLDIR, CTLFILE);
+	if ((fd = cli_conn(name)) < 0)
+		err_sys("printctl: can't connect to %s", name);
+	len = strlen(buf);
+	if (writen(fd, buf, len) != len)
+		err_sys("printctl: write error");
+
+	/*
+	 * The daemon answers with one line starting "error: "
+	 * if it can't do what we asked.
+	 */
+	failed = -1;
+	while ((n = read(fd, buf, IOBUFSZ)) > 0) {
+		if (failed < 0)
+			failed = n >= 7 && strncmp(buf, "error: ", 7) == 0;
+		if (write(STDOUT_FILENO, buf, n) != n)
+			err_sys("printctl: write error");
+	}
+	if (n < 0)
+		err_sys("printctl: read error");
+	exit(failed > 0);
+}
@@ -7,9 +7,17 @@
 #include <ctype.h>
 #include <pwd.h>
 #include <pthread.h>
+#include <search.h>
 #include <strings.h>
 #include <sys/select.h>
 #include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#if defined(LINUX)
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#endif
 
 #include "print.h"
 #include "ipp.h"
@@ -20,24 +28,204 @@
 #define HTTP_INFO(x)	((x) >= 100 && (x) <= 199)
 #define HTTP_SUCCESS(x) ((x) >= 200 && (x) <= 299)
 
+/*
+ * Tells the kernel more data follows, so the headers go out in the
+ * same segments as the start of the file.
+ */
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+/*
+ * Uploads are moved from the socket to the spool file through a
+ * pipe, SPLICE_MAX bytes at a time.  Jobs of at least "directsize"
+ * MB (DIRECT_MB unless the config file says otherwise; 0 turns it
+ * off) bypass the page cache, so a few huge jobs don't push
+ * everything else out of memory.  O_DIRECT needs aligned buffers.
+ */
+#define SPLICE_MAX		(1024*1024)
+#define DIRECT_MB		1024
+#define DIRECT_ALIGN	4096
+#define DIRECT_BUFSZ	(1024*1024)
+
+/*
+ * We keep the connection to a printer open for "ippidle" seconds
+ * (IPP_IDLE unless the config file says otherwise) after its last
+ * job, and send it up to "ippdepth" jobs (IPP_DEPTH, at most
+ * IPP_DEPTH_MAX) before reading the answers.  Each answer must
+ * start within IPP_TIMEOUT seconds.
+ */
+#define IPP_IDLE		30
+#define IPP_DEPTH		4
+#define IPP_DEPTH_MAX	32
+#define IPP_TIMEOUT		5
+
+/*
+ * What's happened to each of the jobs a printer thread took.
+ * Jobs that printed or were canceled are gone.
+ */
+#define JOB_QUEUED		0	/* to be sent */
+#define JOB_SENT		1	/* waiting for the answer */
+#define JOB_FAILED		2	/* the printer refused it */
+
+/*
+ * After a printer fails, we leave it alone for BACKOFF_MIN seconds,
+ * doubling that for each failure in a row, up to BACKOFF_MAX.
+ */
+#define BACKOFF_MIN		5
+#define BACKOFF_MAX		600
+
+/*
+ * We answer a client we turn away right away, but keep reading
+ * what it sends for up to DRAIN_SECS seconds.  Closing a socket with
+ * unread data resets the connection, and the client would never
+ * see our answer.
+ */
+#define DRAIN_MAX		256
+#define DRAIN_SECS		10
+
+/*
+ * The main thread waits for new connections, and for the clients
+ * it's turned away, with epoll on Linux and select elsewhere.  It
+ * takes up to ACCEPT_MAX connections from a listening socket before
+ * looking at the others again.  We listen on at most LISTEN_MAX
+ * addresses.
+ */
+#define ACCEPT_MAX		64
+#define LISTEN_MAX		16
+#define READY_MAX		(LISTEN_MAX + DRAIN_MAX)
+#if defined(LINUX)
+#define CAN_WATCH(fd)	1
+#else
+#define CAN_WATCH(fd)	((fd) < FD_SETSIZE)
+#endif
+
+/*
+ * Jobs are scheduled by priority, then shared among users by
+ * deficit round robin: each time it's a user's turn, the user may
+ * print another QUANTUM bytes.  Each job also costs JOBCHARGE bytes,
+ * so a user with a pile of tiny jobs still gets only a few in per
+ * turn.  A user's own jobs go smallest first.
+ */
+#define NPRIO			3		/* high, normal, low */
+#define QUANTUM			(64*1024)
+#define JOBCHARGE		(32*1024)
+#define JOB_COST(jp)	((long long)(jp)->req.size + JOBCHARGE)
+
+/*
+ * Job IDs are leased from the job ID file JOBBLOCK at a time, so
+ * it's written once per block instead of once per job.  After a
+ * crash we start at the next block; IDs left in the old one are
+ * never used.  IDs start over at 1 after JOBID_MAX.
+ */
+#define JOBBLOCK		1000
+#define JOBID_MAX		999999999
+
+/*
+ * The journal records each job when it's queued and again when
+ * it's done, so we can rebuild the queue in order on start-up
+ * without reading every control file.  It's rewritten with just
+ * the pending jobs once it holds JNL_COMPACT records for jobs
+ * that are done, and they outnumber the pending ones.
+ */
+#define JNL_ADD			1
+#define JNL_DONE		2
+#define JNL_COMPACT		20000
+
+/*
+ * The counters printctl reads through the control socket.  They're
+ * only ever added to, atomically, so the threads doing the work
+ * never wait on someone watching them.  Times are kept in
+ * histograms: bucket i counts times under 2^i milliseconds, and the
+ * last bucket everything longer.  A control request must arrive
+ * within CTL_TIMEOUT seconds, and the answer must be taken just as
+ * fast.
+ */
+#define NHIST			20
+#define STAT_ADD(x, n)	__sync_fetch_and_add(&(x), (n))
+#define CTL_LINEMAX		128
+#define CTL_TIMEOUT		5
+
+struct stats {
+	volatile long       njobs;		/* printed */
+	volatile long       nfailed;	/* refused by the printer */
+	volatile long       nretries;	/* put back to try again */
+	volatile long long  nbytes;		/* bytes printed */
+	volatile long long  sendus;		/* usec spent sending them */
+	volatile long       waithist[NHIST];	/* queued until sent */
+	volatile long       sendhist[NHIST];	/* sent until answered */
+};
+
 /*
  * Describes a print job.
  */
 struct job {
-	struct job      *next;		/* next in list */
-	struct job      *prev;		/* previous in list */
 	int32_t          jobid;		/* job ID */
+	struct printer  *printer;	/* where it's going */
+	long long        queued;	/* when it was queued, in msec */
+	long long        sent;		/* when it was last sent, in msec */
+	struct printreq  req;		/* copy of print request */
+};
+
+/*
+ * A journal record.  JNL_DONE records end after the type.
+ */
+struct jnlrec {
+	int32_t          jobid;		/* first, for jobid_cmp */
+	int32_t          type;		/* JNL_ADD or JNL_DONE */
 	struct printreq  req;		/* copy of print request */
 };
+#define JNLHDRSZ		offsetof(struct jnlrec, req)
+
+/*
+ * The jobs one user has waiting for a printer at one priority,
+ * kept in a heap with the smallest job on top.  Flows with jobs
+ * are on a circular list, one per priority, in round-robin order.
+ */
+struct flow {
+	struct flow     *next;		/* next in round-robin order */
+	struct flow     *prev;
+	char             usernm[USERNM_MAX];
+	int              prio;		/* 0 is highest */
+	long long        deficit;	/* bytes it may print now */
+	struct job     **heap;		/* heap[0] is the smallest job */
+	int              njobs;
+	int              maxjobs;	/* size of heap */
+};
+
+/*
+ * Describes a printer and the jobs waiting for it.  Each printer
+ * has its own queue, so one that's down holds up only its own jobs.
+ */
+struct printer {
+	struct printer  *next;		/* next in list */
+	char             name[PRINTERNM_MAX];	/* as in config file */
+	char            *hostname;	/* canonical name, for IPP */
+	struct addrinfo *addr;		/* network address */
+	void            *flows;		/* tsearch tree of flows */
+	struct flow     *turn[NPRIO];	/* whose turn it is, by priority */
+	int              nflows[NPRIO];	/* flows on each list */
+	int              njobs;		/* pending jobs */
+	int              busy;		/* a printer thread is using it */
+	time_t           retry;		/* don't try again before this */
+	int              backoff;	/* seconds to wait after next failure */
+	int              sockfd;	/* kept-alive connection, or -1 */
+	int              keep;		/* printer will keep it open */
+	int              nsent;		/* jobs sent on it */
+	time_t           idle;		/* close it if unused by then */
+	char             rbuf[IOBUFSZ];	/* response data not yet parsed */
+	int              rlen;
+	struct stats     stats;
+};
 
 /*
- * Describes a thread processing a client request.
+ * Describes a thread processing client requests.
  */
 struct worker_thread {
 	struct worker_thread  *next;	/* next in list */
 	struct worker_thread  *prev;	/* previous in list */
 	pthread_t              tid;		/* thread ID */
-	int                    sockfd;	/* socket */
+	int                    sockfd;	/* socket, or -1 if idle */
 };
 
 /*
@@ -46,12 +234,34 @@ struct worker_thread {
 int					log_to_stderr = 0;
 
 /*
- * Printer-related stuff.
+ * Jobs this big (in MB) are written with O_DIRECT; 0 if never.
+ */
+int					directmb;
+
+/*
+ * See IPP_IDLE and IPP_DEPTH.
+ */
+int					ippidle;
+int					ippdepth;
+
+/*
+ * Printer-related stuff.  The list of printers and their
+ * queues are protected by joblock.  There is a printer thread
+ * for each printer, but any of them can serve any printer.
+ */
+struct printer			*printers;	/* the first is the default */
+int					nprinters;
+int					nprthreads;
+
+/*
+ * Counters for the clients; see struct stats.
  */
-struct addrinfo		*printer;
-char					*printer_name;
-pthread_mutex_t		configlock = PTHREAD_MUTEX_INITIALIZER;
-int					reread;
+volatile long			nbusy;		/* client threads with a client */
+volatile long			naccepted;	/* jobs queued */
+volatile long			nrejected;	/* clients turned away */
+volatile long long		nreceived;	/* bytes in jobs queued */
+int					nclthreads;
+int					ctlfd;		/* control socket */
 
 /*
  * Thread-related stuff.
@@ -60,12 +270,50 @@ struct worker_thread	*workers;
 pthread_mutex_t		workerlock = PTHREAD_MUTEX_INITIALIZER;
 sigset_t				mask;
 
+/*
+ * Connections accepted but not yet taken by a client thread.
+ * A circular queue, protected by clientlock.
+ */
+int					*clientq;
+int					clientqlen;		/* size of clientq */
+int					clienthead;		/* next to take */
+int					nclients;		/* number in queue */
+pthread_mutex_t		clientlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t			clientwait = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Clients we've turned away.  Used only by the main thread.
+ */
+int					drainfd[DRAIN_MAX];
+time_t					draintime[DRAIN_MAX];	/* when to give up */
+int					ndrain;
+
+/*
+ * What the main thread waits on.  sparefd is kept open so that
+ * when we run out of descriptors, we can still accept a connection
+ * and close it, rather than have it ready forever.
+ */
+int					listenfd[LISTEN_MAX];
+int					nlisten;
+int					sparefd;
+#if defined(LINUX)
+int					epfd;
+#else
+fd_set					watchset;
+int					watchmax = -1;
+#endif
+
 /*
  * Job-related stuff.
  */
-struct job				*jobhead, *jobtail;
 int					jobfd;
-int32_t				nextjob;
+volatile int32_t		nextjob;	/* taken atomically */
+volatile int32_t		jobleased;	/* end of leased block */
+pthread_mutex_t		leaselock = PTHREAD_MUTEX_INITIALIZER;
+int					jnlfd = -1;	/* journal, opened for append */
+long				jnllive;	/* pending jobs in journal */
+long				jnldead;	/* records for jobs that are done */
+pthread_mutex_t		jnllock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t		joblock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t			jobwait = PTHREAD_COND_INITIALIZER;
 
@@ -74,18 +322,54 @@ pthread_cond_t			jobwait = PTHREAD_COND_INITIALIZER;
  */
 void		init_request(void);
 void		init_printer(void);
-void		update_jobno(void);
+void		lease_jobno(int32_t);
 int32_t	get_newjobno(void);
 void		add_job(struct printreq *, int32_t);
 void		replace_job(struct job *);
-void		remove_job(struct job *);
+struct job	*remove_job(struct printer *);
+int		job_prio(uint32_t);
+int		flow_cmp(const void *, const void *);
+struct flow	*get_flow(struct printer *, struct job *);
+void		put_flow(struct printer *, struct flow *);
+void		flow_push(struct flow *, struct job *);
+struct job	*flow_delete(struct flow *, int);
+struct printer	*find_printer(const char *);
+struct printer	*next_printer(time_t *);
 void		build_qonstart(void);
+int		jobid_cmp(const void *, const void *);
+int		read_journal(struct jnlrec **);
+void		write_journal(struct jnlrec *, int);
+void		journal_job(int32_t, int32_t, struct printreq *);
+int		scan_reqdir(struct jnlrec **);
 void		*client_thread(void *);
+int		client_request(int);
+int		queue_client(int);
+int		get_client(void);
+void		reject_client(int, int);
+void		accept_clients(int);
+void		drain_client(int);
+void		expire_drains(time_t);
+void		init_watch(void);
+void		watch_fd(int);
+void		unwatch_fd(int);
+int		wait_fds(int *, int, int);
 void		*printer_thread(void *);
 void		*signal_thread(void *);
-ssize_t	readmore(int, char **, int, int *);
-int		printer_status(int, struct job *);
-void		add_worker(pthread_t, int);
+int		readmore(struct printer *, int);
+off_t		send_file(int, int, off_t);
+off_t		recv_file(int, int, off_t);
+int		printer_status(struct printer *, struct job *);
+int		send_job(int, struct job *, char *);
+time_t		close_idle(void);
+long long	now_ms(void);
+void		hist_add(volatile long *, long long);
+int		cancel_job(int32_t, const char *);
+void		*ctl_thread(void *);
+void		ctl_request(int, uid_t);
+void		ctl_status(FILE *);
+void		ctl_jobs(FILE *);
+void		ctl_hist(FILE *);
+struct worker_thread	*add_worker(pthread_t);
 void		kill_workers(void);
 void		client_cleanup(void *);
 
@@ -100,9 +384,11 @@ main(int argc, char *argv[])
 {
 	pthread_t			tid;
 	struct addrinfo		*ailist, *aip;
-	int					sockfd, err, i, n, maxfd;
+	int					sockfd, err, i, j, n;
 	char				*host;
-	fd_set				rendezvous, rset;
+	char				name[FILENMSZ];
+	int					ready[READY_MAX];
+	time_t				now, lastexpire;
 	struct sigaction	sa;
 	struct passwd		*pwdp;
 
@@ -133,18 +419,21 @@ main(int argc, char *argv[])
 		log_quit("getaddrinfo error: %s", gai_strerror(err));
 		exit(1);
 	}
-	FD_ZERO(&rendezvous);
-	maxfd = -1;
-	for (aip = ailist; aip != NULL; aip = aip->ai_next) {
+	init_watch();
+	for (aip = ailist; aip != NULL && nlisten < LISTEN_MAX;
+	  aip = aip->ai_next) {
 		if ((sockfd = initserver(SOCK_STREAM, aip->ai_addr,
 		  aip->ai_addrlen, QLEN)) >= 0) {
-			FD_SET(sockfd, &rendezvous);
-			if (sockfd > maxfd)
-				maxfd = sockfd;
+			set_fl(sockfd, O_NONBLOCK);
+			set_cloexec(sockfd);
+			watch_fd(sockfd);
+			listenfd[nlisten++] = sockfd;
 		}
 	}
-	if (maxfd == -1)
+	if (nlisten == 0)
 		log_quit("service not enabled");
+	if ((sparefd = open("/dev/null", O_RDONLY)) < 0)
+		log_sys("can't open /dev/null");
 
 	pwdp = getpwnam(LPNAME);
 	if (pwdp == NULL)
@@ -155,31 +444,62 @@ main(int argc, char *argv[])
 		log_sys("can't change IDs to user %s", LPNAME);
 
 	init_request();
+	ippidle = get_confignum("ippidle", IPP_IDLE);
+	ippdepth = get_confignum("ippdepth", IPP_DEPTH);
+	if (ippdepth < 1)
+		ippdepth = 1;
+	if (ippdepth > IPP_DEPTH_MAX)
+		ippdepth = IPP_DEPTH_MAX;
 	init_printer();
 
-	err = pthread_create(&tid, NULL, printer_thread, NULL);
-	if (err == 0)
-		err = pthread_create(&tid, NULL, signal_thread, NULL);
+	/*
+	 * Start the pool of threads that accept print jobs.  If they're
+	 * all busy, up to clientqlen more connections can wait for
+	 * them; we turn away any beyond that.
+	 */
+	nclthreads = get_confignum("clientthreads", CLIENT_THREADS);
+	clientqlen = get_confignum("clientqueue", CLIENT_QLEN);
+	directmb = get_confignum("directsize", DIRECT_MB);
+	if ((clientq = malloc(clientqlen * sizeof(int))) == NULL)
+		log_sys("malloc error");
+	for (i = 0; i < nclthreads; i++) {
+		if ((err = pthread_create(&tid, NULL, client_thread,
+		  NULL)) != 0)
+			log_exit(err, "can't create thread");
+	}
+
+	err = pthread_create(&tid, NULL, signal_thread, NULL);
 	if (err != 0)
 		log_exit(err, "can't create thread");
 	build_qonstart();
 
+	/*
+	 * Listen for printctl on the control socket.
+	 */
+	sprintf(name, "%s/%s", SPOOLDIR, CTLFILE);
+	if ((ctlfd = serv_listen(name)) < 0)
+		log_sys("can't listen on %s", name);
+	err = pthread_create(&tid, NULL, ctl_thread, NULL);
+	if (err != 0)
+		log_exit(err, "can't create thread");
+
 	log_msg("daemon initialized");
 
+	lastexpire = time(NULL);
 	for (;;) {
-		rset = rendezvous;
-		if (select(maxfd+1, &rset, NULL, NULL, NULL) < 0)
-			log_sys("select failed");
-		for (i = 0; i <= maxfd; i++) {
-			if (FD_ISSET(i, &rset)) {
-				/*
-				 * Accept the connection and handle the request.
-				 */
-				if ((sockfd = accept(i, NULL, NULL)) < 0)
-					log_ret("accept failed");
-				pthread_create(&tid, NULL, client_thread,
-				  (void *)((long)sockfd));
-			}
+		n = wait_fds(ready, READY_MAX, ndrain > 0 ? DRAIN_SECS : -1);
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < nlisten; j++)
+				if (ready[i] == listenfd[j])
+					break;
+			if (j < nlisten)
+				accept_clients(ready[i]);
+			else
+				drain_client(ready[i]);
+		}
+		if ((now = time(NULL)) != lastexpire) {
+			expire_drains(now);
+			lastexpire = now;
 		}
 	}
 	exit(1);
@@ -203,231 +523,1097 @@ init_request(void)
 		log_quit("daemon already running");
 
 	/*
-	 * Reuse the name buffer for the job counter.
+	 * Reuse the name buffer for the job counter.  The file holds
+	 * the end of the last block we leased, and jobs may have used
+	 * any ID before it, so start with a new block.
 	 */
-	if ((n = read(jobfd, name, FILENMSZ)) < 0)
+	if ((n = read(jobfd, name, FILENMSZ-1)) < 0)
 		log_sys("can't read job file");
-	if (n == 0)
+	name[n] = '\0';
+	if (n == 0 || (nextjob = atol(name)) <= 0 ||
+	  nextjob > JOBID_MAX - JOBBLOCK)
 		nextjob = 1;
-	else
-		nextjob = atol(name);
+	lease_jobno(nextjob);
 }
 
 /*
- * Initialize printer information from configuration file.
+ * Initialize printer information from configuration file.  Also
+ * called to re-read the file.  Printers new to the list are added,
+ * and the addresses of the others are looked up again.  Printers
+ * that are no longer in the file are kept until we're restarted,
+ * so their jobs aren't lost.  Then start enough printer threads.
  *
- * LOCKING: none.
+ * LOCKING: acquires and releases joblock.
  */
 void
 init_printer(void)
 {
-	printer = get_printaddr();
-	if (printer == NULL)
-		exit(1);	/* message already logged */
-	printer_name = printer->ai_canonname;
-	if (printer_name == NULL)
-		printer_name = "printer";
-	log_msg("printer is %s", printer_name);
+	int				i, err;
+	char			*name;
+	pthread_t		tid;
+	struct addrinfo	*ai;
+	struct printer	*pp, **ppp;
+
+	for (i = 0; (name = get_printer(i)) != NULL; i++) {
+		if ((ai = get_printaddr(name)) == NULL)
+			continue;	/* message already logged */
+		pthread_mutex_lock(&joblock);
+		for (ppp = &printers; (pp = *ppp) != NULL; ppp = &pp->next)
+			if (strncmp(pp->name, name, PRINTERNM_MAX) == 0)
+				break;
+		if (pp == NULL) {
+			if ((pp = calloc(1, sizeof(struct printer))) == NULL)
+				log_sys("calloc failed");
+			strncpy(pp->name, name, PRINTERNM_MAX-1);
+			pp->backoff = BACKOFF_MIN;
+			pp->sockfd = -1;
+			*ppp = pp;
+			nprinters++;
+		} else {
+			freeaddrinfo(pp->addr);
+			if (!pp->busy && pp->sockfd >= 0) {
+				close(pp->sockfd);	/* the address may change */
+				pp->sockfd = -1;
+			}
+		}
+		pp->addr = ai;
+		pp->hostname = ai->ai_canonname;
+		if (pp->hostname == NULL)
+			pp->hostname = pp->name;
+		pthread_mutex_unlock(&joblock);
+		log_msg("printer %d is %s", i, pp->hostname);
+	}
+	if (printers == NULL)
+		log_quit("no printer address specified");
+
+	pthread_mutex_lock(&joblock);
+	while (nprthreads < nprinters) {
+		if ((err = pthread_create(&tid, NULL, printer_thread, NULL)) != 0)
+			log_exit(err, "can't create thread");
+		nprthreads++;
+	}
+	pthread_mutex_unlock(&joblock);
+}
+
+/*
+ * Find a printer by name.  The empty name means the default.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+struct printer *
+find_printer(const char *name)
+{
+	struct printer	*pp;
+
+	if (name[0] == '\0')
+		return(printers);
+	for (pp = printers; pp != NULL; pp = pp->next)
+		if (strncmp(pp->name, name, PRINTERNM_MAX) == 0)
+			break;
+	return(pp);
 }
 
 /*
- * Update the job ID file with the next job number.
- * Doesn't handle wrap-around of job number.
+ * Lease the block of job IDs starting at start, and make sure
+ * the job ID file says so before any of them are handed out.
+ * The number is written at a fixed width, so a shorter one
+ * doesn't leave digits of the old one behind.
  *
- * LOCKING: none.
+ * LOCKING: caller must hold leaselock, or be the only thread.
  */
 void
-update_jobno(void)
+lease_jobno(int32_t start)
 {
 	char	buf[32];
 
-	if (lseek(jobfd, 0, SEEK_SET) == -1)
-		log_sys("can't seek in job file");
-	sprintf(buf, "%d", nextjob);
-	if (write(jobfd, buf, strlen(buf)) < 0)
+	sprintf(buf, "%10d\n", start + JOBBLOCK);
+	if (pwrite(jobfd, buf, strlen(buf), 0) != strlen(buf))
 		log_sys("can't update job file");
+	if (fsync(jobfd) < 0)
+		log_sys("can't sync job file");
+	jobleased = start + JOBBLOCK;
 }
 
 /*
- * Get the next job number.
+ * Get the next job number.  Usually it's just an atomic
+ * increment; only the thread that runs off the end of the
+ * leased block takes leaselock and leases another one.
  *
- * LOCKING: acquires and releases joblock.
+ * LOCKING: may acquire and release leaselock.
  */
 int32_t
 get_newjobno(void)
 {
 	int32_t	jobid;
 
-	pthread_mutex_lock(&joblock);
-	jobid = nextjob++;
-	if (nextjob <= 0)
-		nextjob = 1;
-	pthread_mutex_unlock(&joblock);
-	return(jobid);
+	for (;;) {
+		jobid = __sync_fetch_and_add(&nextjob, 1);
+		if (jobid < jobleased)
+			return(jobid);
+		pthread_mutex_lock(&leaselock);
+		if (nextjob >= jobleased) {
+			if (jobleased > JOBID_MAX - JOBBLOCK) {
+				lease_jobno(1);
+				nextjob = 1;
+			} else {
+				lease_jobno(nextjob);
+			}
+		}
+		pthread_mutex_unlock(&leaselock);
+	}
+}
+
+/*
+ * Map the request flags to a priority, 0 being the highest.
+ *
+ * LOCKING: none.
+ */
+int
+job_prio(uint32_t flags)
+{
+	if (flags & PR_HIGH)
+		return(0);
+	if (flags & PR_LOW)
+		return(2);
+	return(1);
+}
+
+/*
+ * Compare two flows, for tsearch.
+ *
+ * LOCKING: none.
+ */
+int
+flow_cmp(const void *a, const void *b)
+{
+	const struct flow	*fa = a, *fb = b;
+
+	if (fa->prio != fb->prio)
+		return(fa->prio - fb->prio);
+	return(strcmp(fa->usernm, fb->usernm));
+}
+
+/*
+ * Find the flow a job belongs to.  If the user has no other jobs
+ * waiting at that priority, create one and put it last in the
+ * round-robin order.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+struct flow *
+get_flow(struct printer *pp, struct job *jp)
+{
+	struct flow	key, *fp, *tp;
+	void		*node;
+
+	strcpy(key.usernm, jp->req.usernm);
+	key.prio = job_prio(jp->req.flags);
+	if ((node = tfind(&key, &pp->flows, flow_cmp)) != NULL)
+		return(*(struct flow **)node);
+	if ((fp = calloc(1, sizeof(struct flow))) == NULL)
+		log_sys("calloc failed");
+	strcpy(fp->usernm, key.usernm);
+	fp->prio = key.prio;
+	if (tsearch(fp, &pp->flows, flow_cmp) == NULL)
+		log_sys("tsearch failed");
+	if ((tp = pp->turn[fp->prio]) == NULL) {
+		fp->next = fp->prev = fp;
+		fp->deficit = QUANTUM;
+		pp->turn[fp->prio] = fp;
+	} else {
+		fp->next = tp;
+		fp->prev = tp->prev;
+		tp->prev->next = fp;
+		tp->prev = fp;
+	}
+	pp->nflows[fp->prio]++;
+	return(fp);
+}
+
+/*
+ * Take a flow that has run out of jobs off the round-robin list,
+ * and free it.  The next flow on the list gets its turn.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+void
+put_flow(struct printer *pp, struct flow *fp)
+{
+	if (fp->next == fp) {
+		pp->turn[fp->prio] = NULL;
+	} else {
+		fp->next->prev = fp->prev;
+		fp->prev->next = fp->next;
+		if (pp->turn[fp->prio] == fp) {
+			pp->turn[fp->prio] = fp->next;
+			fp->next->deficit += QUANTUM;
+		}
+	}
+	pp->nflows[fp->prio]--;
+	tdelete(fp, &pp->flows, flow_cmp);
+	free(fp->heap);
+	free(fp);
+}
+
+#define JOB_BEFORE(a, b)	((a)->req.size < (b)->req.size || \
+  ((a)->req.size == (b)->req.size && (a)->jobid < (b)->jobid))
+
+/*
+ * Add a job to a flow's heap.  Smaller jobs come first, and
+ * jobs of the same size in the order they were submitted.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+void
+flow_push(struct flow *fp, struct job *jp)
+{
+	int			i, parent;
+	struct job	**heap;
+
+	if (fp->njobs == fp->maxjobs) {
+		fp->maxjobs = fp->maxjobs == 0 ? 8 : fp->maxjobs * 2;
+		heap = realloc(fp->heap, fp->maxjobs * sizeof(struct job *));
+		if (heap == NULL)
+			log_sys("realloc failed");
+		fp->heap = heap;
+	}
+	for (i = fp->njobs++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!JOB_BEFORE(jp, fp->heap[parent]))
+			break;
+		fp->heap[i] = fp->heap[parent];
+	}
+	fp->heap[i] = jp;
+}
+
+/*
+ * Remove the job at index i from a flow's heap; index 0 is the
+ * smallest job.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+struct job *
+flow_delete(struct flow *fp, int i)
+{
+	int			child, parent;
+	struct job	*jp, *last;
+
+	jp = fp->heap[i];
+	last = fp->heap[--fp->njobs];
+	for (; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!JOB_BEFORE(last, fp->heap[parent]))
+			break;
+		fp->heap[i] = fp->heap[parent];
+	}
+	for (; (child = 2 * i + 1) < fp->njobs; i = child) {
+		if (child + 1 < fp->njobs &&
+		  JOB_BEFORE(fp->heap[child+1], fp->heap[child]))
+			child++;
+		if (!JOB_BEFORE(fp->heap[child], last))
+			break;
+		fp->heap[i] = fp->heap[child];
+	}
+	fp->heap[i] = last;
+	return(jp);
 }
 
 /*
- * Add a new job to the list of pending jobs.  Then signal
- * the printer thread that a job is pending.
+ * Add a new job to the list of pending jobs for its printer.
+ * A job for a printer we don't know about goes to the default
+ * printer.  A user with no other jobs waiting at this priority
+ * goes last in the round-robin order.  Then signal the printer
+ * threads that a job is pending.
  *
  * LOCKING: acquires and releases joblock.
  */
 void
 add_job(struct printreq *reqp, int32_t jobid)
 {
-	struct job	*jp;
+	struct job		*jp;
+	struct printer	*pp;
+	struct flow		*fp;
 
 	if ((jp = malloc(sizeof(struct job))) == NULL)
 		log_sys("malloc failed");
 	memcpy(&jp->req, reqp, sizeof(struct printreq));
+	jp->req.usernm[USERNM_MAX-1] = '\0';
 	jp->jobid = jobid;
-	jp->next = NULL;
+	jp->queued = now_ms();
 	pthread_mutex_lock(&joblock);
-	jp->prev = jobtail;
-	if (jobtail == NULL)
-		jobhead = jp;
-	else
-		jobtail->next = jp;
-	jobtail = jp;
+	if ((pp = find_printer(jp->req.prname)) == NULL)
+		pp = printers;
+	jp->printer = pp;
+	fp = get_flow(pp, jp);
+	flow_push(fp, jp);
+	pp->njobs++;
 	pthread_mutex_unlock(&joblock);
 	pthread_cond_signal(&jobwait);
 }
 
 /*
- * Replace a job back on the head of the list.
+ * Put back a job we couldn't print.  The user gets back what the
+ * job was charged, and the turn, so it's the next job chosen.
  *
- * LOCKING: acquires and releases joblock.
+ * LOCKING: caller must hold joblock.
  */
 void
 replace_job(struct job *jp)
 {
-	pthread_mutex_lock(&joblock);
-	jp->prev = NULL;
-	jp->next = jobhead;
-	if (jobhead == NULL)
-		jobtail = jp;
-	else
-		jobhead->prev = jp;
-	jobhead = jp;
-	pthread_mutex_unlock(&joblock);
+	struct printer	*pp = jp->printer;
+	struct flow		*fp;
+
+	fp = get_flow(pp, jp);
+	flow_push(fp, jp);
+	pp->turn[fp->prio] = fp;
+	fp->deficit += JOB_COST(jp);
+	pp->njobs++;
 }
 
 /*
- * Remove a job from the list of pending jobs.
+ * Choose the next job for a printer and remove it from the queue.
+ * It comes from the highest priority with jobs waiting.  Within
+ * that, users take turns; a user keeps the turn until the next
+ * smallest job costs more than it has left.  If nobody can afford
+ * a job after a full round, skip ahead the rounds it would take.
+ * The printer must have jobs waiting.
  *
  * LOCKING: caller must hold joblock.
  */
-void
-remove_job(struct job *target)
+struct job *
+remove_job(struct printer *pp)
 {
-	if (target->next != NULL)
-		target->next->prev = target->prev;
-	else
-		jobtail = target->prev;
-	if (target->prev != NULL)
-		target->prev->next = target->next;
-	else
-		jobhead = target->next;
+	int				prio, visits;
+	long long		need, rounds;
+	struct flow		*fp, *tp;
+	struct job		*jp;
+
+	for (prio = 0; pp->turn[prio] == NULL; prio++)
+		;
+	fp = pp->turn[prio];
+	for (visits = 0; JOB_COST(fp->heap[0]) > fp->deficit; visits++) {
+		if (visits == pp->nflows[prio]) {
+			rounds = 0;
+			tp = fp;
+			do {
+				need = (JOB_COST(tp->heap[0]) - tp->deficit +
+				  QUANTUM - 1) / QUANTUM;
+				if (rounds == 0 || need < rounds)
+					rounds = need;
+				tp = tp->next;
+			} while (tp != fp);
+			do {
+				tp->deficit += (rounds - 1) * QUANTUM;
+				tp = tp->next;
+			} while (tp != fp);
+			visits = 0;
+		}
+		fp = fp->next;
+		fp->deficit += QUANTUM;
+	}
+	pp->turn[prio] = fp;
+	jp = flow_delete(fp, 0);
+	fp->deficit -= JOB_COST(jp);
+	if (fp->njobs == 0)
+		put_flow(pp, fp);
+	pp->njobs--;
+	return(jp);
 }
 
 /*
- * Check the spool directory for pending jobs on start-up.
+ * Return a printer that has jobs waiting, isn't being used by
+ * another printer thread, and isn't backing off after a failure.
+ * If there's none, set *waitp to the time the first printer that
+ * is backing off can be tried again, or 0 if there's no such printer.
  *
- * LOCKING: none.
+ * LOCKING: caller must hold joblock.
  */
-void
-build_qonstart(void)
+struct printer *
+next_printer(time_t *waitp)
 {
-	int				fd, err, nr;
-	int32_t			jobid;
-	DIR				*dirp;
-	struct dirent	*entp;
-	struct printreq	req;
-	char			dname[FILENMSZ], fname[FILENMSZ];
-
-	sprintf(dname, "%s/%s", SPOOLDIR, REQDIR);
-	if ((dirp = opendir(dname)) == NULL)
-		return;
-	while ((entp = readdir(dirp)) != NULL) {
-		/*
-		 * Skip "." and ".."
-		 */
-		if (strcmp(entp->d_name, ".") == 0 ||
-		  strcmp(entp->d_name, "..") == 0)
-			continue;
+	struct printer	*pp;
+	time_t			now;
 
-		/*
-		 * Read the request structure.
-		 */
-		sprintf(fname, "%s/%s/%s", SPOOLDIR, REQDIR, entp->d_name);
-		if ((fd = open(fname, O_RDONLY)) < 0)
-			continue;
-		nr = read(fd, &req, sizeof(struct printreq));
-		if (nr != sizeof(struct printreq)) {
-			if (nr < 0)
-				err = errno;
-			else
-				err = EIO;
-			close(fd);
-			log_msg("build_qonstart: can't read %s: %s",
-			  fname, strerror(err));
-			unlink(fname);
-			sprintf(fname, "%s/%s/%s", SPOOLDIR, DATADIR,
-			  entp->d_name);
-			unlink(fname);
+	now = time(NULL);
+	*waitp = 0;
+	for (pp = printers; pp != NULL; pp = pp->next) {
+		if (pp->busy || pp->njobs == 0)
 			continue;
-		}
-		jobid = atol(entp->d_name);
-		log_msg("adding job %d to queue", jobid);
-		add_job(&req, jobid);
+		if (pp->retry <= now)
+			return(pp);
+		if (*waitp == 0 || pp->retry < *waitp)
+			*waitp = pp->retry;
 	}
-	closedir(dirp);
+	return(NULL);
 }
 
 /*
- * Accept a print job from a client.
+ * Compare two job IDs, for qsort and bsearch.
  *
  * LOCKING: none.
  */
-void *
-client_thread(void *arg)
+int
+jobid_cmp(const void *a, const void *b)
 {
-	int					n, fd, sockfd, nr, nw, first;
-	int32_t				jobid;
-	pthread_t			tid;
-	struct printreq		req;
-	struct printresp	res;
-	char				name[FILENMSZ];
-	char				buf[IOBUFSZ];
+	int32_t	ja = *(const int32_t *)a, jb = *(const int32_t *)b;
+
+	return(ja < jb ? -1 : ja > jb);
+}
+
+/*
+ * Read the journal and return the jobs that were added but never
+ * finished, in the order they were added, in a malloc'ed array.
+ * Returns the number of jobs, or -1 with errno set if there's no
+ * journal.  A record cut short by a crash ends the journal.
+ *
+ * LOCKING: caller must hold jnllock, or be the only thread.
+ */
+int
+read_journal(struct jnlrec **recsp)
+{
+	int				fd, n, ndone, nlive;
+	size_t			off;
+	char			*buf;
+	struct stat		sbuf;
+	struct jnlrec	*recs, *rp;
+	int32_t			*done;
+	char			name[FILENMSZ];
 
-	tid = pthread_self();
-	pthread_cleanup_push(client_cleanup, (void *)((long)tid));
-	sockfd = (long)arg;
-	add_worker(tid, sockfd);
+	sprintf(name, "%s/%s", SPOOLDIR, JNLFILE);
+	if ((fd = open(name, O_RDONLY)) < 0)
+		return(-1);
+	if (fstat(fd, &sbuf) < 0)
+		log_sys("can't fstat %s", name);
+	if ((buf = malloc(sbuf.st_size + 1)) == NULL)
+		log_sys("malloc failed");
+	if ((n = readn(fd, buf, sbuf.st_size)) < 0)
+		log_sys("can't read %s", name);
+	close(fd);
 
 	/*
-	 * Read the request header.
+	 * First pass: count the records and collect the
+	 * IDs of the jobs that finished.
 	 */
-	if ((n = treadn(sockfd, &req, sizeof(struct printreq), 10)) !=
-	  sizeof(struct printreq)) {
-		res.jobid = 0;
-		if (n < 0)
-			res.retcode = htonl(errno);
-		else
-			res.retcode = htonl(EIO);
-		strncpy(res.msg, strerror(res.retcode), MSGLEN_MAX);
-		writen(sockfd, &res, sizeof(struct printresp));
-		pthread_exit((void *)1);
+	if ((done = malloc((n / JNLHDRSZ + 1) * sizeof(int32_t))) == NULL)
+		log_sys("malloc failed");
+	ndone = nlive = 0;
+	for (off = 0; off + JNLHDRSZ <= n; off += JNLHDRSZ) {
+		rp = (struct jnlrec *)(buf + off);
+		if (rp->type == JNL_ADD) {
+			if (off + sizeof(struct jnlrec) > n)
+				break;
+			off += sizeof(struct printreq);
+			nlive++;
+		} else if (rp->type == JNL_DONE) {
+			done[ndone++] = rp->jobid;
+		} else {
+			break;
+		}
+	}
+	if (off != n)
+		log_msg("read_journal: %s ends early at %ld of %d bytes", name,
+		  (long)off, n);
+	n = off;
+	qsort(done, ndone, sizeof(int32_t), jobid_cmp);
+
+	/*
+	 * Second pass: keep the jobs that didn't finish.
+	 */
+	if ((recs = malloc((nlive + 1) * sizeof(struct jnlrec))) == NULL)
+		log_sys("malloc failed");
+	nlive = 0;
+	for (off = 0; off < n; off += JNLHDRSZ) {
+		rp = (struct jnlrec *)(buf + off);
+		if (rp->type != JNL_ADD)
+			continue;
+		off += sizeof(struct printreq);
+		if (bsearch(&rp->jobid, done, ndone, sizeof(int32_t),
+		  jobid_cmp) == NULL)
+			memcpy(&recs[nlive++], rp, sizeof(struct jnlrec));
+	}
+	free(done);
+	free(buf);
+	*recsp = recs;
+	return(nlive);
+}
+
+/*
+ * Replace the journal with one that holds just the given jobs.
+ * The new one is written under a temporary name and renamed,
+ * so a crash leaves either the old journal or the new one.
+ * If we can't write it, remove the journal instead; we'll scan
+ * the spool directory on the next start-up.
+ *
+ * LOCKING: caller must hold jnllock, or be the only thread.
+ */
+void
+write_journal(struct jnlrec *recs, int n)
+{
+	int		fd;
+	size_t	len;
+	char	name[FILENMSZ], tname[FILENMSZ];
+
+	sprintf(name, "%s/%s", SPOOLDIR, JNLFILE);
+	sprintf(tname, "%s/%s.tmp", SPOOLDIR, JNLFILE);
+	if (jnlfd >= 0) {
+		close(jnlfd);
+		jnlfd = -1;
+	}
+	len = n * sizeof(struct jnlrec);
+	if ((fd = open(tname, O_WRONLY|O_CREAT|O_TRUNC, FILEPERM)) < 0 ||
+	  writen(fd, recs, len) != len || fsync(fd) < 0 ||
+	  rename(tname, name) < 0) {
+		log_ret("can't write %s", tname);
+		if (fd >= 0)
+			close(fd);
+		unlink(tname);
+		unlink(name);
+		return;
+	}
+	close(fd);
+	if ((jnlfd = open(name, O_WRONLY|O_APPEND)) < 0) {
+		log_ret("can't open %s", name);
+		unlink(name);
+		return;
+	}
+	jnllive = n;
+	jnldead = 0;
+}
+
+/*
+ * Add a record to the journal: JNL_ADD when a job is queued, and
+ * JNL_DONE when it's printed or canceled.  Appends aren't synced;
+ * the spool files they describe aren't either.  Once most of the
+ * journal describes finished jobs, rewrite it.
+ *
+ * LOCKING: acquires and releases jnllock.
+ */
+void
+journal_job(int32_t type, int32_t jobid, struct printreq *reqp)
+{
+	int				n;
+	size_t			len;
+	struct jnlrec	rec, *recs;
+	char			name[FILENMSZ];
+
+	rec.type = type;
+	rec.jobid = jobid;
+	len = JNLHDRSZ;
+	if (type == JNL_ADD) {
+		memcpy(&rec.req, reqp, sizeof(struct printreq));
+		len = sizeof(struct jnlrec);
+	}
+	pthread_mutex_lock(&jnllock);
+	if (jnlfd < 0) {
+		pthread_mutex_unlock(&jnllock);
+		return;
+	}
+	if (write(jnlfd, &rec, len) != len) {
+		log_ret("can't append to journal; removing it");
+		sprintf(name, "%s/%s", SPOOLDIR, JNLFILE);
+		unlink(name);
+		close(jnlfd);
+		jnlfd = -1;
+		pthread_mutex_unlock(&jnllock);
+		return;
+	}
+	if (type == JNL_ADD) {
+		jnllive++;
+	} else {
+		jnllive--;
+		jnldead += 2;
+	}
+	if (jnldead >= JNL_COMPACT && jnldead > jnllive) {
+		if ((n = read_journal(&recs)) < 0) {
+			log_ret("can't read journal");
+		} else {
+			write_journal(recs, n);
+			free(recs);
+		}
+	}
+	pthread_mutex_unlock(&jnllock);
+}
+
+/*
+ * Without a journal, find the pending jobs by reading each
+ * control file in the spool directory.  Returns them in a
+ * malloc'ed array in job ID order, which is the order they were
+ * submitted unless the IDs wrapped around.
+ *
+ * LOCKING: none.
+ */
+int
+scan_reqdir(struct jnlrec **recsp)
+{
+	int				fd, err, nr, n, maxrecs;
+	DIR				*dirp;
+	struct dirent	*entp;
+	struct jnlrec	*recs;
+	char			dname[FILENMSZ], fname[FILENMSZ];
+
+	n = 0;
+	maxrecs = 64;
+	if ((recs = malloc(maxrecs * sizeof(struct jnlrec))) == NULL)
+		log_sys("malloc failed");
+	*recsp = recs;
+	sprintf(dname, "%s/%s", SPOOLDIR, REQDIR);
+	if ((dirp = opendir(dname)) == NULL)
+		return(0);
+	while ((entp = readdir(dirp)) != NULL) {
+		/*
+		 * Skip "." and ".."
+		 */
+		if (strcmp(entp->d_name, ".") == 0 ||
+		  strcmp(entp->d_name, "..") == 0)
+			continue;
+
+		/*
+		 * Read the request structure.
+		 */
+		if (n == maxrecs) {
+			maxrecs *= 2;
+			recs = realloc(recs, maxrecs * sizeof(struct jnlrec));
+			if (recs == NULL)
+				log_sys("realloc failed");
+		}
+		sprintf(fname, "%s/%s/%s", SPOOLDIR, REQDIR, entp->d_name);
+		if ((fd = open(fname, O_RDONLY)) < 0)
+			continue;
+		nr = read(fd, &recs[n].req, sizeof(struct printreq));
+		if (nr != sizeof(struct printreq)) {
+			if (nr < 0)
+				err = errno;
+			else
+				err = EIO;
+			close(fd);
+			log_msg("scan_reqdir: can't read %s: %s",
+			  fname, strerror(err));
+			unlink(fname);
+			sprintf(fname, "%s/%s/%s", SPOOLDIR, DATADIR,
+			  entp->d_name);
+			unlink(fname);
+			continue;
+		}
+		close(fd);
+		recs[n].type = JNL_ADD;
+		recs[n].jobid = atol(entp->d_name);
+		n++;
+	}
+	closedir(dirp);
+	qsort(recs, n, sizeof(struct jnlrec), jobid_cmp);
+	*recsp = recs;
+	return(n);
+}
+
+/*
+ * Rebuild the queue on start-up.  Normally we replay the journal;
+ * if there isn't one, we scan the spool directory.  Either way we
+ * start a new journal holding just the pending jobs.
+ *
+ * LOCKING: none; no client requests are taken until we're done.
+ */
+void
+build_qonstart(void)
+{
+	int				i, n;
+	int32_t			maxjob;
+	struct jnlrec	*recs;
+
+	if ((n = read_journal(&recs)) < 0) {
+		if (errno != ENOENT)
+			log_ret("can't open journal");
+		log_msg("build_qonstart: no journal, scanning %s/%s",
+		  SPOOLDIR, REQDIR);
+		n = scan_reqdir(&recs);
+	}
+	maxjob = 0;
+	for (i = 0; i < n; i++) {
+		log_msg("adding job %d to queue", recs[i].jobid);
+		add_job(&recs[i].req, recs[i].jobid);
+		if (recs[i].jobid > maxjob &&
+		  recs[i].jobid < JOBID_MAX - JOBBLOCK)
+			maxjob = recs[i].jobid;
+	}
+
+	/*
+	 * A job ID file written before IDs were leased
+	 * can be behind the jobs in the spool directory.
+	 */
+	if (maxjob >= nextjob) {
+		nextjob = maxjob + 1;
+		lease_jobno(nextjob);
+	}
+	write_journal(recs, n);
+	free(recs);
+}
+
+/*
+ * Add a connection to the queue for the client threads.
+ * Returns -1 if the queue is full.
+ *
+ * LOCKING: acquires and releases clientlock.
+ */
+int
+queue_client(int sockfd)
+{
+	pthread_mutex_lock(&clientlock);
+	if (nclients == clientqlen) {
+		pthread_mutex_unlock(&clientlock);
+		return(-1);
+	}
+	clientq[(clienthead + nclients) % clientqlen] = sockfd;
+	nclients++;
+	pthread_mutex_unlock(&clientlock);
+	pthread_cond_signal(&clientwait);
+	return(0);
+}
+
+/*
+ * Wait for a connection to be queued, and remove it.
+ *
+ * LOCKING: acquires and releases clientlock.
+ */
+int
+get_client(void)
+{
+	int		sockfd;
+
+	pthread_mutex_lock(&clientlock);
+	pthread_cleanup_push((void (*)(void *))pthread_mutex_unlock,
+	  &clientlock);
+	while (nclients == 0)
+		pthread_cond_wait(&clientwait, &clientlock);
+	sockfd = clientq[clienthead];
+	clienthead = (clienthead + 1) % clientqlen;
+	nclients--;
+	pthread_cleanup_pop(1);
+	return(sockfd);
+}
+
+/*
+ * Turn a client away without reading its request.  Called
+ * only by the main thread.
+ *
+ * LOCKING: none.
+ */
+void
+reject_client(int sockfd, int err)
+{
+	struct printresp	res;
+
+	STAT_ADD(nrejected, 1);
+	res.jobid = 0;
+	res.retcode = htonl(err);
+	strncpy(res.msg, strerror(err), MSGLEN_MAX);
+	writen(sockfd, &res, sizeof(struct printresp));
+	if (ndrain == DRAIN_MAX || !CAN_WATCH(sockfd) ||
+	  shutdown(sockfd, SHUT_WR) < 0) {
+		close(sockfd);		/* best we can do */
+		return;
+	}
+	set_fl(sockfd, O_NONBLOCK);
+	watch_fd(sockfd);
+	drainfd[ndrain] = sockfd;
+	draintime[ndrain] = time(NULL) + DRAIN_SECS;
+	ndrain++;
+}
+
+/*
+ * Accept the connections waiting on a listening socket, up to
+ * ACCEPT_MAX of them, and queue them for the client threads.
+ * Called only by the main thread.
+ *
+ * LOCKING: none.
+ */
+void
+accept_clients(int lfd)
+{
+	int		i, sockfd;
+
+	for (i = 0; i < ACCEPT_MAX; i++) {
+#if defined(LINUX)
+		sockfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+#else
+		if ((sockfd = accept(lfd, NULL, NULL)) >= 0) {
+			clr_fl(sockfd, O_NONBLOCK);	/* inherited on BSD */
+			set_cloexec(sockfd);
+		}
+#endif
+		if (sockfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if ((errno == EMFILE || errno == ENFILE) &&
+			  sparefd >= 0) {
+				/*
+				 * Out of descriptors.  Take the connection
+				 * with the spare and drop it, so the listening
+				 * socket isn't left ready.
+				 */
+				close(sparefd);
+				if ((sockfd = accept(lfd, NULL, NULL)) >= 0)
+					close(sockfd);
+				STAT_ADD(nrejected, 1);
+				sparefd = open("/dev/null", O_RDONLY);
+				log_msg("out of descriptors; connection dropped");
+				return;
+			}
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_ret("accept failed");
+			return;
+		}
+		if (sparefd < 0)
+			sparefd = open("/dev/null", O_RDONLY);
+		if (queue_client(sockfd) < 0)
+			reject_client(sockfd, EBUSY);
+	}
+}
+
+/*
+ * Read and throw away whatever a client we've turned away has
+ * sent.  Its socket is closed when the client closes its end.
+ * Called only by the main thread.
+ *
+ * LOCKING: none.
+ */
+void
+drain_client(int fd)
+{
+	int		i, n;
+	char	buf[IOBUFSZ];
+
+	for (i = 0; i < ndrain; i++)
+		if (drainfd[i] == fd)
+			break;
+	if (i == ndrain)
+		return;
+	while ((n = read(fd, buf, IOBUFSZ)) > 0)
+		;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	unwatch_fd(fd);
+	close(fd);
+	drainfd[i] = drainfd[--ndrain];
+	draintime[i] = draintime[ndrain];
+}
+
+/*
+ * Close the sockets of clients we've turned away that we've
+ * waited long enough for.  Called only by the main thread.
+ *
+ * LOCKING: none.
+ */
+void
+expire_drains(time_t now)
+{
+	int		i;
+
+	for (i = 0; i < ndrain; ) {
+		if (now < draintime[i]) {
+			i++;
+			continue;
+		}
+		unwatch_fd(drainfd[i]);
+		close(drainfd[i]);
+		drainfd[i] = drainfd[--ndrain];
+		draintime[i] = draintime[ndrain];
+	}
+}
+
+#if defined(LINUX)
+
+/*
+ * Set up to wait for descriptors.
+ *
+ * LOCKING: none.
+ */
+void
+init_watch(void)
+{
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		log_sys("epoll_create1 failed");
+}
+
+/*
+ * Have wait_fds watch a descriptor for input.
+ *
+ * LOCKING: none.
+ */
+void
+watch_fd(int fd)
+{
+	struct epoll_event	ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		log_sys("epoll_ctl failed");
+}
+
+/*
+ * Stop watching a descriptor.
+ *
+ * LOCKING: none.
+ */
+void
+unwatch_fd(int fd)
+{
+	struct epoll_event	ev;		/* for kernels before 2.6.9 */
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/*
+ * Wait up to secs seconds, or forever if secs is negative, for
+ * input on the descriptors we're watching.  Fills in fds with
+ * up to nfds of those that are ready, and returns how many.
+ *
+ * LOCKING: none.
+ */
+int
+wait_fds(int *fds, int nfds, int secs)
+{
+	int					i, n;
+	struct epoll_event	evs[READY_MAX];
+
+	if (nfds > READY_MAX)
+		nfds = READY_MAX;
+	if ((n = epoll_wait(epfd, evs, nfds, secs < 0 ? -1 : secs * 1000)) < 0) {
+		if (errno == EINTR)
+			return(0);
+		log_sys("epoll_wait failed");
+	}
+	for (i = 0; i < n; i++)
+		fds[i] = evs[i].data.fd;
+	return(n);
+}
+
+#else
+
+/*
+ * The same, with select.
+ */
+void
+init_watch(void)
+{
+	FD_ZERO(&watchset);
+}
+
+void
+watch_fd(int fd)
+{
+	FD_SET(fd, &watchset);
+	if (fd > watchmax)
+		watchmax = fd;
+}
+
+void
+unwatch_fd(int fd)
+{
+	FD_CLR(fd, &watchset);
+}
+
+int
+wait_fds(int *fds, int nfds, int secs)
+{
+	int				fd, n;
+	fd_set			rset;
+	struct timeval	tv;
+
+	rset = watchset;
+	tv.tv_sec = secs;
+	tv.tv_usec = 0;
+	if (select(watchmax + 1, &rset, NULL, NULL, secs < 0 ? NULL : &tv) < 0) {
+		if (errno == EINTR)
+			return(0);
+		log_sys("select failed");
+	}
+	n = 0;
+	for (fd = 0; fd <= watchmax && n < nfds; fd++)
+		if (FD_ISSET(fd, &rset))
+			fds[n++] = fd;
+	return(n);
+}
+
+#endif
+
+/*
+ * One of the pool of threads that accept print jobs.
+ *
+ * LOCKING: none.
+ */
+void *
+client_thread(void *arg)
+{
+	struct worker_thread	*wtp;
+	int						sockfd;
+
+	wtp = add_worker(pthread_self());
+	pthread_cleanup_push(client_cleanup, wtp);
+	for (;;) {
+		sockfd = get_client();
+		wtp->sockfd = sockfd;
+		STAT_ADD(nbusy, 1);
+		client_request(sockfd);
+		STAT_ADD(nbusy, -1);
+		wtp->sockfd = -1;
+		close(sockfd);
+	}
+	pthread_cleanup_pop(1);
+	return((void *)0);
+}
+
+/*
+ * Accept a print job from a client.  Returns 0 if the job
+ * was queued, -1 otherwise.
+ *
+ * LOCKING: none.
+ */
+int
+client_request(int sockfd)
+{
+	int					n, fd, nw, oflag;
+	int32_t				jobid;
+	struct printer		*pp;
+	struct printreq		req;
+	struct printresp	res;
+	struct timeval		tv;
+	char				name[FILENMSZ];
+	char				buf[4];
+
+	/*
+	 * Read the request header.
+	 */
+	if ((n = treadn(sockfd, &req, sizeof(struct printreq), 10)) !=
+	  sizeof(struct printreq)) {
+		res.jobid = 0;
+		if (n < 0)
+			res.retcode = htonl(errno);
+		else
+			res.retcode = htonl(EIO);
+		strncpy(res.msg, strerror(res.retcode), MSGLEN_MAX);
+		writen(sockfd, &res, sizeof(struct printresp));
+		return(-1);
 	}
 	req.size = ntohl(req.size);
 	req.flags = ntohl(req.flags);
+	req.prname[PRINTERNM_MAX-1] = '\0';
 
 	/*
 	 * Create the data file.
 	 */
 	jobid = get_newjobno();
 	sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jobid);
-	fd = creat(name, FILEPERM);
+	oflag = O_WRONLY|O_CREAT|O_TRUNC;
+#if defined(O_DIRECT)
+	if (directmb > 0 && req.size / (1024*1024) >= directmb)
+		oflag |= O_DIRECT;
+	if ((fd = open(name, oflag, FILEPERM)) < 0 && errno == EINVAL)
+		fd = open(name, oflag & ~O_DIRECT, FILEPERM);
+#else
+	fd = open(name, oflag, FILEPERM);
+#endif
 	if (fd < 0) {
 		res.jobid = 0;
 		res.retcode = htonl(errno);
@@ -435,39 +1621,66 @@ client_thread(void *arg)
 		  strerror(res.retcode));
 		strncpy(res.msg, strerror(res.retcode), MSGLEN_MAX);
 		writen(sockfd, &res, sizeof(struct printresp));
-		pthread_exit((void *)1);
+		return(-1);
 	}
 
 	/*
-	 * Read the file and store it in the spool directory.
 	 * Try to figure out if the file is a PostScript file
-	 * or a plain text file.
+	 * or a plain text file.  Peek, so the data stays in the
+	 * socket to be copied with the rest.  Give up on a client
+	 * that stops sending for 20 seconds.
 	 */
-	first = 1;
-	while ((nr = tread(sockfd, buf, IOBUFSZ, 20)) > 0) {
-		if (first) {
-			first = 0;
-			if (strncmp(buf, "%!PS", 4) != 0)
-				req.flags |= PR_TEXT;
-		}
-		nw = write(fd, buf, nr);
-		if (nw != nr) {
-			res.jobid = 0;
-			if (nw < 0)
-				res.retcode = htonl(errno);
-			else
-				res.retcode = htonl(EIO);
-			log_msg("client_thread: can't write %s: %s", name,
-			  strerror(res.retcode));
-			close(fd);
-			strncpy(res.msg, strerror(res.retcode), MSGLEN_MAX);
-			writen(sockfd, &res, sizeof(struct printresp));
-			unlink(name);
-			pthread_exit((void *)1);
-		}
+	tv.tv_sec = 20;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (req.size > 0) {
+		n = recv(sockfd, buf, req.size < 4 ? req.size : 4,
+		  MSG_PEEK|MSG_WAITALL);
+		if (n > 0 && (n < 4 || strncmp(buf, "%!PS", 4) != 0))
+			req.flags |= PR_TEXT;
+	}
+
+	/*
+	 * Read exactly the number of bytes the client said it would
+	 * send; it may not close its end until we answer.  Reserve
+	 * the space first, so a big file isn't fragmented.
+	 */
+#if defined(LINUX)
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, req.size);
+#endif
+	if (recv_file(fd, sockfd, req.size) != req.size) {
+		res.jobid = 0;
+		if (errno != 0)
+			res.retcode = htonl(errno);
+		else
+			res.retcode = htonl(EIO);
+		log_msg("client_thread: can't receive %s: %s", name,
+		  strerror(ntohl(res.retcode)));
+		close(fd);
+		strncpy(res.msg, strerror(ntohl(res.retcode)), MSGLEN_MAX);
+		writen(sockfd, &res, sizeof(struct printresp));
+		unlink(name);
+		return(-1);
 	}
 	close(fd);
 
+	/*
+	 * Make sure we know where to send it.  The client doesn't
+	 * read our response until it has sent the whole file, so
+	 * we can't tell it any sooner.
+	 */
+	pthread_mutex_lock(&joblock);
+	pp = find_printer(req.prname);
+	pthread_mutex_unlock(&joblock);
+	if (pp == NULL) {
+		res.jobid = 0;
+		res.retcode = htonl(ENOENT);
+		sprintf(res.msg, "unknown printer %s", req.prname);
+		writen(sockfd, &res, sizeof(struct printresp));
+		unlink(name);
+		return(-1);
+	}
+
 	/*
 	 * Create the control file.  Then write the
 	 * print request information to the control
@@ -484,7 +1697,7 @@ client_thread(void *arg)
 		writen(sockfd, &res, sizeof(struct printresp));
 		sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jobid);
 		unlink(name);
-		pthread_exit((void *)1);
+		return(-1);
 	}
 	nw = write(fd, &req, sizeof(struct printreq));
 	if (nw != sizeof(struct printreq)) {
@@ -501,9 +1714,10 @@ client_thread(void *arg)
 		unlink(name);
 		sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jobid);
 		unlink(name);
-		pthread_exit((void *)1);
+		return(-1);
 	}
 	close(fd);
+	journal_job(JNL_ADD, jobid, &req);
 
 	/*
 	 * Send response to client.
@@ -514,12 +1728,13 @@ client_thread(void *arg)
 	writen(sockfd, &res, sizeof(struct printresp));
 
 	/*
-	 * Notify the printer thread, clean up, and exit.
+	 * Notify the printer threads.
 	 */
 	log_msg("adding job %d to queue", jobid);
 	add_job(&req, jobid);
-	pthread_cleanup_pop(1);
-	return((void *)0);
+	STAT_ADD(naccepted, 1);
+	STAT_ADD(nreceived, req.size);
+	return(0);
 }
 
 /*
@@ -527,8 +1742,8 @@ client_thread(void *arg)
  *
  * LOCKING: acquires and releases workerlock.
  */
-void
-add_worker(pthread_t tid, int sockfd)
+struct worker_thread *
+add_worker(pthread_t tid)
 {
 	struct worker_thread	*wtp;
 
@@ -537,15 +1752,15 @@ add_worker(pthread_t tid, int sockfd)
 		pthread_exit((void *)1);
 	}
 	wtp->tid = tid;
-	wtp->sockfd = sockfd;
+	wtp->sockfd = -1;
 	pthread_mutex_lock(&workerlock);
 	wtp->prev = NULL;
 	wtp->next = workers;
-	if (workers == NULL)
-		workers = wtp;
-	else
+	if (workers != NULL)
 		workers->prev = wtp;
+	workers = wtp;
 	pthread_mutex_unlock(&workerlock);
+	return(wtp);
 }
 
 /*
@@ -572,453 +1787,1049 @@ kill_workers(void)
 void
 client_cleanup(void *arg)
 {
-	struct worker_thread	*wtp;
-	pthread_t				tid;
-
-	tid = (pthread_t)((long)arg);
-	pthread_mutex_lock(&workerlock);
-	for (wtp = workers; wtp != NULL; wtp = wtp->next) {
-		if (wtp->tid == tid) {
-			if (wtp->next != NULL)
-				wtp->next->prev = wtp->prev;
-			if (wtp->prev != NULL)
-				wtp->prev->next = wtp->next;
-			else
-				workers = wtp->next;
-			break;
+	struct worker_thread	*wtp = arg;
+
+	pthread_mutex_lock(&workerlock);
+	if (wtp->next != NULL)
+		wtp->next->prev = wtp->prev;
+	if (wtp->prev != NULL)
+		wtp->prev->next = wtp->next;
+	else
+		workers = wtp->next;
+	pthread_mutex_unlock(&workerlock);
+	if (wtp->sockfd >= 0)
+		close(wtp->sockfd);
+	free(wtp);
+}
+
+/*
+ * Deal with signals.
+ *
+ * LOCKING: none.
+ */
+void *
+signal_thread(void *arg)
+{
+	int		err, signo;
+
+	for (;;) {
+		err = sigwait(&mask, &signo);
+		if (err != 0)
+			log_quit("sigwait failed: %s", strerror(err));
+		switch (signo) {
+		case SIGHUP:
+			/*
+			 * Re-read the configuration file.
+			 */
+			init_printer();
+			break;
+
+		case SIGTERM:
+			kill_workers();
+			log_msg("terminate with signal %s", strsignal(signo));
+			exit(0);
+
+		default:
+			kill_workers();
+			log_quit("unexpected signal %d", signo);
+		}
+	}
+}
+
+/*
+ * Add an option to the IPP header.
+ *
+ * LOCKING: none.
+ */
+char *
+add_option(char *cp, int tag, char *optname, char *optval)
+{
+	int		n;
+	union {
+		int16_t s;
+		char c[2];
+	}		u;
+
+	*cp++ = tag;
+	n = strlen(optname);
+	u.s = htons(n);
+	*cp++ = u.c[0];
+	*cp++ = u.c[1];
+	strcpy(cp, optname);
+	cp += n;
+	n = strlen(optval);
+	u.s = htons(n);
+	*cp++ = u.c[0];
+	*cp++ = u.c[1];
+	strcpy(cp, optval);
+	return(cp + n);
+}
+
+/*
+ * Thread to communicate with the printers.  It takes up to
+ * ippdepth jobs for a printer that's free, sends them all over
+ * the printer's connection, and then reads the answers, which
+ * come back in the same order.  The printer threads together
+ * keep all the printers busy.
+ *
+ * LOCKING: acquires and releases joblock.
+ */
+void *
+printer_thread(void *arg)
+{
+	struct job		*jobs[IPP_DEPTH_MAX];
+	int				state[IPP_DEPTH_MAX];
+	struct printer	*pp;
+	time_t			wait, idle;
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	char			hostname[HOST_NAME_MAX];
+	int				i, n, r, reused, retried, answered, broken, failed;
+	char			name[FILENMSZ];
+	struct timespec	ts;
+
+	for (;;) {
+		/*
+		 * Get jobs to print.  If the only jobs are for
+		 * printers that failed recently, sleep until the
+		 * first of them can be tried again, closing idle
+		 * connections as they time out.
+		 */
+		pthread_mutex_lock(&joblock);
+		while ((pp = next_printer(&wait)) == NULL) {
+			idle = close_idle();
+			if (idle != 0 && (wait == 0 || idle < wait))
+				wait = idle;
+			if (wait == 0) {
+				log_msg("printer_thread: waiting...");
+				pthread_cond_wait(&jobwait, &joblock);
+			} else {
+				ts.tv_sec = wait;
+				ts.tv_nsec = 0;
+				pthread_cond_timedwait(&jobwait, &joblock, &ts);
+			}
+		}
+		for (n = 0; n < ippdepth && pp->njobs > 0; n++) {
+			jobs[n] = remove_job(pp);
+			state[n] = JOB_QUEUED;
+			log_msg("printer_thread: picked up job %d from %s for %s",
+			  jobs[n]->jobid, jobs[n]->req.usernm, pp->name);
+		}
+		pp->busy = 1;
+
+		/*
+		 * Copy what we need, since re-reading the
+		 * config file can change it.
+		 */
+		addrlen = pp->addr->ai_addrlen;
+		memcpy(&addr, pp->addr->ai_addr, addrlen);
+		strncpy(hostname, pp->hostname, HOST_NAME_MAX-1);
+		hostname[HOST_NAME_MAX-1] = '\0';
+		pthread_mutex_unlock(&joblock);
+
+		/*
+		 * Send the jobs, then read the answers.  A printer can
+		 * close the connection after any answer, or while we
+		 * kept it idle.  If it answered something, send what's
+		 * left on a new connection.  If it answered nothing on
+		 * a connection we kept, try once more on a new one.
+		 */
+		retried = 0;
+again:
+		reused = pp->sockfd >= 0;
+		if (!reused) {
+			if ((pp->sockfd = connect_retry(AF_INET, SOCK_STREAM, 0,
+			  (struct sockaddr *)&addr, addrlen)) < 0) {
+				log_msg("printer %s: jobs deferred - can't contact "
+				  "printer: %s", pp->name, strerror(errno));
+				goto done;
+			}
+			pp->keep = 1;
+			pp->rlen = 0;
+			pp->nsent = 0;
+		}
+		answered = 0;
+		broken = 0;
+		for (i = 0; i < n && !broken; i++) {
+			if (jobs[i] == NULL || state[i] != JOB_QUEUED)
+				continue;
+			if ((r = send_job(pp->sockfd, jobs[i], hostname)) == 0) {
+				sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR,
+				  jobs[i]->jobid);
+				unlink(name);
+				sprintf(name, "%s/%s/%d", SPOOLDIR, REQDIR,
+				  jobs[i]->jobid);
+				unlink(name);
+				journal_job(JNL_DONE, jobs[i]->jobid, NULL);
+				free(jobs[i]);
+				jobs[i] = NULL;
+			} else if (r > 0) {
+				state[i] = JOB_SENT;
+				pp->nsent++;
+			} else {
+				broken = 1;
+			}
+		}
+
+		/*
+		 * Even if a send failed, the printer may have answered
+		 * the jobs ahead of it before it closed the connection.
+		 */
+		for (i = 0; i < n && pp->keep; i++) {
+			if (jobs[i] == NULL || state[i] != JOB_SENT)
+				continue;
+			if ((r = printer_status(pp, jobs[i])) > 0) {
+				STAT_ADD(pp->stats.njobs, 1);
+				STAT_ADD(pp->stats.nbytes, jobs[i]->req.size);
+				hist_add(pp->stats.waithist,
+				  jobs[i]->sent - jobs[i]->queued);
+				hist_add(pp->stats.sendhist,
+				  now_ms() - jobs[i]->sent);
+				sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR,
+				  jobs[i]->jobid);
+				unlink(name);
+				sprintf(name, "%s/%s/%d", SPOOLDIR, REQDIR,
+				  jobs[i]->jobid);
+				unlink(name);
+				journal_job(JNL_DONE, jobs[i]->jobid, NULL);
+				free(jobs[i]);
+				jobs[i] = NULL;
+				answered++;
+			} else if (r == 0) {
+				STAT_ADD(pp->stats.nfailed, 1);
+				state[i] = JOB_FAILED;
+				answered++;
+			} else {
+				broken = 1;
+				break;
+			}
+		}
+		if (broken || !pp->keep) {
+			log_msg("printer %s: closing connection after %d jobs",
+			  pp->name, pp->nsent);
+			close(pp->sockfd);
+			pp->sockfd = -1;
+			r = 0;
+			for (i = 0; i < n; i++) {
+				if (jobs[i] != NULL && state[i] != JOB_FAILED) {
+					state[i] = JOB_QUEUED;
+					r++;
+				}
+			}
+			if (r > 0 && (answered > 0 || (reused && !retried))) {
+				if (answered == 0)
+					retried = 1;
+				goto again;
+			}
+		}
+done:
+		/*
+		 * Failed jobs go back on the front of the queue, and
+		 * we leave the printer alone for a while.  Other
+		 * printers aren't affected.
+		 */
+		pthread_mutex_lock(&joblock);
+		pp->busy = 0;
+		pp->idle = time(NULL) + ippidle;
+		failed = 0;
+		for (i = n - 1; i >= 0; i--) {
+			if (jobs[i] != NULL) {
+				replace_job(jobs[i]);
+				failed++;
+			}
+		}
+		if (failed) {
+			STAT_ADD(pp->stats.nretries, failed);
+			pp->retry = time(NULL) + pp->backoff;
+			log_msg("printer %s: retrying in %d seconds", pp->name,
+			  pp->backoff);
+			pp->backoff *= 2;
+			if (pp->backoff > BACKOFF_MAX)
+				pp->backoff = BACKOFF_MAX;
+		} else {
+			pp->backoff = BACKOFF_MIN;
+		}
+		pthread_mutex_unlock(&joblock);
+		pthread_cond_broadcast(&jobwait);
+	}
+}
+
+/*
+ * Send a Print-Job request for a job over a connection to its
+ * printer.  Returns 1 if it was sent, 0 if the job had to be
+ * canceled, or -1 if the connection failed.
+ *
+ * LOCKING: none.
+ */
+int
+send_job(int sockfd, struct job *jp, char *hostname)
+{
+	int				hlen, ilen, fd, extra, r;
+	char			*icp, *hcp, *p;
+	struct ipp_hdr	*hp;
+	struct stat		sbuf;
+	struct iovec	iov[3];
+	struct msghdr	msg;
+	char			name[FILENMSZ];
+	char			hbuf[HBUFSZ];
+	char			ibuf[IBUFSZ];
+	char			str[HOST_NAME_MAX + 16];
+	double			secs, cpu;
+	struct timespec	start, end, cstart, cend;
+
+	sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jp->jobid);
+	if ((fd = open(name, O_RDONLY)) < 0) {
+		log_msg("job %d canceled - can't open %s: %s",
+		  jp->jobid, name, strerror(errno));
+		return(0);
+	}
+	if (fstat(fd, &sbuf) < 0) {
+		log_msg("job %d canceled - can't fstat %s: %s",
+		  jp->jobid, name, strerror(errno));
+		close(fd);
+		return(0);
+	}
+
+	/*
+	 * Set up the IPP header.
+	 */
+	icp = ibuf;
+	hp = (struct ipp_hdr *)icp;
+	hp->major_version = 1;
+	hp->minor_version = 1;
+	hp->operation = htons(OP_PRINT_JOB);
+	hp->request_id = htonl(jp->jobid);
+	icp += offsetof(struct ipp_hdr, attr_group);
+	*icp++ = TAG_OPERATION_ATTR;
+	icp = add_option(icp, TAG_CHARSET, "attributes-charset",
+	  "utf-8");
+	icp = add_option(icp, TAG_NATULANG,
+	  "attributes-natural-language", "en-us");
+	sprintf(str, "http://%s/ipp", hostname);
+	icp = add_option(icp, TAG_URI, "printer-uri", str);
+	icp = add_option(icp, TAG_NAMEWOLANG,
+	  "requesting-user-name", jp->req.usernm);
+	icp = add_option(icp, TAG_NAMEWOLANG, "job-name",
+	  jp->req.jobnm);
+	if (jp->req.flags & PR_TEXT) {
+		p = "text/plain";
+		extra = 1;
+	} else {
+		p = "application/postscript";
+		extra = 0;
+	}
+	icp = add_option(icp, TAG_MIMETYPE, "document-format", p);
+	*icp++ = TAG_END_OF_ATTR;
+	ilen = icp - ibuf;
+
+	/*
+	 * Set up the HTTP header.
+	 */
+	hcp = hbuf;
+	sprintf(hcp, "POST /ipp HTTP/1.1\r\n");
+	hcp += strlen(hcp);
+	sprintf(hcp, "Content-Length: %ld\r\n",
+	  (long)sbuf.st_size + ilen + extra);
+	hcp += strlen(hcp);
+	strcpy(hcp, "Content-Type: application/ipp\r\n");
+	hcp += strlen(hcp);
+	sprintf(hcp, "Host: %s:%d\r\n", hostname, IPP_PORT);
+	hcp += strlen(hcp);
+	*hcp++ = '\r';
+	*hcp++ = '\n';
+	hlen = hcp - hbuf;
+
+	/*
+	 * Write the headers first.  Then send the file.
+	 * For plain text, the headers are followed by a
+	 * backspace.  This hack allows PostScript to be
+	 * printed as plain text.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cstart);
+	jp->sent = now_ms();
+	iov[0].iov_base = hbuf;
+	iov[0].iov_len = hlen;
+	iov[1].iov_base = ibuf;
+	iov[1].iov_len = ilen;
+	iov[2].iov_base = "\b";
+	iov[2].iov_len = extra;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 3;
+	r = -1;
+	if (sendmsg(sockfd, &msg, sbuf.st_size > 0 ? MSG_MORE : 0) !=
+	  hlen + ilen + extra) {
+		log_ret("can't write to printer");
+		goto out;
+	}
+	if (send_file(sockfd, fd, sbuf.st_size) != sbuf.st_size) {
+		log_ret("can't send %s to printer", name);
+		goto out;
+	}
+	r = 1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cend);
+	secs = (end.tv_sec - start.tv_sec) +
+	  (end.tv_nsec - start.tv_nsec) / 1e9;
+	cpu = (cend.tv_sec - cstart.tv_sec) +
+	  (cend.tv_nsec - cstart.tv_nsec) / 1e9;
+	STAT_ADD(jp->printer->stats.sendus, (long long)(secs * 1e6));
+	if (sbuf.st_size > 0 && secs > 0) {
+		log_msg("job %d: sent %lld bytes in %.3f s (%.1f MB/s, "
+		  "%.2f CPU s/GB)", jp->jobid, (long long)sbuf.st_size,
+		  secs, sbuf.st_size / secs / 1e6,
+		  cpu * 1e9 / sbuf.st_size);
+	}
+out:
+	close(fd);
+	return(r);
+}
+
+/*
+ * Close the connections of printers that have been idle too long.
+ * Returns the time the next one should be closed, or 0 if there
+ * are no others.
+ *
+ * LOCKING: caller must hold joblock.
+ */
+time_t
+close_idle(void)
+{
+	struct printer	*pp;
+	time_t			now, next;
+
+	now = time(NULL);
+	next = 0;
+	for (pp = printers; pp != NULL; pp = pp->next) {
+		if (pp->busy || pp->sockfd < 0)
+			continue;
+		if (pp->idle <= now) {
+			log_msg("printer %s: closing idle connection after %d jobs",
+			  pp->name, pp->nsent);
+			close(pp->sockfd);
+			pp->sockfd = -1;
+		} else if (next == 0 || pp->idle < next) {
+			next = pp->idle;
+		}
+	}
+	return(next);
+}
+
+/*
+ * Send size bytes of a spooled file to the printer.  Where we can,
+ * the kernel moves the data from the file to the socket itself; if
+ * it can't, we copy it through a buffer.  Returns the number of
+ * bytes sent or -1 on error.
+ *
+ * LOCKING: none.
+ */
+off_t
+send_file(int sockfd, int fd, off_t size)
+{
+	off_t	off;
+	ssize_t	nr, nw;
+	char	buf[IOBUFSZ];
+
+	off = 0;
+#if defined(LINUX)
+	while (off < size) {
+		if ((nw = sendfile(sockfd, fd, &off, size - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (off == 0 && (errno == EINVAL || errno == ENOSYS))
+				break;		/* not supported; copy it */
+			return(-1);
 		}
+		if (nw == 0)
+			return(off);	/* file got shorter */
 	}
-	pthread_mutex_unlock(&workerlock);
-	if (wtp != NULL) {
-		close(wtp->sockfd);
-		free(wtp);
+	if (off == size)
+		return(off);
+#endif
+	if (lseek(fd, off, SEEK_SET) == -1)
+		return(-1);
+	nr = 0;
+	while (off < size && (nr = read(fd, buf,
+	  size - off < IOBUFSZ ? size - off : IOBUFSZ)) > 0) {
+		if ((nw = writen(sockfd, buf, nr)) != nr)
+			return(-1);
+		off += nr;
 	}
+	if (nr < 0)
+		return(-1);
+	return(off);
 }
 
 /*
- * Deal with signals.
+ * Receive size bytes of a job from a client into its spool file.
+ * Where we can, the kernel moves the data from the socket into
+ * the file through a pipe; if it can't, we copy it through a
+ * buffer.  A file opened with O_DIRECT is written from a buffer
+ * aligned for it, except the end, which usually isn't a multiple
+ * of the block size.  Returns the number of bytes received, or
+ * -1 or a short count on error or end of file, with errno set
+ * (to 0 at end of file).
  *
- * LOCKING: acquires and releases configlock.
+ * LOCKING: none.
  */
-void *
-signal_thread(void *arg)
+off_t
+recv_file(int fd, int sockfd, off_t size)
 {
-	int		err, signo;
-
-	for (;;) {
-		err = sigwait(&mask, &signo);
-		if (err != 0)
-			log_quit("sigwait failed: %s", strerror(err));
-		switch (signo) {
-		case SIGHUP:
-			/*
-			 * Schedule to re-read the configuration file.
-			 */
-			pthread_mutex_lock(&configlock);
-			reread = 1;
-			pthread_mutex_unlock(&configlock);
-			break;
-
-		case SIGTERM:
-			kill_workers();
-			log_msg("terminate with signal %s", strsignal(signo));
-			exit(0);
-
-		default:
-			kill_workers();
-			log_quit("unexpected signal %d", signo);
+	off_t	off;
+	ssize_t	nr, nw;
+	char	*bp;
+#if defined(LINUX)
+	int		pfd[2];
+#endif
+
+	off = 0;
+#if defined(O_DIRECT)
+	if (fcntl(fd, F_GETFL) & O_DIRECT) {
+		if ((errno = posix_memalign((void **)&bp, DIRECT_ALIGN,
+		  DIRECT_BUFSZ)) != 0)
+			return(-1);
+		while (off < size) {
+			nr = size - off < DIRECT_BUFSZ ? size - off : DIRECT_BUFSZ;
+			errno = 0;
+			if (readn(sockfd, bp, nr) != nr)
+				break;
+			if (nr % DIRECT_ALIGN != 0)
+				clr_fl(fd, O_DIRECT);
+			if (write(fd, bp, nr) != nr)
+				break;
+			off += nr;
+		}
+		free(bp);
+		return(off);
+	}
+#endif
+#if defined(LINUX)
+	if (pipe(pfd) < 0)
+		return(-1);
+	fcntl(pfd[1], F_SETPIPE_SZ, SPLICE_MAX);
+	while (off < size) {
+		errno = 0;
+		nr = splice(sockfd, NULL, pfd[1], NULL,
+		  size - off < SPLICE_MAX ? size - off : SPLICE_MAX,
+		  SPLICE_F_MOVE|SPLICE_F_MORE);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr < 0 && off == 0 && (errno == EINVAL || errno == ENOSYS))
+			break;		/* not supported; copy it */
+		if (nr <= 0) {
+			close(pfd[0]);
+			close(pfd[1]);
+			return(off);
+		}
+		for (; nr > 0; nr -= nw, off += nw) {
+			if ((nw = splice(pfd[0], NULL, fd, NULL, nr,
+			  SPLICE_F_MOVE)) <= 0) {
+				close(pfd[0]);
+				close(pfd[1]);
+				return(-1);
+			}
 		}
 	}
+	close(pfd[0]);
+	close(pfd[1]);
+	if (off == size)
+		return(off);
+#endif
+	if ((bp = malloc(IOBUFSZ)) == NULL)
+		return(-1);
+	while (off < size) {
+		errno = 0;
+		nr = read(sockfd, bp, size - off < IOBUFSZ ? size - off : IOBUFSZ);
+		if (nr < 0 && errno == EINTR)
+			continue;
+		if (nr <= 0 || write(fd, bp, nr) != nr)
+			break;
+		off += nr;
+	}
+	free(bp);
+	return(off);
 }
 
 /*
- * Add an option to the IPP header.
+ * Read from the printer until its buffer holds at least n bytes.
+ * Returns 0, or -1 on error or end of file.
+ *
+ * With requests pipelined, a printer that doesn't disable Nagle's
+ * algorithm holds each small answer until we acknowledge the one
+ * before it, and delayed acknowledgements can stall every answer.
+ * So ask for acknowledgements to go out right away.
  *
  * LOCKING: none.
  */
-char *
-add_option(char *cp, int tag, char *optname, char *optval)
+int
+readmore(struct printer *pp, int n)
 {
-	int		n;
-	union {
-		int16_t s;
-		char c[2];
-	}		u;
+	ssize_t	nr;
+#if defined(TCP_QUICKACK)
+	int		on = 1;
+#endif
 
-	*cp++ = tag;
-	n = strlen(optname);
-	u.s = htons(n);
-	*cp++ = u.c[0];
-	*cp++ = u.c[1];
-	strcpy(cp, optname);
-	cp += n;
-	n = strlen(optval);
-	u.s = htons(n);
-	*cp++ = u.c[0];
-	*cp++ = u.c[1];
-	strcpy(cp, optval);
-	return(cp + n);
+	if (n > IOBUFSZ - 1) {
+		log_msg("printer %s: response too big", pp->name);
+		return(-1);
+	}
+	while (pp->rlen < n) {
+#if defined(TCP_QUICKACK)
+		setsockopt(pp->sockfd, IPPROTO_TCP, TCP_QUICKACK, &on,
+		  sizeof(on));
+#endif
+		if ((nr = tread(pp->sockfd, pp->rbuf + pp->rlen,
+		  IOBUFSZ - 1 - pp->rlen, IPP_TIMEOUT)) <= 0) {
+			if (nr < 0)
+				log_msg("printer %s: error reading response: %s",
+				  pp->name, strerror(errno));
+			return(-1);
+		}
+		pp->rlen += nr;
+	}
+	return(0);
 }
 
 /*
- * Single thread to communicate with the printer.
+ * Read and parse the next response on a printer's connection.
+ * Anything after it is left in the printer's buffer for the next
+ * call.  Returns 1 if the job printed, 0 if the printer refused
+ * it, or -1 if the connection failed.  If the printer is going to
+ * close the connection, pp->keep is cleared.
  *
- * LOCKING: acquires and releases joblock and configlock.
+ * LOCKING: none.
  */
-void *
-printer_thread(void *arg)
+int
+printer_status(struct printer *pp, struct job *jp)
 {
-	struct job		*jp;
-	int				hlen, ilen, sockfd, fd, nr, nw, extra;
-	char			*icp, *hcp, *p;
+	int				code, hlen, boff, ippstat;
+	long			clen, left;
+	ssize_t			nr;
+	int32_t			jobid;
+	char			*bp, *cp, *ep;
 	struct ipp_hdr	*hp;
-	struct stat		sbuf;
-	struct iovec	iov[2];
-	char			name[FILENMSZ];
-	char			hbuf[HBUFSZ];
-	char			ibuf[IBUFSZ];
-	char			buf[IOBUFSZ];
-	char			str[64];
-	struct timespec	ts = { 60, 0 };		/* 1 minute */
 
+	bp = pp->rbuf;
 	for (;;) {
 		/*
-		 * Get a job to print.
-		 */
-		pthread_mutex_lock(&joblock);
-		while (jobhead == NULL) {
-			log_msg("printer_thread: waiting...");
-			pthread_cond_wait(&jobwait, &joblock);
-		}
-		remove_job(jp = jobhead);
-		log_msg("printer_thread: picked up job %d", jp->jobid);
-		pthread_mutex_unlock(&joblock);
-		update_jobno();
-
-		/*
-		 * Check for a change in the config file.
+		 * Read the whole HTTP header.
 		 */
-		pthread_mutex_lock(&configlock);
-		if (reread) {
-			freeaddrinfo(printer);
-			printer = NULL;
-			printer_name = NULL;
-			reread = 0;
-			pthread_mutex_unlock(&configlock);
-			init_printer();
-		} else {
-			pthread_mutex_unlock(&configlock);
+		for (;;) {
+			bp[pp->rlen] = '\0';
+			if ((ep = strstr(bp, "\r\n\r\n")) != NULL)
+				break;
+			if (readmore(pp, pp->rlen + 1) < 0)
+				return(-1);
 		}
-
-		/*
-		 * Send job to printer.
-		 */
-		sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jp->jobid);
-		if ((fd = open(name, O_RDONLY)) < 0) {
-			log_msg("job %d canceled - can't open %s: %s",
-			  jp->jobid, name, strerror(errno));
-			free(jp);
-			continue;
+		hlen = ep + 4 - bp;
+		*ep = '\0';
+		if (strncmp(bp, "HTTP/", 5) != 0 ||
+		  (cp = strchr(bp, ' ')) == NULL) {
+			log_msg("printer %s: bad response: %.40s", pp->name, bp);
+			return(-1);
 		}
-		if (fstat(fd, &sbuf) < 0) {
-			log_msg("job %d canceled - can't fstat %s: %s",
-			  jp->jobid, name, strerror(errno));
-			free(jp);
-			close(fd);
+		code = atoi(cp);
+		if (HTTP_INFO(code)) {		/* no body; get the next one */
+			pp->rlen -= hlen;
+			memmove(bp, bp + hlen, pp->rlen);
 			continue;
 		}
-		if ((sockfd = connect_retry(AF_INET, SOCK_STREAM, 0,
-		  printer->ai_addr, printer->ai_addrlen)) < 0) {
-			log_msg("job %d deferred - can't contact printer: %s",
-			  jp->jobid, strerror(errno));
-			goto defer;
-		}
-
-		/*
-		 * Set up the IPP header.
-		 */
-		icp = ibuf;
-		hp = (struct ipp_hdr *)icp;
-		hp->major_version = 1;
-		hp->minor_version = 1;
-		hp->operation = htons(OP_PRINT_JOB);
-		hp->request_id = htonl(jp->jobid);
-		icp += offsetof(struct ipp_hdr, attr_group);
-		*icp++ = TAG_OPERATION_ATTR;
-		icp = add_option(icp, TAG_CHARSET, "attributes-charset",
-		  "utf-8");
-		icp = add_option(icp, TAG_NATULANG,
-		  "attributes-natural-language", "en-us");
-		sprintf(str, "http://%s/ipp", printer_name);
-		icp = add_option(icp, TAG_URI, "printer-uri", str);
-		icp = add_option(icp, TAG_NAMEWOLANG,
-		  "requesting-user-name", jp->req.usernm);
-		icp = add_option(icp, TAG_NAMEWOLANG, "job-name",
-		  jp->req.jobnm);
-		if (jp->req.flags & PR_TEXT) {
-			p = "text/plain";
-			extra = 1;
-		} else {
-			p = "application/postscript";
-			extra = 0;
-		}
-		icp = add_option(icp, TAG_MIMETYPE, "document-format", p);
-		*icp++ = TAG_END_OF_ATTR;
-		ilen = icp - ibuf;
-
-		/*
-		 * Set up the HTTP header.
-		 */
-		hcp = hbuf;
-		sprintf(hcp, "POST /ipp HTTP/1.1\r\n");
-		hcp += strlen(hcp);
-		sprintf(hcp, "Content-Length: %ld\r\n",
-		  (long)sbuf.st_size + ilen + extra);
-		hcp += strlen(hcp);
-		strcpy(hcp, "Content-Type: application/ipp\r\n");
-		hcp += strlen(hcp);
-		sprintf(hcp, "Host: %s:%d\r\n", printer_name, IPP_PORT);
-		hcp += strlen(hcp);
-		*hcp++ = '\r';
-		*hcp++ = '\n';
-		hlen = hcp - hbuf;
 
 		/*
-		 * Write the headers first.  Then send the file.
+		 * HTTP/1.1 keeps the connection unless told not to.  If
+		 * there's no Content-Length, the response ends when the
+		 * printer closes the connection.  We don't decode chunks,
+		 * but can skip the first chunk size to find the IPP header.
 		 */
-		iov[0].iov_base = hbuf;
-		iov[0].iov_len = hlen;
-		iov[1].iov_base = ibuf;
-		iov[1].iov_len = ilen;
-		if (writev(sockfd, iov, 2) != hlen + ilen) {
-			log_ret("can't write to printer");
-			goto defer;
-		}
-
-		if (jp->req.flags & PR_TEXT) {
-			/*
-			 * Hack: allow PostScript to be printed as plain text.
-			 */
-			if (write(sockfd, "\b", 1) != 1) {
-				log_ret("can't write to printer");
-				goto defer;
+		if (strncmp(bp, "HTTP/1.0", 8) == 0)
+			pp->keep = 0;
+		clen = -1;
+		boff = hlen;
+		for (cp = strchr(bp, '\n'); cp != NULL; cp = strchr(cp, '\n')) {
+			cp++;
+			if (strncasecmp(cp, "Content-Length:", 15) == 0) {
+				clen = atol(cp + 15);
+			} else if (strncasecmp(cp, "Connection:", 11) == 0) {
+				if (strstr(cp, "close") != NULL)
+					pp->keep = 0;
+			} else if (strncasecmp(cp, "Transfer-Encoding:", 18) == 0) {
+				boff = -1;
 			}
 		}
+		if (clen < 0)
+			pp->keep = 0;
+		break;
+	}
 
-		while ((nr = read(fd, buf, IOBUFSZ)) > 0) {
-			if ((nw = writen(sockfd, buf, nr)) != nr) {
-				if (nw < 0)
-				  log_ret("can't write to printer");
-				else
-				  log_msg("short write (%d/%d) to printer", nw, nr);
-				goto defer;
+	if (!HTTP_SUCCESS(code)) {
+		log_msg("printer %s: job %d: HTTP error %d", pp->name,
+		  jp->jobid, code);
+		ippstat = -1;
+	} else {
+		if (boff < 0) {
+			while ((cp = memchr(bp + hlen, '\n', pp->rlen - hlen)) ==
+			  NULL) {
+				if (readmore(pp, pp->rlen + 1) < 0)
+					return(-1);
 			}
+			boff = cp + 1 - bp;
 		}
-		if (nr < 0) {
-			log_ret("can't read %s", name);
-			goto defer;
+		if (readmore(pp, boff + offsetof(struct ipp_hdr, attr_group)) < 0)
+			return(-1);
+		hp = (struct ipp_hdr *)(bp + boff);
+		ippstat = ntohs(hp->status);
+		jobid = ntohl(hp->request_id);
+		if (jobid != jp->jobid) {
+			log_msg("printer %s: answer for job %d, not %d", pp->name,
+			  jobid, jp->jobid);
+			return(-1);
 		}
+		if (!STATCLASS_OK(ippstat))
+			log_msg("printer %s: job %d: IPP status 0x%04x",
+			  pp->name, jp->jobid, ippstat);
+	}
 
-		/*
-		 * Read the response from the printer.
-		 */
-		if (printer_status(sockfd, jp)) {
-			unlink(name);
-			sprintf(name, "%s/%s/%d", SPOOLDIR, REQDIR, jp->jobid);
-			unlink(name);
-			free(jp);
-			jp = NULL;
-		}
-defer:
-		close(fd);
-		if (sockfd >= 0)
-			close(sockfd);
-		if (jp != NULL) {
-			replace_job(jp);
-			nanosleep(&ts, NULL);
+	/*
+	 * Skip the rest of the response.  If the printer's going to
+	 * close the connection, there's no need.
+	 */
+	if (!pp->keep) {
+		pp->rlen = 0;
+	} else if (hlen + clen <= pp->rlen) {
+		pp->rlen -= hlen + clen;
+		memmove(bp, bp + hlen + clen, pp->rlen);
+	} else {
+		for (left = hlen + clen - pp->rlen; left > 0; left -= nr) {
+			if ((nr = tread(pp->sockfd, bp,
+			  left < IOBUFSZ ? left : IOBUFSZ, IPP_TIMEOUT)) <= 0)
+				return(-1);
 		}
+		pp->rlen = 0;
 	}
+	return(ippstat >= 0 && STATCLASS_OK(ippstat));
 }
 
 /*
- * Read data from the printer, possibly increasing the buffer.
- * Returns offset of end of data in buffer or -1 on failure.
+ * Return the time in milliseconds, from a clock that
+ * only goes forward.
  *
  * LOCKING: none.
  */
-ssize_t
-readmore(int sockfd, char **bpp, int off, int *bszp)
+long long
+now_ms(void)
 {
-	ssize_t	nr;
-	char	*bp = *bpp;
-	int		bsz = *bszp;
-
-	if (off >= bsz) {
-		bsz += IOBUFSZ;
-		if ((bp = realloc(*bpp, bsz)) == NULL)
-			log_sys("readmore: can't allocate bigger read buffer");
-		*bszp = bsz;
-		*bpp = bp;
-	}
-	if ((nr = tread(sockfd, &bp[off], bsz-off, 1)) > 0)
-		return(off+nr);
-	else
-		return(-1);
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
 }
 
 /*
- * Read and parse the response from the printer.  Return 1
- * if the request was successful, and 0 otherwise.
+ * Count a time in a histogram.
  *
  * LOCKING: none.
  */
-int
-printer_status(int sfd, struct job *jp)
+void
+hist_add(volatile long *hist, long long ms)
 {
-	int				i, success, code, len, found, bufsz, datsz;
-	int32_t			jobid;
-	ssize_t			nr;
-	char			*bp, *cp, *statcode, *reason, *contentlen;
-	struct ipp_hdr	*hp;
+	int		i;
 
-	/*
-	 * Read the HTTP header followed by the IPP response header.
-	 * They can be returned in multiple read attempts.  Use the
-	 * Content-Length specifier to determine how much to read.
-	 */
-	success = 0;
-	bufsz = IOBUFSZ;
-	if ((bp = malloc(IOBUFSZ)) == NULL)
-		log_sys("printer_status: can't allocate read buffer");
+	for (i = 0; i < NHIST - 1 && ms >= (1LL << i); i++)
+		;
+	STAT_ADD(hist[i], 1);
+}
 
-	while ((nr = tread(sfd, bp, bufsz, 5)) > 0) {
-		/*
-		 * Find the status.  Response starts with "HTTP/x.y"
-		 * so we can skip the first 8 characters.
-		 */
-		cp = bp + 8;
-		datsz = nr;
-		while (isspace((int)*cp))
-			cp++;
-		statcode = cp;
-		while (isdigit((int)*cp))
-			cp++;
-		if (cp == statcode) { /* Bad format; log it and move on */
-			log_msg(bp);
-		} else {
-			*cp++ = '\0';
-			reason = cp;
-			while (*cp != '\r' && *cp != '\n')
-				cp++;
-			*cp = '\0';
-			code = atoi(statcode);
-			if (HTTP_INFO(code))
+/*
+ * Take a job off its printer's queue and throw it away.  Only the
+ * user who submitted it may cancel it, unless usernm is NULL.
+ * A job a printer thread has already taken can't be canceled.
+ * Returns 0 if the job was canceled, or -1 with errno set to
+ * ENOENT or EPERM.
+ *
+ * LOCKING: acquires and releases joblock.
+ */
+int
+cancel_job(int32_t jobid, const char *usernm)
+{
+	int				i, prio;
+	struct printer	*pp;
+	struct flow		*fp;
+	struct job		*jp;
+	char			name[FILENMSZ];
+
+	pthread_mutex_lock(&joblock);
+	for (pp = printers; pp != NULL; pp = pp->next) {
+		for (prio = 0; prio < NPRIO; prio++) {
+			if ((fp = pp->turn[prio]) == NULL)
 				continue;
-			if (!HTTP_SUCCESS(code)) { /* probable error: log it */
-				bp[datsz] = '\0';
-				log_msg("error: %s", reason);
-				break;
-			}
+			do {
+				for (i = 0; i < fp->njobs; i++)
+					if (fp->heap[i]->jobid == jobid)
+						goto found;
+				fp = fp->next;
+			} while (fp != pp->turn[prio]);
+		}
+	}
+	pthread_mutex_unlock(&joblock);
+	errno = ENOENT;
+	return(-1);
 
-			/*
-			 * HTTP request was okay, but still need to check
-			 * IPP status.  Search for the Content-Length.
-			 */
-			i = cp - bp;
-			for (;;) {
-				while (*cp != 'C' && *cp != 'c' && i < datsz) {
-					cp++;
-					i++;
-				}
-				if (i >= datsz) {	/* get more header */
-					if ((nr = readmore(sfd, &bp, i, &bufsz)) < 0) {
-						goto out;
-					} else {
-						cp = &bp[i];
-						datsz += nr;
-					}
-				}
+found:
+	if (usernm != NULL && strcmp(usernm, fp->heap[i]->req.usernm) != 0) {
+		pthread_mutex_unlock(&joblock);
+		errno = EPERM;
+		return(-1);
+	}
+	jp = flow_delete(fp, i);
+	if (fp->njobs == 0)
+		put_flow(pp, fp);
+	pp->njobs--;
+	pthread_mutex_unlock(&joblock);
 
-				if (strncasecmp(cp, "Content-Length:", 15) == 0) {
-					cp += 15;
-					while (isspace((int)*cp))
-						cp++;
-					contentlen = cp;
-					while (isdigit((int)*cp))
-						cp++;
-					*cp++ = '\0';
-					i = cp - bp;
-					len = atoi(contentlen);
-					break;
-				} else {
-					cp++;
-					i++;
-				}
-			}
-			if (i >= datsz) {	/* get more header */
-				if ((nr = readmore(sfd, &bp, i, &bufsz)) < 0) {
-					goto out;
-				} else {
-					cp = &bp[i];
-					datsz += nr;
-				}
-			}
+	sprintf(name, "%s/%s/%d", SPOOLDIR, DATADIR, jobid);
+	unlink(name);
+	sprintf(name, "%s/%s/%d", SPOOLDIR, REQDIR, jobid);
+	unlink(name);
+	journal_job(JNL_DONE, jobid, NULL);
+	log_msg("job %d canceled by request", jobid);
+	free(jp);
+	return(0);
+}
 
-			found = 0;
-			while (!found) {  /* look for end of HTTP header */
-				while (i < datsz - 2) {
-					if (*cp == '\n' && *(cp + 1) == '\r' &&
-					  *(cp + 2) == '\n') {
-						found = 1;
-						cp += 3;
-						i += 3;
-						break;
-					}
-					cp++;
-					i++;
-				}
-				if (i >= datsz) {	/* get more header */
-					if ((nr = readmore(sfd, &bp, i, &bufsz)) < 0) {
-						goto out;
-					} else {
-						cp = &bp[i];
-						datsz += nr;
-					}
-				}
-			}
+/*
+ * Thread to answer printctl.  Requests come one at a time, and
+ * are quick, so one thread is enough.
+ *
+ * LOCKING: none.
+ */
+void *
+ctl_thread(void *arg)
+{
+	int		clfd;
+	uid_t	uid;
 
-			if (datsz - i < len) {	/* get more header */
-				if ((nr = readmore(sfd, &bp, i, &bufsz)) < 0) {
-					goto out;
-				} else {
-					cp = &bp[i];
-					datsz += nr;
-				}
-			}
+	for (;;) {
+		if ((clfd = serv_accept(ctlfd, &uid)) < 0) {
+			log_msg("ctl_thread: serv_accept error %d: %s", clfd,
+			  strerror(errno));
+			continue;
+		}
+		ctl_request(clfd, uid);
+	}
+	return((void *)0);
+}
 
-			hp = (struct ipp_hdr *)cp;
-			i = ntohs(hp->status);
-			jobid = ntohl(hp->request_id);
+/*
+ * Read a command line from printctl, answer it, and close the
+ * connection.  The commands are:
+ *	status			the daemon and each printer
+ *	jobs			the jobs waiting, in no particular order
+ *	hist			how long jobs wait and take to print
+ *	cancel jobid	throw a waiting job away
+ * Only the superuser, our own user, or the job's owner may
+ * cancel a job.
+ *
+ * LOCKING: none.
+ */
+void
+ctl_request(int sockfd, uid_t uid)
+{
+	int				n, nr;
+	long			jobid;
+	FILE			*fp;
+	struct passwd	*pwdp;
+	struct timeval	tv;
+	char			*usernm;
+	char			line[CTL_LINEMAX], cmd[CTL_LINEMAX];
+
+	for (n = 0; n < CTL_LINEMAX - 1; n += nr) {
+		if ((nr = tread(sockfd, line + n, CTL_LINEMAX - 1 - n,
+		  CTL_TIMEOUT)) <= 0)
+			break;
+		if (memchr(line + n, '\n', nr) != NULL) {
+			n += nr;
+			break;
+		}
+	}
+	line[n] = '\0';
+	tv.tv_sec = CTL_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if ((fp = fdopen(sockfd, "w")) == NULL) {
+		log_ret("ctl_request: fdopen failed");
+		close(sockfd);
+		return;
+	}
 
-			if (jobid != jp->jobid) {
-				/*
-				 * Different jobs.  Ignore it.
-				 */
-				log_msg("jobid %d status code %d", jobid, i);
-				break;
+	jobid = 0;
+	if (sscanf(line, "%s %ld", cmd, &jobid) < 1) {
+		fprintf(fp, "error: no command\n");
+	} else if (strcmp(cmd, "status") == 0) {
+		ctl_status(fp);
+	} else if (strcmp(cmd, "jobs") == 0) {
+		ctl_jobs(fp);
+	} else if (strcmp(cmd, "hist") == 0) {
+		ctl_hist(fp);
+	} else if (strcmp(cmd, "cancel") == 0) {
+		usernm = NULL;
+		if (uid != 0 && uid != getuid()) {
+			if ((pwdp = getpwuid(uid)) == NULL) {
+				fprintf(fp, "error: unknown user %ld\n", (long)uid);
+				goto out;
 			}
+			usernm = pwdp->pw_name;
+		}
+		if (jobid <= 0)
+			fprintf(fp, "error: no job ID\n");
+		else if (cancel_job(jobid, usernm) < 0)
+			fprintf(fp, "error: job %ld: %s\n", jobid, errno == ENOENT ?
+			  "not waiting to print" : strerror(errno));
+		else
+			fprintf(fp, "job %ld canceled\n", jobid);
+	} else {
+		fprintf(fp, "error: unknown command %s\n", cmd);
+	}
+out:
+	fclose(fp);
+}
 
-			if (STATCLASS_OK(i))
-				success = 1;
-			break;
+/*
+ * Report on the client threads and each printer.  Only the queue
+ * and connection state need joblock, and we never hold it while
+ * writing to the socket.
+ *
+ * LOCKING: acquires and releases joblock.
+ */
+void
+ctl_status(FILE *fp)
+{
+	struct printer	*pp, *next;
+	int				njobs, busy, connected, nbusypr;
+	time_t			retry, now;
+	long			nwaiting;
+	long long		nbytes, sendus;
+
+	pthread_mutex_lock(&clientlock);
+	nwaiting = nclients;
+	pthread_mutex_unlock(&clientlock);
+	fprintf(fp, "clients: %d threads, %ld busy, %ld waiting, "
+	  "%ld jobs queued (%.1f MB), %ld turned away\n", nclthreads, nbusy,
+	  nwaiting, naccepted, nreceived / 1e6, nrejected);
+
+	nbusypr = 0;
+	now = time(NULL);
+	pthread_mutex_lock(&joblock);
+	pp = printers;
+	pthread_mutex_unlock(&joblock);
+	for (; pp != NULL; pp = next) {
+		pthread_mutex_lock(&joblock);
+		njobs = pp->njobs;
+		busy = pp->busy;
+		connected = pp->sockfd >= 0;
+		retry = pp->retry;
+		next = pp->next;
+		pthread_mutex_unlock(&joblock);
+		nbusypr += busy;
+		nbytes = pp->stats.nbytes;
+		sendus = pp->stats.sendus;
+		fprintf(fp, "printer %s: %d waiting, %s%s, %ld printed "
+		  "(%.1f MB", pp->name, njobs, busy ? "printing" : "idle",
+		  connected ? ", connected" : "", pp->stats.njobs, nbytes / 1e6);
+		if (sendus > 0)
+			fprintf(fp, " at %.1f MB/s", (double)nbytes / sendus);
+		fprintf(fp, "), %ld refused, %ld retries", pp->stats.nfailed,
+		  pp->stats.nretries);
+		if (retry > now)
+			fprintf(fp, ", retrying in %ld s", (long)(retry - now));
+		fputc('\n', fp);
+	}
+	fprintf(fp, "printer threads: %d, %d busy\n", nprthreads, nbusypr);
+}
+
+/*
+ * List the jobs waiting to print.  The jobs for one printer are
+ * copied with joblock held, then written without it.
+ *
+ * LOCKING: acquires and releases joblock.
+ */
+void
+ctl_jobs(FILE *fp)
+{
+	struct printer	*pp, *next;
+	struct flow		*flp;
+	struct job		*jobs;
+	int				i, n, prio;
+	long long		now;
+	static const char	*prnames[NPRIO] = { "high", "normal", "low" };
+
+	now = now_ms();
+	pthread_mutex_lock(&joblock);
+	pp = printers;
+	pthread_mutex_unlock(&joblock);
+	for (; pp != NULL; pp = next) {
+		pthread_mutex_lock(&joblock);
+		if ((jobs = malloc((pp->njobs + 1) * sizeof(struct job))) ==
+		  NULL) {
+			pthread_mutex_unlock(&joblock);
+			fprintf(fp, "error: out of memory\n");
+			return;
+		}
+		n = 0;
+		for (prio = 0; prio < NPRIO; prio++) {
+			if ((flp = pp->turn[prio]) == NULL)
+				continue;
+			do {
+				for (i = 0; i < flp->njobs; i++)
+					jobs[n++] = *flp->heap[i];
+				flp = flp->next;
+			} while (flp != pp->turn[prio]);
+		}
+		next = pp->next;
+		pthread_mutex_unlock(&joblock);
+		for (i = 0; i < n; i++) {
+			fprintf(fp, "%d\t%s\t%s\t%s\t%lu bytes\twaiting %.1f s\t%s\n",
+			  jobs[i].jobid, pp->name, jobs[i].req.usernm,
+			  prnames[job_prio(jobs[i].req.flags)],
+			  (unsigned long)jobs[i].req.size,
+			  (now - jobs[i].queued) / 1e3, jobs[i].req.jobnm);
 		}
+		free(jobs);
 	}
+}
 
-out:
-	free(bp);
-	if (nr < 0) {
-		log_msg("jobid %d: error reading printer response: %s",
-		  jobid, strerror(errno));
+/*
+ * Print the histograms of each printer, up to the last bucket
+ * that isn't empty.
+ *
+ * LOCKING: acquires and releases joblock.
+ */
+void
+ctl_hist(FILE *fp)
+{
+	struct printer	*pp, *next;
+	int				i, last;
+
+	pthread_mutex_lock(&joblock);
+	pp = printers;
+	pthread_mutex_unlock(&joblock);
+	for (; pp != NULL; pp = next) {
+		pthread_mutex_lock(&joblock);
+		next = pp->next;
+		pthread_mutex_unlock(&joblock);
+		fprintf(fp, "printer %s:\n%12s %10s %10s\n", pp->name, "msec",
+		  "waiting", "printing");
+		for (last = NHIST - 1; last > 0; last--)
+			if (pp->stats.waithist[last] != 0 ||
+			  pp->stats.sendhist[last] != 0)
+				break;
+		for (i = 0; i <= last; i++) {
+			if (i == NHIST - 1)
+				fprintf(fp, "%4s %7ld", ">=", 1L << (i - 1));
+			else
+				fprintf(fp, "%4s %7ld", "<", 1L << i);
+			fprintf(fp, " %10ld %10ld\n", pp->stats.waithist[i],
+			  pp->stats.sendhist[i]);
+		}
 	}
-	return(success);
 }
@@ -37,11 +37,13 @@ getaddrlist(const char *host, const char *service,
 /*
  * Given a keyword, scan the configuration file for a match
  * and return the string value corresponding to the keyword.
+ * A keyword can appear more than once; skip says how many
+ * matches to pass over before the one we return.
  *
  * LOCKING: none.
  */
 static char *
-scan_configfile(char *keyword)
+scan_configfile(char *keyword, int skip)
 {
 	int				n, match;
 	FILE			*fp;
@@ -55,7 +57,7 @@ scan_configfile(char *keyword)
 	match = 0;
 	while (fgets(line, MAXCFGLINE, fp) != NULL) {
 		n = sscanf(line, pattern, keybuf, valbuf);
-		if (n == 2 && strcmp(keyword, keybuf) == 0) {
+		if (n == 2 && strcmp(keyword, keybuf) == 0 && skip-- == 0) {
 			match = 1;
 			break;
 		}
@@ -75,30 +77,56 @@ scan_configfile(char *keyword)
 char *
 get_printserver(void)
 {
-	return(scan_configfile("printserver"));
+	return(scan_configfile("printserver", 0));
 }
 
 /*
- * Return the address of the network printer or NULL on error.
+ * Return the value of a numeric parameter from the configuration
+ * file, or defval if it isn't set to a positive number.
+ *
+ * LOCKING: none.
+ */
+int
+get_confignum(char *keyword, int defval)
+{
+	char	*p;
+	int		n;
+
+	if ((p = scan_configfile(keyword, 0)) == NULL || (n = atoi(p)) <= 0)
+		return(defval);
+	return(n);
+}
+
+/*
+ * Return the name of the nth network printer, counting from 0, or
+ * NULL if there are fewer printers.  Each printer has its own
+ * "printer" line in the configuration file; the first one is the
+ * default.  The name is overwritten by the next call.
+ *
+ * LOCKING: none.
+ */
+char *
+get_printer(int n)
+{
+	return(scan_configfile("printer", n));
+}
+
+/*
+ * Return the address of the named network printer or NULL on error.
  *
  * LOCKING: none.
  */
 struct addrinfo *
-get_printaddr(void)
+get_printaddr(const char *name)
 {
 	int				err;
-	char			*p;
 	struct addrinfo	*ailist;
 
-	if ((p = scan_configfile("printer")) != NULL) {
-		if ((err = getaddrlist(p, "ipp", &ailist)) != 0) {
-			log_msg("no address information for %s", p);
-			return(NULL);
-		}
-		return(ailist);
+	if ((err = getaddrlist(name, "ipp", &ailist)) != 0) {
+		log_msg("no address information for %s", name);
+		return(NULL);
 	}
-	log_msg("no printer address specified");
-	return(NULL);
+	return(ailist);
 }
 
 /*
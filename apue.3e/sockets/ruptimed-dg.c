@@ -2,27 +2,104 @@
 #include <netdb.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
 #include <sys/socket.h>
 
 #define BUFLEN		128
 #define MAXADDRLEN	256
+#define VLEN		64		/* most datagrams handled per system call */
+#define MAXTHREADS	64
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
 #endif
 
 extern int initserver(int, const struct sockaddr *, socklen_t, int);
+extern char *get_uptime(int);
 
+int		ttl = 1;	/* seconds an answer is good for */
+
+pthread_mutex_t	uptimelock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Copy the current answer.  The threads share one cached
+ * answer, and whoever finds it stale remakes it.
+ */
 void
-serve(int sockfd)
+copy_uptime(char *buf)
 {
-	int				n;
+	pthread_mutex_lock(&uptimelock);
+	strcpy(buf, get_uptime(ttl));
+	pthread_mutex_unlock(&uptimelock);
+}
+
+#if defined(LINUX)
+
+/*
+ * Read as many requests as are waiting, up to VLEN, with one
+ * system call, and answer them all with another.  MSG_WAITFORONE
+ * blocks only until the first arrives.
+ */
+void *
+serve(void *arg)
+{
+	int						i, n, m, sockfd;
+	char					ans[BUFLEN];
+	struct iovec			ansiov;
+	struct iovec			iov[VLEN];
+	struct mmsghdr			msgs[VLEN];
+	struct sockaddr_storage	addrs[VLEN];
+	char					bufs[VLEN][BUFLEN];
+
+	sockfd = (long)arg;
+	set_cloexec(sockfd);
+	ansiov.iov_base = ans;
+	for (;;) {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < VLEN; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = BUFLEN;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if ((n = recvmmsg(sockfd, msgs, VLEN, MSG_WAITFORONE, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "ruptimed: recvmmsg error: %s",
+			  strerror(errno));
+			exit(1);
+		}
+
+		/*
+		 * Everyone gets the same answer, sent back to the address
+		 * (and length) recvmmsg filled in.
+		 */
+		copy_uptime(ans);
+		ansiov.iov_len = strlen(ans);
+		for (i = 0; i < n; i++)
+			msgs[i].msg_hdr.msg_iov = &ansiov;
+		for (i = 0; i < n; i += m)
+			if ((m = sendmmsg(sockfd, &msgs[i], n - i, 0)) < 0)
+				m = 1;		/* skip the one that failed */
+	}
+	return((void *)0);
+}
+
+#else
+
+void *
+serve(void *arg)
+{
+	int				n, sockfd;
 	socklen_t		alen;
-	FILE			*fp;
 	char			buf[BUFLEN];
+	char			ans[BUFLEN];
 	char			abuf[MAXADDRLEN];
 	struct sockaddr	*addr = (struct sockaddr *)abuf;
 
+	sockfd = (long)arg;
 	set_cloexec(sockfd);
 	for (;;) {
 		alen = MAXADDRLEN;
@@ -31,15 +108,44 @@ serve(int sockfd)
 			  strerror(errno));
 			exit(1);
 		}
-		if ((fp = popen("/usr/bin/uptime", "r")) == NULL) {
-			sprintf(buf, "error: %s\n", strerror(errno));
-			sendto(sockfd, buf, strlen(buf), 0, addr, alen);
-		} else {
-			if (fgets(buf, BUFLEN, fp) != NULL)
-				sendto(sockfd, buf, strlen(buf), 0, addr, alen);
-			pclose(fp);
-		}
+		copy_uptime(ans);
+		sendto(sockfd, ans, strlen(ans), 0, addr, alen);
 	}
+	return((void *)0);
+}
+
+#endif
+
+/*
+ * A datagram socket bound to addr with SO_REUSEPORT set.  Several
+ * can be bound to the same address, and the kernel spreads the
+ * datagrams across them, so each thread can have its own.
+ */
+int
+reuseport_socket(const struct sockaddr *addr, socklen_t alen)
+{
+#if defined(SO_REUSEPORT)
+	int fd, err;
+	int reuse = 1;
+
+	if ((fd = socket(addr->sa_family, SOCK_DGRAM, 0)) < 0)
+		return(-1);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+	  sizeof(int)) < 0)
+		goto errout;
+	if (bind(fd, addr, alen) < 0)
+		goto errout;
+	return(fd);
+
+errout:
+	err = errno;
+	close(fd);
+	errno = err;
+	return(-1);
+#else
+	errno = EOPNOTSUPP;
+	return(-1);
+#endif
 }
 
 int
@@ -47,11 +153,33 @@ main(int argc, char *argv[])
 {
 	struct addrinfo	*ailist, *aip;
 	struct addrinfo	hint;
-	int				sockfd, err, n;
+	int				sockfd, err, n, c, i, nthreads;
+	pthread_t		tid;
 	char			*host;
 
-	if (argc != 1)
-		err_quit("usage: ruptimed");
+	err = 0;
+	nthreads = 1;
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			nthreads = atoi(optarg);
+			break;
+
+		case 't':
+			ttl = atoi(optarg);
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || optind != argc || nthreads < 1 || nthreads > MAXTHREADS)
+		err_quit("usage: ruptimed-dg [-n nthreads] [-t ttl]");
+#if !defined(SO_REUSEPORT)
+	if (nthreads > 1)
+		err_quit("can't run more than one thread without SO_REUSEPORT");
+#endif
 	if ((n = sysconf(_SC_HOST_NAME_MAX)) < 0)
 		n = HOST_NAME_MAX;	/* best guess */
 	if ((host = malloc(n)) == NULL)
@@ -71,11 +199,33 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 	for (aip = ailist; aip != NULL; aip = aip->ai_next) {
-		if ((sockfd = initserver(SOCK_DGRAM, aip->ai_addr,
-		  aip->ai_addrlen, 0)) >= 0) {
-			serve(sockfd);
-			exit(0);
+		if (nthreads > 1)
+			sockfd = reuseport_socket(aip->ai_addr, aip->ai_addrlen);
+		else
+			sockfd = initserver(SOCK_DGRAM, aip->ai_addr,
+			  aip->ai_addrlen, 0);
+		if (sockfd < 0)
+			continue;
+
+		/*
+		 * Each extra thread gets a socket of its own.
+		 */
+		for (i = 1; i < nthreads; i++) {
+			if ((n = reuseport_socket(aip->ai_addr,
+			  aip->ai_addrlen)) < 0) {
+				syslog(LOG_ERR, "ruptimed: can't bind: %s",
+				  strerror(errno));
+				exit(1);
+			}
+			if ((err = pthread_create(&tid, NULL, serve,
+			  (void *)(long)n)) != 0) {
+				syslog(LOG_ERR, "ruptimed: can't create thread: %s",
+				  strerror(err));
+				exit(1);
+			}
 		}
+		serve((void *)(long)sockfd);
+		exit(0);
 	}
 	exit(1);
 }
@@ -2,54 +2,145 @@
 #include <netdb.h>
 #include <errno.h>
 #include <syslog.h>
+#include <fcntl.h>
 #include <sys/socket.h>
+#if defined(LINUX)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
-#define BUFLEN	128
-#define QLEN 10
+#define QLEN		128
+#define MAXLISTEN	8		/* most addresses we listen on */
+#define ACCEPT_MAX	64		/* most clients answered per wakeup */
 
 #ifndef HOST_NAME_MAX
 #define HOST_NAME_MAX 256
 #endif
 
 extern int initserver(int, const struct sockaddr *, socklen_t, int);
+extern char *get_uptime(int);
+
+int		ttl = 1;	/* seconds an answer is good for */
 
+/*
+ * Answer the clients waiting on a listening socket, up to
+ * ACCEPT_MAX of them, so one busy address can't starve another.
+ * The answer is short enough to fit in an empty socket buffer,
+ * so the send never blocks.
+ */
 void
-serve(int sockfd)
+answer(int sockfd)
 {
-	int		clfd;
-	FILE	*fp;
-	char	buf[BUFLEN];
+	int		i, clfd;
+	char	*buf;
 
-	set_cloexec(sockfd);
-	for (;;) {
+	for (i = 0; i < ACCEPT_MAX; i++) {
 		if ((clfd = accept(sockfd, NULL, NULL)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+			  errno == ECONNABORTED || errno == EINTR)
+				return;
 			syslog(LOG_ERR, "ruptimed: accept error: %s",
 			  strerror(errno));
+			if (errno == EMFILE || errno == ENFILE)
+				return;
 			exit(1);
 		}
-		set_cloexec(clfd);
-		if ((fp = popen("/usr/bin/uptime", "r")) == NULL) {
-			sprintf(buf, "error: %s\n", strerror(errno));
-			send(clfd, buf, strlen(buf), 0);
-		} else {
-			while (fgets(buf, BUFLEN, fp) != NULL)
-				send(clfd, buf, strlen(buf), 0);
-			pclose(fp);
-		}
+		buf = get_uptime(ttl);
+		send(clfd, buf, strlen(buf), 0);
 		close(clfd);
 	}
 }
 
+#if defined(LINUX)
+
+void
+serve(int *fds, int nfds)
+{
+	int					i, n, epfd;
+	struct epoll_event	ev[MAXLISTEN];
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		syslog(LOG_ERR, "ruptimed: epoll_create1 error: %s",
+		  strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < nfds; i++) {
+		ev[0].events = EPOLLIN;
+		ev[0].data.fd = fds[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev[0]) < 0) {
+			syslog(LOG_ERR, "ruptimed: epoll_ctl error: %s",
+			  strerror(errno));
+			exit(1);
+		}
+	}
+	for (;;) {
+		if ((n = epoll_wait(epfd, ev, MAXLISTEN, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "ruptimed: epoll_wait error: %s",
+			  strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < n; i++)
+			answer(ev[i].data.fd);
+	}
+}
+
+#else
+
+/*
+ * The same, with poll.
+ */
+void
+serve(int *fds, int nfds)
+{
+	int				i;
+	struct pollfd	pfd[MAXLISTEN];
+
+	for (i = 0; i < nfds; i++) {
+		pfd[i].fd = fds[i];
+		pfd[i].events = POLLIN;
+	}
+	for (;;) {
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "ruptimed: poll error: %s",
+			  strerror(errno));
+			exit(1);
+		}
+		for (i = 0; i < nfds; i++)
+			if (pfd[i].revents & POLLIN)
+				answer(pfd[i].fd);
+	}
+}
+
+#endif
+
 int
 main(int argc, char *argv[])
 {
 	struct addrinfo	*ailist, *aip;
 	struct addrinfo	hint;
-	int				sockfd, err, n;
+	int				sockfd, err, n, c, nfds;
+	int				fds[MAXLISTEN];
 	char			*host;
 
-	if (argc != 1)
-		err_quit("usage: ruptimed");
+	err = 0;
+	while ((c = getopt(argc, argv, "t:")) != -1) {
+		switch (c) {
+		case 't':
+			ttl = atoi(optarg);
+			break;
+
+		case '?':
+			err = 1;
+			break;
+		}
+	}
+	if (err || optind != argc)
+		err_quit("usage: ruptimed [-t ttl]");
 	if ((n = sysconf(_SC_HOST_NAME_MAX)) < 0)
 		n = HOST_NAME_MAX;	/* best guess */
 	if ((host = malloc(n)) == NULL)
@@ -57,6 +148,10 @@ main(int argc, char *argv[])
 	if (gethostname(host, n) < 0)
 		err_sys("gethostname error");
 	daemonize("ruptimed");
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {	/* client reset */
+		syslog(LOG_ERR, "ruptimed: can't ignore SIGPIPE");
+		exit(1);
+	}
 	memset(&hint, 0, sizeof(hint));
 	hint.ai_flags = AI_CANONNAME;
 	hint.ai_socktype = SOCK_STREAM;
@@ -68,12 +163,24 @@ main(int argc, char *argv[])
 		  gai_strerror(err));
 		exit(1);
 	}
-	for (aip = ailist; aip != NULL; aip = aip->ai_next) {
+
+	/*
+	 * Listen on every address we can, not just the first.
+	 * The sockets don't block, so a client that gives up
+	 * between poll and accept can't hang us.
+	 */
+	nfds = 0;
+	for (aip = ailist; aip != NULL && nfds < MAXLISTEN;
+	  aip = aip->ai_next) {
 		if ((sockfd = initserver(SOCK_STREAM, aip->ai_addr,
 		  aip->ai_addrlen, QLEN)) >= 0) {
-			serve(sockfd);
-			exit(0);
+			set_cloexec(sockfd);
+			set_fl(sockfd, O_NONBLOCK);
+			fds[nfds++] = sockfd;
 		}
 	}
-	exit(1);
+	if (nfds == 0)
+		exit(1);
+	serve(fds, nfds);
+	exit(0);
 }
@@ -0,0 +1,108 @@
+#include "apue.h"
+#include <errno.h>
+#include <time.h>
+#if defined(LINUX)
+#include <utmpx.h>
+#endif
+
+#define BUFLEN	128
+
+static char		answer[BUFLEN];
+static time_t	made;		/* when answer was made; 0 if never */
+
+#if defined(LINUX)
+
+/*
+ * Make the line uptime(1) prints ourselves, from /proc and the
+ * utmp file, instead of running it.
+ */
+static int
+make_answer(char *buf)
+{
+	int				n, nusers;
+	long			up;
+	double			uptime, load[3];
+	time_t			now;
+	FILE			*fp;
+	struct utmpx	*ut;
+
+	if ((fp = fopen("/proc/uptime", "r")) == NULL)
+		return(-1);
+	n = fscanf(fp, "%lf", &uptime);
+	fclose(fp);
+	if (n != 1) {
+		errno = EINVAL;
+		return(-1);
+	}
+	if ((fp = fopen("/proc/loadavg", "r")) == NULL)
+		return(-1);
+	n = fscanf(fp, "%lf %lf %lf", &load[0], &load[1], &load[2]);
+	fclose(fp);
+	if (n != 3) {
+		errno = EINVAL;
+		return(-1);
+	}
+	nusers = 0;
+	setutxent();
+	while ((ut = getutxent()) != NULL)
+		if (ut->ut_type == USER_PROCESS)
+			nusers++;
+	endutxent();
+
+	time(&now);
+	n = strftime(buf, BUFLEN, " %H:%M:%S up ", localtime(&now));
+	up = uptime / 60;		/* minutes */
+	if (up >= 24 * 60)
+		n += sprintf(buf + n, "%ld day%s, ", up / (24 * 60),
+		  up / (24 * 60) == 1 ? "" : "s");
+	up %= 24 * 60;
+	if (up >= 60)
+		n += sprintf(buf + n, "%2ld:%02ld, ", up / 60, up % 60);
+	else
+		n += sprintf(buf + n, "%ld min, ", up);
+	sprintf(buf + n, " %d user%s,  load average: %.2f, %.2f, %.2f\n",
+	  nusers, nusers == 1 ? "" : "s", load[0], load[1], load[2]);
+	return(0);
+}
+
+#else
+
+/*
+ * Elsewhere there's no /proc to read, so run uptime(1).
+ */
+static int
+make_answer(char *buf)
+{
+	FILE	*fp;
+	int		rval;
+
+	if ((fp = popen("/usr/bin/uptime", "r")) == NULL)
+		return(-1);
+	rval = fgets(buf, BUFLEN, fp) == NULL ? -1 : 0;
+	pclose(fp);
+	return(rval);
+}
+
+#endif
+
+/*
+ * Return the line to send a client: what uptime(1) would say.
+ * The answer is made at most once every ttl seconds; everyone
+ * who asks in the meantime gets the same one.
+ */
+char *
+get_uptime(int ttl)
+{
+	time_t	now;
+
+	time(&now);
+	if (made != 0 && now - made < ttl)
+		return(answer);
+	if (make_answer(answer) < 0) {
+		sprintf(answer, "error: %s\n", strerror(errno));
+		made = 0;
+	} else {
+		made = now;
+	}
+	return(answer);
+}
@@ -1,17 +1,181 @@
+#define _GNU_SOURCE     // copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "apue.h"           // uring_copy
+#ifdef __linux__
+#include <linux/fs.h>       // FICLONE
+#include <sys/sendfile.h>
+#endif
 
 #define BUF_SIZE 4096
+#define CHUNK (1 << 30)     // copy_file_range/sendfile 한 번에 요청할 크기
+
+enum { REFLINK_NEVER, REFLINK_AUTO, REFLINK_ALWAYS };
+
+int depth = 8;              // -q: io_uring 에 동시에 걸어 둘 버퍼 수 (0이면 쓰지 않음)
+
+#ifdef __linux__
+// 이 파일 시스템에서 지원하지 않는 방법이라 다음 방법으로 넘어가도 되는 오류인지
+int unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTSUP || err == ENOSYS || err == EXDEV ||
+           err == EINVAL || err == ENOTTY || err == EBADF;
+}
+#endif
+
+// 한 번에 요청할 크기 (len < 0 이면 파일 끝까지)
+size_t chunk(off_t len, size_t max) {
+    return (len < 0 || (off_t)max < len) ? max : (size_t)len;
+}
+
+// 현재 오프셋에서 len 바이트를 copy_file_range -> sendfile -> io_uring -> read/write 순서로 복사
+// (kernel 이 0이면 read/write 만 사용)
+int copy_range(int src, int dst, off_t len, int kernel) {
+    char buf[BUF_SIZE];
+    ssize_t n = 0, w;
+    char *p;
+    struct stat st;
+    off_t off;
+    int r;
+
+#ifdef __linux__
+    while (kernel && len != 0 && (n = copy_file_range(src, NULL, dst, NULL, chunk(len, CHUNK), 0)) > 0)
+        if (len > 0) len -= n;
+    if (kernel && (len == 0 || n == 0))
+        return 0;
+    if (kernel && !unsupported(errno))
+        return -1;
+    while (kernel && len != 0 && (n = sendfile(dst, src, NULL, chunk(len, CHUNK))) > 0)
+        if (len > 0) len -= n;
+    if (kernel && (len == 0 || n == 0))
+        return 0;
+    if (kernel && !unsupported(errno))
+        return -1;
+#endif
+
+    // 둘 다 안 되면 io_uring 으로 읽기/쓰기를 depth 개씩 겹쳐서 (같은 오프셋에 씀)
+    if (kernel && depth > 0 && (off = lseek(src, 0, SEEK_CUR)) >= 0 && lseek(dst, off, SEEK_SET) >= 0) {
+        if (len < 0 && fstat(src, &st) == 0)
+            len = st.st_size > off ? st.st_size - off : 0;
+        if (len > BUF_SIZE && (r = uring_copy(src, dst, off, len, depth, NULL, NULL)) != -2) {
+            if (r < 0 || lseek(src, off + len, SEEK_SET) < 0 || lseek(dst, off + len, SEEK_SET) < 0)
+                return -1;
+            return 0;
+        }
+    }                                           // -2: io_uring 을 쓸 수 없으면 read/write 로
+
+    while (len != 0 && (n = read(src, buf, chunk(len, BUF_SIZE))) > 0) {   // 앞에서 복사한 곳부터 이어서
+        if (len > 0) len -= n;
+        for (p = buf; n > 0; p += w, n -= w) {
+            if ((w = write(dst, p, n)) < 0)
+                return -1;
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+// 0으로만 된 블록은 쓰지 않고 건너뛰어 구멍으로 남김 (SEEK_DATA 를 못 쓰는 경우)
+int copy_zeros(int src, int dst) {
+    char buf[BUF_SIZE];
+    ssize_t n, w;
+    off_t end;
+    char *p;
+
+    while ((n = read(src, buf, BUF_SIZE)) > 0) {
+        if (buf[0] == 0 && memcmp(buf, buf + 1, n - 1) == 0) {    // 블록 전체가 0
+            if (lseek(dst, n, SEEK_CUR) < 0)
+                return -1;
+            continue;
+        }
+        for (p = buf; n > 0; p += w, n -= w) {
+            if ((w = write(dst, p, n)) < 0)
+                return -1;
+        }
+    }
+    if (n < 0 || (end = lseek(dst, 0, SEEK_CUR)) < 0)
+        return -1;
+    return ftruncate(dst, end);                 // 끝의 구멍은 크기만 맞춤
+}
+
+// 구멍이 있는 파일: SEEK_DATA/SEEK_HOLE 로 찾은 데이터 구간만 같은 오프셋에 복사
+int copy_sparse(int src, int dst, off_t size) {
+#ifdef SEEK_DATA
+    off_t data, hole;
+
+    for (hole = 0; hole < size; ) {
+        if ((data = lseek(src, hole, SEEK_DATA)) < 0) {
+            if (errno == ENXIO)                 // 나머지는 모두 구멍
+                break;
+            if (errno == EINVAL && hole == 0)   // SEEK_DATA 를 지원하지 않는 파일 시스템
+                return copy_zeros(src, dst);
+            return -1;
+        }
+        if ((hole = lseek(src, data, SEEK_HOLE)) < 0 ||
+            lseek(src, data, SEEK_SET) < 0 || lseek(dst, data, SEEK_SET) < 0)
+            return -1;
+        if (copy_range(src, dst, hole - data, 1) < 0)
+            return -1;
+    }
+    return ftruncate(dst, size);                // 건너뛴 곳은 구멍으로 남음
+#else
+    (void)size;
+    return copy_zeros(src, dst);
+#endif
+}
+
+// 리플링크를 먼저 시도하고, 안 되면 구멍을 유지하며 복사
+int copy_data(int src, int dst, int reflink) {
+    struct stat st;
+
+#ifdef __linux__
+    if (reflink != REFLINK_NEVER) {
+        if (ioctl(dst, FICLONE, src) == 0)      // 블록 공유, 데이터는 복사하지 않음
+            return 0;
+        if (reflink == REFLINK_ALWAYS || !unsupported(errno))
+            return -1;
+    }
+#else
+    if (reflink == REFLINK_ALWAYS) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+#endif
+    if (fstat(src, &st) < 0)
+        return -1;
+    if (st.st_size > 0 && (off_t)st.st_blocks * 512 < st.st_size)   // 할당된 블록이 크기보다 적음
+        return copy_sparse(src, dst, st.st_size);
+    return copy_range(src, dst, -1, st.st_size > 0);    // /proc 파일 등은 크기가 0이라 read/write 로
+}
 
 int main(int argc, char *argv[]) {
     int src, dst;
-    ssize_t nread;
-    char buf[BUF_SIZE];
+    int reflink = REFLINK_AUTO;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <source> <destination>\n", argv[0]);
+    // 선택 인자: -q depth, --reflink[=auto|always|never]
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-q") == 0 && argc > 2) {
+            depth = atoi(argv[2]);
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--reflink") == 0 || strcmp(argv[1], "--reflink=always") == 0)
+            reflink = REFLINK_ALWAYS;
+        else if (strcmp(argv[1], "--reflink=auto") == 0)
+            reflink = REFLINK_AUTO;
+        else if (strcmp(argv[1], "--reflink=never") == 0)
+            reflink = REFLINK_NEVER;
+        else
+            break;                              // 잘못된 옵션이면 사용법 출력
+        argv++;
+        argc--;
+    }
+
+    if (argc != 3 || depth < 0) {
+        fprintf(stderr, "Usage: minicp [-q depth] [--reflink[=auto|always|never]] <source> <destination>\n");
         exit(1);
     }
 
@@ -28,15 +192,12 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    while ((nread = read(src, buf, BUF_SIZE)) > 0) {
-        if (write(dst, buf, nread) != nread) {
-            perror("write");
-            close(src);
-            close(dst);
-            exit(1);
-        }
+    if (copy_data(src, dst, reflink) < 0) {
+        perror("copy");
+        close(src);
+        close(dst);
+        exit(1);
     }
-    if (nread < 0) perror("read");
 
     close(src);
     close(dst);
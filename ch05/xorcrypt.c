@@ -1,15 +1,34 @@
 #include "apue.h"
 #include <fcntl.h>
 #include <unistd.h>
+
+// uring_copy 가 버퍼를 읽을 때마다 호출하는 변환 함수 (arg 는 키)
+void xor_buf(unsigned char *p, size_t n, void *arg) {
+    unsigned char key = *(unsigned char *)arg;
+    for (size_t i = 0; i < n; i++)
+        p[i] ^= key;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <key> <input> <output>\n", argv[0]); 
+    int depth = 8; // -q: io_uring 에 동시에 걸어 둘 버퍼 수 (0이면 read/write 만 사용)
+    int c;
+    while ((c = getopt(argc, argv, "q:")) != -1) {
+        if (c != 'q') {
+            argc = 0; // 사용법 출력
+            break;
+        }
+        depth = atoi(optarg);
+    }
+    if (argc - optind != 3 || depth < 0) {
+        fprintf(stderr, "Usage: %s [-q depth] <key> <input> <output>\n", argv[0]);
         exit(1);
     }
+    argv += optind - 1; // 아래는 옵션이 없을 때와 같은 argv[1..3] 사용
     unsigned char key = (unsigned char)argv[1][0]; // 첫 문자를 키로 사용
     int fdin, fdout;
     char buf[4096]; // 읽기/쓰기 버퍼
     ssize_t n;
+    struct stat st;
 
     // (1) 입력 파일 열기 → open(???, ???)
     // TODO: O_RDONLY 사용
@@ -21,14 +40,22 @@ int main(int argc, char *argv[]) {
     if ((fdout = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
         err_sys("Failed to open output file");
 
-    // (3) read → for 루프에서 XOR 변환 → write
-    while ((n = read(fdin, buf, sizeof(buf))) > 0) {
+    // (3) io_uring 으로 읽기/변환/쓰기를 depth 개씩 겹쳐서 처리
+    //     io_uring 을 쓸 수 없으면 (-2) 아래의 read/write 루프로
+    int r = -2;
+    if (depth > 0 && fstat(fdin, &st) == 0 && S_ISREG(st.st_mode))
+        r = uring_copy(fdin, fdout, 0, st.st_size, depth, xor_buf, &key);
+    if (r == -1)
+        err_sys("io_uring copy failed");
+
+    // read → for 루프에서 XOR 변환 → write
+    while (r == -2 && (n = read(fdin, buf, sizeof(buf))) > 0) {
         for (ssize_t i = 0; i < n; i++)
             buf[i] ^= key;   // XOR 변환
         if (write(fdout, buf, n) != n)
             err_sys("Write failed");
     }
-    if (n < 0)
+    if (r == -2 && n < 0)
         err_sys("Read failed");
 
     // (4) 파일 디스크립터 닫기 → close(???)